@@ -0,0 +1,52 @@
+#include "BlockingPool.hpp"
+
+#include "logging.hpp"
+
+namespace cdnalizerd {
+
+BlockingPool::BlockingPool(std::size_t threadCount) {
+  LOG_S(1) << "Starting " << threadCount << " threads for blocking work";
+  for (std::size_t i = 0; i != threadCount; ++i)
+    threads.emplace_back([this]() { run(); });
+}
+
+BlockingPool::~BlockingPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+void BlockingPool::post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  wake.notify_one();
+}
+
+void BlockingPool::run() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      if (tasks.empty())
+        return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+BlockingPool *_global_blocking_pool(nullptr);
+
+void blockingPool(BlockingPool *pool) { _global_blocking_pool = pool; }
+
+BlockingPool *blockingPool() { return _global_blocking_pool; }
+
+} /* cdnalizerd  */
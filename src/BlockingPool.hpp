@@ -0,0 +1,118 @@
+#pragma once
+/// A fixed size pool of threads for work that would otherwise block the
+/// io_service thread: hashing, stats and directory walks.
+///
+/// Coroutines hand work over with runBlocking() and sleep until it's done, so
+/// connections and the inotify reader keep going in the mean time.
+
+#include "common.hpp"
+#include "https.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/optional.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cdnalizerd {
+
+class BlockingPool {
+private:
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> threads;
+  bool stopping = false;
+  void run();
+
+public:
+  /// Starts 'threadCount' threads. This is the most blocking work that will
+  /// ever happen at once; anything more waits in the queue
+  explicit BlockingPool(std::size_t threadCount);
+  BlockingPool(const BlockingPool &) = delete;
+  /// Finishes anything already queued, then stops the threads
+  ~BlockingPool();
+  /// Queues 'task' to be run on one of our threads
+  void post(std::function<void()> task);
+  std::size_t size() const { return threads.size(); }
+};
+
+/// Sets the process wide blocking pool. nullptr means blocking work just runs
+/// in place
+void blockingPool(BlockingPool *pool);
+/// The process wide blocking pool, or nullptr if there isn't one
+BlockingPool *blockingPool();
+
+namespace detail {
+
+/// What came back from the pool: either a value or an exception
+template <typename T> struct Outcome {
+  boost::optional<T> value;
+  std::exception_ptr error;
+  template <typename Work> void run(Work &work) {
+    try {
+      value.emplace(work());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  T get() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <> struct Outcome<void> {
+  std::exception_ptr error;
+  template <typename Work> void run(Work &work) {
+    try {
+      work();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  void get() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+} /* detail */
+
+/// Runs 'work' on the blocking pool and suspends the calling coroutine until
+/// it's finished. Returns what 'work' returned, or rethrows what it threw.
+/// 'work' runs on another thread, so it mustn't touch anything that the
+/// io_service thread could be using at the same time.
+template <typename Work>
+auto runBlocking(yield_context yield, Work work) -> decltype(work()) {
+  using Outcome = detail::Outcome<decltype(work())>;
+  BlockingPool *pool = blockingPool();
+  if (pool == nullptr)
+    return work();
+  boost::asio::async_completion<yield_context,
+                                void(boost::system::error_code, Outcome)>
+      init(yield);
+  asio::io_service &ios(service());
+  pool->post([
+    work = std::move(work), handler = std::move(init.completion_handler), &ios,
+    // Stop ios.run() returning while we're away
+    keepAlive = asio::io_service::work(ios)
+  ]() mutable {
+    Outcome outcome;
+    outcome.run(work);
+    ios.post([ handler = std::move(handler),
+               outcome = std::move(outcome) ]() mutable {
+      handler(boost::system::error_code(), std::move(outcome));
+    });
+  });
+  return init.result.get().get();
+}
+
+} /* cdnalizerd  */
@@ -0,0 +1,240 @@
+#include "DirectoryTree.hpp"
+
+#include <boost/functional/hash.hpp>
+
+#include <cstring>
+
+namespace cdnalizerd {
+
+namespace {
+
+constexpr DirectoryTree::Node absoluteRoot = 0;
+constexpr DirectoryTree::Node relativeRoot = 1;
+
+DirectoryTree::Node rootOf(boost::string_view path) {
+  return (!path.empty() && (path.front() == '/')) ? absoluteRoot
+                                                  : relativeRoot;
+}
+
+/// Cuts the last name off 'path' and returns it, leaving its parent directory
+boost::string_view lastName(boost::string_view &path) {
+  while (!path.empty() && (path.back() == '/'))
+    path.remove_suffix(1);
+  std::size_t slash = path.rfind('/');
+  boost::string_view result;
+  if (slash == boost::string_view::npos) {
+    result = path;
+    path.clear();
+  } else {
+    result = path.substr(slash + 1);
+    path = path.substr(0, slash);
+  }
+  return result;
+}
+
+/// Cuts the first name off 'path' and returns it. Skips doubled up slashes
+/// and '.'. Returns an empty name when there are no more
+boost::string_view firstName(boost::string_view &path) {
+  while (!path.empty()) {
+    std::size_t slash = path.find('/');
+    boost::string_view result(path.substr(0, slash));
+    if (slash == boost::string_view::npos)
+      path.clear();
+    else
+      path.remove_prefix(slash + 1);
+    if (!result.empty() && (result != "."))
+      return result;
+  }
+  return {};
+}
+
+} /* anonymous namespace */
+
+std::size_t DirectoryTree::NameHash::
+operator()(boost::string_view name) const {
+  return boost::hash_range(name.begin(), name.end());
+}
+
+DirectoryTree::DirectoryTree() {
+  std::uint32_t empty = intern("");
+  // The roots are always used, so they never go away
+  nodes.push_back({none, empty, none, none, none, 1});
+  nodes.push_back({none, empty, none, none, none, 1});
+}
+
+std::uint32_t DirectoryTree::intern(boost::string_view name) {
+  auto found = nameIds.find(name);
+  if (found != nameIds.end())
+    return found->second;
+  names.emplace_back(name.data(), name.size());
+  std::uint32_t id = names.size() - 1;
+  nameIds.emplace(names.back(), id);
+  return id;
+}
+
+void DirectoryTree::link(Node node, Node parent, std::uint32_t name) {
+  Entry &entry = nodes[node];
+  entry.parent = parent;
+  entry.name = name;
+  entry.previous = none;
+  entry.next = nodes[parent].firstChild;
+  if (entry.next != none)
+    nodes[entry.next].previous = node;
+  nodes[parent].firstChild = node;
+  children.emplace(key(parent, name), node);
+}
+
+void DirectoryTree::unlink(Node node) {
+  Entry &entry = nodes[node];
+  children.erase(key(entry.parent, entry.name));
+  if (entry.previous == none)
+    nodes[entry.parent].firstChild = entry.next;
+  else
+    nodes[entry.previous].next = entry.next;
+  if (entry.next != none)
+    nodes[entry.next].previous = entry.previous;
+}
+
+DirectoryTree::Node DirectoryTree::child(Node parent,
+                                         boost::string_view name) const {
+  auto id = nameIds.find(name);
+  if (id == nameIds.end())
+    return none;
+  auto found = children.find(key(parent, id->second));
+  return (found == children.end()) ? none : found->second;
+}
+
+DirectoryTree::Node DirectoryTree::makeChild(Node parent,
+                                             boost::string_view name) {
+  std::uint32_t id = intern(name);
+  Node node;
+  if (unused.empty()) {
+    node = nodes.size();
+    nodes.emplace_back();
+  } else {
+    node = unused.back();
+    unused.pop_back();
+  }
+  nodes[node].firstChild = none;
+  nodes[node].uses = 0;
+  link(node, parent, id);
+  return node;
+}
+
+DirectoryTree::Node DirectoryTree::locate(boost::string_view path) const {
+  Node node = rootOf(path);
+  for (boost::string_view name = firstName(path);
+       !name.empty() && (node != none); name = firstName(path))
+    node = child(node, name);
+  return node;
+}
+
+DirectoryTree::Node DirectoryTree::make(Node node, boost::string_view path) {
+  for (boost::string_view name = firstName(path); !name.empty();
+       name = firstName(path)) {
+    Node next = child(node, name);
+    node = (next == none) ? makeChild(node, name) : next;
+  }
+  return node;
+}
+
+void DirectoryTree::prune(Node node) {
+  while ((node != absoluteRoot) && (node != relativeRoot) &&
+         (nodes[node].uses == 0) && (nodes[node].firstChild == none)) {
+    Node parent = nodes[node].parent;
+    unlink(node);
+    unused.push_back(node);
+    node = parent;
+  }
+}
+
+DirectoryTree::Node DirectoryTree::add(boost::string_view path) {
+  Node node = make(rootOf(path), path);
+  ++nodes[node].uses;
+  return node;
+}
+
+void DirectoryTree::remove(Node node) {
+  if (nodes[node].uses != 0)
+    --nodes[node].uses;
+  prune(node);
+}
+
+DirectoryTree::Node DirectoryTree::find(boost::string_view path) const {
+  Node node = locate(path);
+  return ((node != none) && (nodes[node].uses != 0)) ? node : none;
+}
+
+bool DirectoryTree::move(boost::string_view from, boost::string_view to) {
+  Node node = locate(from);
+  if ((node == none) || (node == absoluteRoot) || (node == relativeRoot))
+    return false;
+  Node root = rootOf(to);
+  boost::string_view name(lastName(to));
+  if (name.empty())
+    return false;
+  Node parent = make(root, to);
+  if (child(parent, name) != none) {
+    prune(parent);
+    return false;
+  }
+  Node oldParent = nodes[node].parent;
+  unlink(node);
+  link(node, parent, intern(name));
+  prune(oldParent);
+  return true;
+}
+
+bool DirectoryTree::contains(Node ancestor, Node node) const {
+  for (; node != none; node = nodes[node].parent)
+    if (node == ancestor)
+      return true;
+  return false;
+}
+
+std::vector<DirectoryTree::Node> DirectoryTree::under(Node top) const {
+  std::vector<Node> result{top};
+  // Each one's children go on the end, so the list is its own work queue
+  for (std::size_t i = 0; i != result.size(); ++i)
+    for (Node child = nodes[result[i]].firstChild; child != none;
+         child = nodes[child].next)
+      result.push_back(child);
+  return result;
+}
+
+std::string DirectoryTree::path(Node node) const {
+  std::string result;
+  appendPath(node, result);
+  return result;
+}
+
+void DirectoryTree::appendPath(Node node, std::string &out) const {
+  // Work out how long it is first, then fill it in from the end, as we go up
+  // the tree
+  std::size_t length = 0;
+  Node top = node;
+  for (; (top != absoluteRoot) && (top != relativeRoot);
+       top = nodes[top].parent)
+    length += 1 + names[nodes[top].name].size();
+  if (top == relativeRoot) {
+    // No leading slash
+    if (length != 0)
+      --length;
+  } else if (length == 0) {
+    out.push_back('/');
+    return;
+  }
+  std::size_t start = out.size();
+  out.resize(start + length);
+  char *end = &out[start] + length;
+  for (; (node != absoluteRoot) && (node != relativeRoot);
+       node = nodes[node].parent) {
+    const std::string &name = names[nodes[node].name];
+    end -= name.size();
+    std::memcpy(end, name.data(), name.size());
+    if (nodes[node].parent != relativeRoot)
+      *--end = '/';
+  }
+}
+
+} /* cdnalizerd  */
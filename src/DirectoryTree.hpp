@@ -0,0 +1,101 @@
+#pragma once
+/// The directories we watch, as a tree of names. Each directory is a small
+/// node holding its parent and its name, and each name is only stored once
+/// however many directories share it; full paths are put back together when
+/// they're needed. Moving a directory only changes its own node. Each node
+/// also links to its children, so what's under a directory can be found
+/// without looking at the rest of the tree.
+
+#include <boost/utility/string_view.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cdnalizerd {
+
+class DirectoryTree {
+public:
+  using Node = std::uint32_t;
+  static constexpr Node none = std::numeric_limits<Node>::max();
+
+private:
+  struct Entry {
+    Node parent;
+    std::uint32_t name;
+    // Our children are a list, threaded through their 'previous' and 'next'
+    Node firstChild;
+    Node previous;
+    Node next;
+    // How many times we've been add()ed and not remove()d
+    std::uint32_t uses;
+  };
+  struct NameHash {
+    std::size_t operator()(boost::string_view name) const;
+  };
+  // Indexed by Node. The first two are the roots: '/' for absolute paths and
+  // '' for relative ones
+  std::vector<Entry> nodes;
+  // Nodes we've removed, to reuse
+  std::vector<Node> unused;
+  // Interned names; the deque never moves them, so the keys of 'nameIds' can
+  // point into it. Names are never forgotten, there aren't that many
+  // different ones
+  std::deque<std::string> names;
+  std::unordered_map<boost::string_view, std::uint32_t, NameHash> nameIds;
+  // (parent << 32 | name) to child
+  std::unordered_map<std::uint64_t, Node> children;
+
+  static std::uint64_t key(Node parent, std::uint32_t name) {
+    return (std::uint64_t(parent) << 32) | name;
+  }
+  std::uint32_t intern(boost::string_view name);
+  /// Puts 'node', called 'name', in 'parent''s children
+  void link(Node node, Node parent, std::uint32_t name);
+  /// Takes 'node' out of its parent's children
+  void unlink(Node node);
+  /// Returns the child of 'parent' called 'name', or none
+  Node child(Node parent, boost::string_view name) const;
+  Node makeChild(Node parent, boost::string_view name);
+  /// Returns the node for 'path', whether or not it's been add()ed, or none
+  Node locate(boost::string_view path) const;
+  /// Returns the node for 'path' under 'node', making it and its parents if
+  /// need be
+  Node make(Node node, boost::string_view path);
+  /// Forgets 'node', and any parents that were only there for it, if nothing
+  /// uses them any more
+  void prune(Node node);
+
+public:
+  DirectoryTree();
+
+  /// Returns the node for 'path', adding it (and its parents) if need be. Each
+  /// add() needs a remove() before the node can go
+  Node add(boost::string_view path);
+  /// Lets go of a node we got from add()
+  void remove(Node node);
+  /// Returns the node for 'path' if it's been add()ed, otherwise none
+  Node find(boost::string_view path) const;
+  /// Moves the directory at 'from' to 'to'; everything under it comes along.
+  /// Returns false if there's no 'from', or there's already a 'to'
+  bool move(boost::string_view from, boost::string_view to);
+
+  /// True if 'node' is 'ancestor', or somewhere under it
+  bool contains(Node ancestor, Node node) const;
+  /// 'top' and every node under it, parents before their children. Includes
+  /// the parents nobody add()ed
+  std::vector<Node> under(Node top) const;
+
+  /// The full path of 'node'
+  std::string path(Node node) const;
+  /// Appends the full path of 'node' to 'out'
+  void appendPath(Node node, std::string &out) const;
+
+  /// How many nodes there are, including the parents nobody add()ed
+  std::size_t size() const { return nodes.size() - unused.size(); }
+};
+
+} /* cdnalizerd  */
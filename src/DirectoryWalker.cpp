@@ -0,0 +1,194 @@
+#include "DirectoryWalker.hpp"
+
+#include "BlockingPool.hpp"
+#include "logging.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+namespace cdnalizerd {
+
+namespace {
+
+/// What getdents64 fills the buffer with. glibc doesn't declare it for us
+struct linux_dirent64 {
+  std::uint64_t d_ino;
+  std::int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/// Shared by all the threads walking one tree
+struct WalkState {
+  PruneDirectory prune;
+  OnDirectory onDirectory;
+  bool stat;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  // Directories waiting to be read
+  std::vector<std::string> queue;
+  // Threads reading a directory right now
+  std::size_t busy = 0;
+  // Threads inside work()
+  std::size_t working = 0;
+  bool done = false;
+  LocalTree result;
+
+  /// Reads directories until there are none left. Any number of threads can
+  /// call it at once; ones that turn up once the walk is over return straight
+  /// away
+  void work();
+  /// Reads one directory. Adds what it finds to 'found', and the directories
+  /// to go into next to 'next'
+  void read(const std::string &directory, std::vector<char> &buffer,
+            LocalTree &found, std::vector<std::string> &next);
+};
+
+void WalkState::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (done)
+    return;
+  ++working;
+  std::vector<char> buffer(64 * 1024);
+  LocalTree found;
+  std::vector<std::string> next;
+  while (true) {
+    changed.wait(lock, [this]() { return done || !queue.empty() || !busy; });
+    if (done)
+      break;
+    if (queue.empty()) {
+      // Nobody's reading anything, so nothing more can turn up
+      done = true;
+      changed.notify_all();
+      break;
+    }
+    std::string directory(std::move(queue.back()));
+    queue.pop_back();
+    ++busy;
+    lock.unlock();
+    read(directory, buffer, found, next);
+    lock.lock();
+    --busy;
+    for (std::string &path : next)
+      queue.push_back(std::move(path));
+    next.clear();
+    changed.notify_all();
+  }
+  result.directories.insert(
+      result.directories.end(),
+      std::make_move_iterator(found.directories.begin()),
+      std::make_move_iterator(found.directories.end()));
+  result.files.insert(result.files.end(),
+                      std::make_move_iterator(found.files.begin()),
+                      std::make_move_iterator(found.files.end()));
+  --working;
+  changed.notify_all();
+}
+
+void WalkState::read(const std::string &directory, std::vector<char> &buffer,
+                     LocalTree &found, std::vector<std::string> &next) {
+  // Watch it before reading it, so anything that turns up after we've read
+  // it gets an event
+  if (onDirectory)
+    onDirectory(directory);
+  found.directories.push_back(directory);
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    // Probably gone already
+    DLOG_S(9) << "Couldn't open directory " << directory << ": "
+              << std::strerror(errno);
+    return;
+  }
+  std::string prefix(directory);
+  if (prefix.empty() || (prefix.back() != '/'))
+    prefix.push_back('/');
+  while (true) {
+    long size = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (size <= 0)
+      break;
+    for (long offset = 0; offset < size;) {
+      const linux_dirent64 *entry =
+          reinterpret_cast<const linux_dirent64 *>(buffer.data() + offset);
+      offset += entry->d_reclen;
+      const char *name = entry->d_name;
+      if ((std::strcmp(name, ".") == 0) || (std::strcmp(name, "..") == 0))
+        continue;
+      unsigned char type = entry->d_type;
+      bool link = (type == DT_LNK);
+      struct stat sb;
+      bool stated = false;
+      if (link || (type == DT_UNKNOWN)) {
+        // Some file systems don't tell us the type. And we look through
+        // symlinks, like the stat based walk did
+        if (fstatat(fd, name, &sb, 0) != 0)
+          continue;
+        stated = true;
+        type = S_ISDIR(sb.st_mode) ? DT_DIR
+                                   : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      if (type == DT_DIR) {
+        std::string path(prefix + name);
+        if (prune && prune(path)) {
+          DLOG_S(9) << "Not going into ignored directory " << path;
+          continue;
+        }
+        if (link) {
+          // Watched, but not followed
+          if (onDirectory)
+            onDirectory(path);
+          found.directories.push_back(std::move(path));
+        } else
+          next.push_back(std::move(path));
+      } else if (type == DT_REG) {
+        WalkedFile file;
+        file.path = prefix + name;
+        if (stat && (stated || (fstatat(fd, name, &sb, 0) == 0))) {
+          file.size = sb.st_size;
+          file.modified = sb.st_mtime;
+        }
+        found.files.push_back(std::move(file));
+      }
+    }
+  }
+  close(fd);
+}
+
+} /* anonymous namespace */
+
+LocalTree walkTree(yield_context yield, const std::string &root,
+                   PruneDirectory prune, OnDirectory onDirectory, bool stat) {
+  LOG_SCOPE_F(5, "walkTree");
+  if (prune && prune(root))
+    return {};
+  std::shared_ptr<WalkState> state(new WalkState);
+  state->prune = std::move(prune);
+  state->onDirectory = std::move(onDirectory);
+  state->stat = stat;
+  state->queue.push_back(root);
+  return runBlocking(yield, [state]() {
+    // We're on one of the pool's threads; get the rest to help. If they're
+    // busy with other things, we'll just do more of it ourselves
+    BlockingPool *pool = blockingPool();
+    for (std::size_t i = 1; pool && (i < pool->size()); ++i)
+      pool->post([state]() { state->work(); });
+    state->work();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->changed.wait(lock, [&state]() { return state->working == 0; });
+    LOG_S(5) << "Walked " << state->result.directories.size()
+             << " directories and " << state->result.files.size()
+             << " files";
+    return std::move(state->result);
+  });
+}
+
+} /* cdnalizerd  */
@@ -0,0 +1,49 @@
+#pragma once
+/// Walks directory trees quickly: getdents64 tells us each entry's type, so
+/// there's no stat per entry; the directories are read by all the blocking
+/// pool's threads at once; and we never go into directories we ignore.
+
+#include "common.hpp"
+#include "config/config.hpp"
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+
+struct WalkedFile {
+  std::string path;
+  // Only filled in if the walk was asked to stat files
+  std::uint64_t size = 0;
+  std::time_t modified = 0;
+};
+
+/// What a walk found, in no particular order
+struct LocalTree {
+  /// Every directory we didn't prune, including the root
+  std::vector<std::string> directories;
+  /// Every regular file in them
+  std::vector<WalkedFile> files;
+};
+
+/// Trees walked while setting up the watches, so the initial sync doesn't have
+/// to walk them again
+using LocalTrees = std::map<const ConfigEntry *, LocalTree>;
+
+/// Returns true for directories we shouldn't go into
+using PruneDirectory = std::function<bool(const std::string &path)>;
+/// Called for each directory before we read it, from the walking threads
+using OnDirectory = std::function<void(const std::string &path)>;
+
+/// Walks 'root' on the blocking pool, and suspends the calling coroutine until
+/// it's done. Symlinks to directories are reported, but not followed. If
+/// 'stat' is set, files' sizes and times are filled in
+LocalTree walkTree(yield_context yield, const std::string &root,
+                   PruneDirectory prune, OnDirectory onDirectory = nullptr,
+                   bool stat = false);
+
+} /* cdnalizerd  */
@@ -0,0 +1,59 @@
+#include "EntryIndex.hpp"
+
+namespace cdnalizerd {
+
+namespace {
+
+/// 'path' without any trailing '/'s, unless it's the root
+boost::string_view trimmed(boost::string_view path) {
+  while ((path.size() > 1) && (path.back() == '/'))
+    path.remove_suffix(1);
+  return path;
+}
+
+/// True if 'path' is 'directory', or somewhere under it. Both are trimmed
+bool within(boost::string_view path, boost::string_view directory) {
+  if (!path.starts_with(directory))
+    return false;
+  // "/a/bc" isn't in "/a/b"
+  return (path.size() == directory.size()) || (directory == "/") ||
+         (path[directory.size()] == '/');
+}
+
+} /* anonymous namespace */
+
+const EntryIndex::Entries EntryIndex::none;
+
+EntryIndex::EntryIndex(const Config &config) {
+  for (const ConfigEntry &entry : config.entries())
+    if (!entry.poll)
+      directories[trimmed(entry.local_dir).to_string()];
+  // The config is sorted by directory, so outer entries come first
+  for (auto &directory : directories)
+    for (const ConfigEntry &entry : config.entries())
+      if (!entry.poll && within(directory.first, trimmed(entry.local_dir)))
+        directory.second.push_back(&entry);
+}
+
+const EntryIndex::Entries &EntryIndex::find(boost::string_view path) const {
+  path = trimmed(path);
+  while (!path.empty()) {
+    auto found = directories.find(path);
+    if (found != directories.end())
+      return found->second;
+    std::size_t slash = path.rfind('/');
+    if ((slash == boost::string_view::npos) || (path == "/"))
+      break;
+    path = path.substr(0, (slash == 0) ? 1 : slash);
+  }
+  return none;
+}
+
+bool EntryIndex::ignored(const std::string &directory) const {
+  for (const ConfigEntry *entry : find(directory))
+    if (!entry->shouldIgnoreDirectory(directory))
+      return false;
+  return true;
+}
+
+} /* cdnalizerd  */
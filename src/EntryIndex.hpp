@@ -0,0 +1,45 @@
+#pragma once
+/// Finds the config entries a path is under. Entries can share a directory
+/// (one tree synced to two containers, say) or be inside each other, so a
+/// path can be under several, and each of them gets its events. Each
+/// directory's set of entries is worked out once, and handed out by
+/// reference, so a watch can keep the set it fans out to as a pointer.
+
+#include "config/config.hpp"
+
+#include <boost/utility/string_view.hpp>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+
+class EntryIndex {
+public:
+  /// Outermost first
+  using Entries = std::vector<const ConfigEntry *>;
+  /// For paths that aren't under any entry
+  static const Entries none;
+
+private:
+  // Each entry's directory, without any trailing '/'s, and every entry at or
+  // above it
+  std::map<std::string, Entries, std::less<>> directories;
+
+public:
+  /// Indexes the entries of 'config' that aren't polled
+  explicit EntryIndex(const Config &config);
+  // We're pointed into
+  EntryIndex(const EntryIndex &) = delete;
+
+  /// The entries 'path' is under, by the longest of their directories that
+  /// it's in. It's good for as long as we are
+  const Entries &find(boost::string_view path) const;
+  /// True if every entry that 'directory' is under ignores it (or there are
+  /// none)
+  bool ignored(const std::string &directory) const;
+};
+
+} /* cdnalizerd  */
@@ -0,0 +1,337 @@
+#include "FANotifyWatcher.hpp"
+
+#include "logging.hpp"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <system_error>
+
+namespace cdnalizerd {
+
+namespace {
+
+// The same bits as the inotify mask we use
+constexpr std::uint64_t maskToFollow = FAN_CREATE | FAN_CLOSE_WRITE |
+                                       FAN_DELETE | FAN_MOVED_FROM |
+                                       FAN_MOVED_TO | FAN_ONDIR;
+
+/// How many directories we remember before starting again
+constexpr std::size_t maxDirectories = 100000;
+
+std::pair<int, int> fsidOf(const __kernel_fsid_t &fsid) {
+  return {fsid.val[0], fsid.val[1]};
+}
+
+} /* anonymous namespace */
+
+FANotifyWatcher::FANotifyWatcher(yield_context &yield, const Config &config)
+    : config(&config), yield(yield), stream(service()),
+      buffer(inotify::Instance::bufferSize) {
+  indexes.emplace_back(config);
+  int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                             FAN_REPORT_DFID_NAME,
+                         O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+  if (fd == -1)
+    throw std::system_error(errno, std::system_category(), "fanotify_init");
+  stream.assign(fd);
+  try {
+    for (const ConfigEntry &entry : config.entries())
+      if (!entry.poll)
+        mark(entry);
+  } catch (...) {
+    for (auto &mount : mountFds)
+      close(mount.second);
+    throw;
+  }
+}
+
+void FANotifyWatcher::mark(const ConfigEntry &entry) {
+  LOG_S(1) << "Adding fanotify mark for the file system of: "
+           << entry.local_dir;
+  if (fanotify_mark(stream.native_handle(), FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    maskToFollow, AT_FDCWD, entry.local_dir.c_str()) == -1)
+    throw std::system_error(errno, std::system_category(),
+                            "fanotify_mark " + entry.local_dir);
+  struct statfs info;
+  if (statfs(entry.local_dir.c_str(), &info) == -1)
+    throw std::system_error(errno, std::system_category(),
+                            "statfs " + entry.local_dir);
+  std::pair<int, int> fsid(info.f_fsid.__val[0], info.f_fsid.__val[1]);
+  if (mountFds.count(fsid))
+    return;
+  int mountFd =
+      open(entry.local_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (mountFd == -1)
+    throw std::system_error(errno, std::system_category(),
+                            "open " + entry.local_dir);
+  // Events only give us handles, so make sure we can open them now, rather
+  // than drop every event later (it needs CAP_DAC_READ_SEARCH)
+  struct {
+    file_handle handle;
+    unsigned char bytes[MAX_HANDLE_SZ];
+  } stored;
+  stored.handle.handle_bytes = MAX_HANDLE_SZ;
+  int mountId, fd = -1;
+  if (name_to_handle_at(mountFd, "", &stored.handle, &mountId,
+                        AT_EMPTY_PATH) == 0)
+    fd = open_by_handle_at(mountFd, &stored.handle, O_PATH | O_CLOEXEC);
+  if (fd == -1) {
+    int error = errno;
+    close(mountFd);
+    throw std::system_error(error, std::system_category(),
+                            "open_by_handle_at " + entry.local_dir);
+  }
+  close(fd);
+  mountFds[fsid] = mountFd;
+}
+
+FANotifyWatcher::~FANotifyWatcher() {
+  for (auto &mount : mountFds)
+    close(mount.second);
+}
+
+FANotifyWatcher::Directory
+FANotifyWatcher::resolve(const fanotify_event_info_fid &info,
+                         int &error) const {
+  error = 0;
+  auto mount = mountFds.find(fsidOf(info.fsid));
+  if (mount == mountFds.end())
+    // A file system we're not interested in
+    return {"", &EntryIndex::none};
+  // The handle is in our own buffer, so we're free to pass it as non const
+  file_handle *handle = reinterpret_cast<file_handle *>(
+      const_cast<unsigned char *>(info.handle));
+  int fd = open_by_handle_at(mount->second, handle, O_PATH | O_CLOEXEC);
+  if (fd == -1) {
+    int failed = errno;
+    DLOG_S(9) << "Couldn't open directory handle: " << std::strerror(failed);
+    // These just mean it's been deleted since
+    if ((failed != ENOENT) && (failed != ESTALE))
+      error = failed;
+    return {"", &EntryIndex::none};
+  }
+  // Ignored directories are left to each entry, as the file's path is checked
+  // against them anyway
+  Directory result{"", &EntryIndex::none};
+  struct stat sb;
+  char link[PATH_MAX];
+  std::string proc("/proc/self/fd/" + std::to_string(fd));
+  ssize_t size = readlink(proc.c_str(), link, sizeof(link));
+  // A directory that's already gone has a path ending in " (deleted)"
+  if ((size > 0) && (fstat(fd, &sb) == 0) && (sb.st_nlink != 0)) {
+    result.path.assign(link, size);
+    result.entries = &index().find(result.path);
+  }
+  close(fd);
+  return result;
+}
+
+const FANotifyWatcher::Directory &
+FANotifyWatcher::directory(const fanotify_event_info_fid &info) {
+  const file_handle *handle =
+      reinterpret_cast<const file_handle *>(info.handle);
+  key.assign(reinterpret_cast<const char *>(&info.fsid), sizeof(info.fsid));
+  key.append(reinterpret_cast<const char *>(handle),
+             sizeof(file_handle) + handle->handle_bytes);
+  auto found = directories.find(key);
+  if (found == directories.end()) {
+    if (directories.size() >= maxDirectories)
+      retireAll();
+    int error;
+    Directory resolved(resolve(info, error));
+    if (error != 0) {
+      // Perhaps out of file descriptors; next time may be different
+      LOG_S(WARNING) << "Couldn't open a directory handle ("
+                     << std::strerror(error) << "). Rescanning";
+      lost = true;
+      return unresolved;
+    }
+    found = directories.emplace(key, std::move(resolved)).first;
+    if (!found->second.path.empty())
+      byPath.emplace(found->second.path, &found->first);
+    DLOG_S(9) << "fanotify directory: " << found->second.path;
+  }
+  return found->second;
+}
+
+void FANotifyWatcher::retireAll() {
+  byPath.clear();
+  retired.push_back(std::move(directories));
+  directories.clear();
+}
+
+void FANotifyWatcher::forgetUnder(const std::string &path) {
+  auto forget = [this](ByPath::iterator first, ByPath::iterator last) {
+    for (auto i = first; i != last; ++i)
+      moved.push_back(directories.extract(*i->second));
+    byPath.erase(first, last);
+  };
+  auto same = byPath.equal_range(path);
+  forget(same.first, same.second);
+  // Not just everything after 'path'; "/a/b c" sorts before "/a/b/c"
+  std::string prefix(path + "/");
+  auto first = byPath.lower_bound(prefix);
+  auto last = first;
+  while ((last != byPath.end()) && last->first.starts_with(prefix))
+    ++last;
+  forget(first, last);
+}
+
+const std::vector<inotify::Event> &FANotifyWatcher::waitForEvents() {
+  LOG_SCOPE_F(9, "fanotify event processing");
+  events.clear();
+  eventDirectories.clear();
+  retired.clear();
+  moved.clear();
+  lost = false;
+  while (events.empty() && !lost) {
+    // The kernel only ever gives us whole events
+    std::size_t size =
+        stream.async_read_some(asio::buffer(buffer), yield);
+    DLOG_S(9) << "bytesRead: " << size;
+    long left = size;
+    for (const fanotify_event_metadata *meta =
+             reinterpret_cast<const fanotify_event_metadata *>(buffer.data());
+         FAN_EVENT_OK(meta, left); meta = FAN_EVENT_NEXT(meta, left)) {
+      if (meta->vers != FANOTIFY_METADATA_VERSION)
+        throw std::runtime_error("Unexpected fanotify metadata version");
+      if (meta->fd >= 0)
+        close(meta->fd);
+      if (meta->mask & FAN_Q_OVERFLOW) {
+        events.emplace_back(-1, IN_Q_OVERFLOW, 0, "", 0);
+        continue;
+      }
+      const char *info = reinterpret_cast<const char *>(meta);
+      const char *end = info + meta->event_len;
+      info += meta->metadata_len;
+      while (info + sizeof(fanotify_event_info_header) <= end) {
+        const fanotify_event_info_header *header =
+            reinterpret_cast<const fanotify_event_info_header *>(info);
+        if (header->len == 0)
+          break;
+        if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+          const fanotify_event_info_fid *fid =
+              reinterpret_cast<const fanotify_event_info_fid *>(info);
+          const file_handle *handle =
+              reinterpret_cast<const file_handle *>(fid->handle);
+          const char *name = reinterpret_cast<const char *>(handle->f_handle) +
+                             handle->handle_bytes;
+          const Directory &dir = directory(*fid);
+          if (!dir.entries->empty()) {
+            events.emplace_back(eventDirectories.size(), meta->mask, 0, name,
+                                info + header->len - name);
+            eventDirectories.push_back(&dir);
+            inotify::Event &event = events.back();
+            // fanotify merges events on the same file, so we can't tell if a
+            // delete came before or after a create or write. Go by whether
+            // it's there now
+            if ((event.mask & FAN_DELETE) &&
+                (event.mask & (FAN_CREATE | FAN_CLOSE_WRITE | FAN_MOVED_TO))) {
+              struct stat sb;
+              if (lstat(path(event).c_str(), &sb) == 0)
+                event.mask &= ~FAN_DELETE;
+              else
+                event.mask &= FAN_DELETE | FAN_ONDIR;
+            }
+          }
+          // Once a directory moves or goes, the paths we know under it are
+          // wrong. This batch's events still point at them though. If we
+          // couldn't tell where it was, we can't tell what's under it either
+          if ((meta->mask & FAN_ONDIR) &&
+              (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE))) {
+            if (!dir.path.empty())
+              forgetUnder((dir.path == "/" ? dir.path : dir.path + "/") +
+                          name);
+            else if (lost)
+              retireAll();
+          }
+          break;
+        }
+        info += header->len;
+      }
+    }
+  }
+  if (lost)
+    events.emplace_back(-1, IN_Q_OVERFLOW, 0, "", 0);
+  DLOG_S(9) << "Got " << events.size() << " events";
+  return events;
+}
+
+std::string FANotifyWatcher::path(const inotify::Event &event) const {
+  const std::string &directory = eventDirectories.at(event.wd)->path;
+  std::string result;
+  result.reserve(directory.size() + 1 + event.name.size());
+  result.append(directory);
+  if (!event.name.empty()) {
+    if (result.empty() || (result.back() != '/'))
+      result.push_back('/');
+    result.append(event.name.data(), event.name.size());
+  }
+  return result;
+}
+
+const EntryIndex::Entries &
+FANotifyWatcher::entries(const inotify::Event &event) const {
+  if ((event.wd < 0) ||
+      (static_cast<std::size_t>(event.wd) >= eventDirectories.size()))
+    return EntryIndex::none;
+  return *eventDirectories[event.wd]->entries;
+}
+
+LocalTree FANotifyWatcher::directoryCreated(yield_context yield,
+                                            const ConfigEntry &entry,
+                                            const std::string &path,
+                                            bool moved) {
+  if (!moved)
+    return {};
+  return walkTree(
+      yield, path,
+      [&entry](const std::string &path) {
+        return entry.shouldIgnoreDirectory(path);
+      },
+      nullptr, true);
+}
+
+std::vector<const ConfigEntry *>
+FANotifyWatcher::overflowed(const inotify::Event &) const {
+  std::vector<const ConfigEntry *> result;
+  for (const ConfigEntry &entry : config->entries())
+    if (!entry.poll)
+      result.push_back(&entry);
+  return result;
+}
+
+void FANotifyWatcher::forgetOldConfigs() {
+  // The directories resolved since reconfigure() point into the newest index
+  while (indexes.size() > 1)
+    indexes.pop_front();
+}
+
+void FANotifyWatcher::reconfigure(yield_context, const Config &config,
+                                  const std::vector<const ConfigEntry *> &added,
+                                  LocalTrees *) {
+  this->config = &config;
+  indexes.emplace_back(config);
+  // The directories we know point at the old entries. This batch's events
+  // still point at them though
+  retireAll();
+  for (const ConfigEntry *entry : added) {
+    if (entry->poll)
+      continue;
+    try {
+      mark(*entry);
+    } catch (std::system_error &e) {
+      // The rest of the config is still good
+      LOG_S(ERROR) << "Couldn't watch " << entry->local_dir << ": "
+                   << e.what();
+    }
+  }
+}
+
+} /* cdnalizerd  */
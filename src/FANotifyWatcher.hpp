@@ -0,0 +1,114 @@
+#pragma once
+/// Watches whole file systems with fanotify, so there's no watch per
+/// directory to add (or run out of), and no window where a new directory
+/// isn't watched yet. Events tell us the parent directory's file handle and
+/// the file's name; we turn the handle back into a path, and find the config
+/// entries it's under by path prefix.
+///
+/// Needs CAP_SYS_ADMIN (for FAN_MARK_FILESYSTEM) and CAP_DAC_READ_SEARCH
+/// (for open_by_handle_at), and Linux 5.9+ for FAN_REPORT_DFID_NAME.
+
+#include "Watcher.hpp"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <list>
+#include <map>
+#include <unordered_map>
+
+struct fanotify_event_info_fid;
+
+namespace cdnalizerd {
+
+class FANotifyWatcher : public Watcher {
+private:
+  /// A directory that events happened in
+  struct Directory {
+    std::string path;
+    // Empty if it's not under any of our config entries
+    const EntryIndex::Entries *entries;
+  };
+  /// Keyed by fsid + file handle
+  using Directories = std::unordered_map<std::string, Directory>;
+  /// Paths to the keys of 'Directories'
+  using ByPath = std::multimap<boost::string_view, const std::string *>;
+
+  const Config *config;
+  // The one for the config we're watching now is at the back. The ones for
+  // the configs before it stay, as entry sets we've handed out point into
+  // them
+  std::list<EntryIndex> indexes;
+  yield_context &yield;
+  asio::posix::stream_descriptor stream;
+  std::vector<char> buffer;
+  /// A directory on each file system we watch, by fsid, to open handles with
+  std::map<std::pair<int, int>, int> mountFds;
+  /// Every directory we've resolved so far
+  Directories directories;
+  /// The ones with paths, by path, pointing at their keys in 'directories'
+  ByPath byPath;
+  /// What the events in directories we couldn't resolve get
+  const Directory unresolved{"", &EntryIndex::none};
+  /// We've thrown events away this batch, as we couldn't resolve their
+  /// directories; they're reported as an overflow, so they're rescanned
+  bool lost = false;
+  /// Caches we've thrown away during this batch, but that this batch's events
+  /// still point into
+  std::vector<Directories> retired;
+  /// Likewise the directories we've forgotten because one above them moved
+  /// or went
+  std::vector<Directories::node_type> moved;
+  /// Each event's 'wd' is an index into this
+  std::vector<const Directory *> eventDirectories;
+  std::vector<inotify::Event> events;
+  std::string key;
+
+  const EntryIndex &index() const { return indexes.back(); }
+  /// Marks the file system 'entry' is on, if it isn't already
+  void mark(const ConfigEntry &entry);
+  const Directory &directory(const fanotify_event_info_fid &info);
+  /// Forgets every directory we know of, for the rest of the batch
+  void retireAll();
+  /// Forgets 'path', and every directory under it
+  void forgetUnder(const std::string &path);
+  /// Sets 'error' if the directory's handle can't be opened, other than
+  /// because it's gone
+  Directory resolve(const fanotify_event_info_fid &info, int &error) const;
+
+public:
+  /// Marks the file systems of all of 'config's directories, and checks we
+  /// can open handles on them. Throws std::system_error if we can't (usually
+  /// for lack of privileges)
+  FANotifyWatcher(yield_context &yield, const Config &config);
+  FANotifyWatcher(const FANotifyWatcher &) = delete;
+  ~FANotifyWatcher();
+
+  const std::vector<inotify::Event> &waitForEvents() override;
+  std::string path(const inotify::Event &event) const override;
+  const EntryIndex::Entries &
+  entries(const inotify::Event &event) const override;
+  /// New directories are already watched, and anything made in them has
+  /// events. Only directories moved in from elsewhere need walking
+  LocalTree directoryCreated(yield_context yield, const ConfigEntry &entry,
+                             const std::string &path, bool moved) override;
+  /// Our directory cache notices moves itself, and the marks cover whole file
+  /// systems, so there's nothing to do
+  bool directoryMoved(const std::string &, const std::string &) override {
+    return true;
+  }
+  void directoryGone(const std::string &) override {}
+  /// There's only the one queue. Events whose directories we couldn't
+  /// resolve are reported this way too
+  std::vector<const ConfigEntry *>
+  overflowed(const inotify::Event &event) const override;
+  /// Marks the file systems of new entries. The marks of ones we no longer
+  /// need stay, and their events are thrown away. Nothing's walked, as the
+  /// marks cover everything at once
+  void reconfigure(yield_context yield, const Config &config,
+                   const std::vector<const ConfigEntry *> &added,
+                   LocalTrees *trees = nullptr) override;
+  void forgetOldConfigs() override;
+};
+
+} /* cdnalizerd  */
@@ -0,0 +1,307 @@
+#include "INotifyWatcher.hpp"
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <system_error>
+#include <utility>
+
+namespace cdnalizerd {
+
+namespace {
+
+constexpr int maskToFollow =
+    IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+/// Parents before the directories under them, so an entry inside another one
+/// (or on the same directory) goes on the same shard, and shares its watches
+void parentsFirst(std::vector<const ConfigEntry *> &entries) {
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const ConfigEntry *a, const ConfigEntry *b) {
+                     return a->local_dir.size() < b->local_dir.size();
+                   });
+}
+
+/// Sorts paths with '/' before any other character, so everything under a
+/// directory comes straight after it
+bool treeOrder(const std::string &a, const std::string &b) {
+  return std::lexicographical_compare(
+      a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        if ((x == '/') || (y == '/'))
+          return (x == '/') && (y != '/');
+        return static_cast<unsigned char>(x) < static_cast<unsigned char>(y);
+      });
+}
+
+} /* anonymous namespace */
+
+INotifyWatcher::INotifyWatcher(yield_context &yield, const Config &config,
+                               LocalTrees *trees)
+    : yield(yield) {
+  indexes.emplace_back(config);
+  std::vector<const ConfigEntry *> entries;
+  for (const ConfigEntry &entry : config.entries())
+    if (!entry.poll)
+      entries.push_back(&entry);
+  parentsFirst(entries);
+  std::size_t count = std::max<std::size_t>(
+      1, std::min<std::size_t>(inotifyShards(), entries.size()));
+  for (std::size_t i = 0; i != count; ++i)
+    shards.emplace_back(new inotify::Instance);
+  LOG_S(INFO) << "Creating inotify watches on " << count << " handles..."
+              << std::endl;
+  for (const ConfigEntry *entry : entries)
+    watchEntry(yield, *entry, trees);
+  std::vector<int> handles;
+  for (const auto &shard : shards)
+    handles.push_back(shard->inotify_handle);
+  reader.reset(new inotify::Reader(handles));
+}
+
+std::size_t INotifyWatcher::shardFor(const ConfigEntry &entry,
+                                     const std::string &path) const {
+  std::size_t slash = path.rfind('/');
+  const std::string parent(
+      (slash == std::string::npos) ? "" : path.substr(0, slash));
+  for (const std::string *directory : {&path, &parent})
+    if (!directory->empty())
+      for (std::size_t i = 0; i != shards.size(); ++i)
+        if (shards[i]->alreadyWatching(*directory))
+          return i;
+  // Events handed out before a reload can be for entries we've let go of
+  auto found = entryShards.find(&entry);
+  return (found == entryShards.end()) ? 0 : found->second;
+}
+
+std::size_t INotifyWatcher::assignShard(const ConfigEntry &entry) {
+  entryShards[&entry] = nextShard++ % shards.size();
+  std::size_t shard = shardFor(entry, entry.local_dir);
+  entryShards[&entry] = shard;
+  return shard;
+}
+
+void INotifyWatcher::watchEntry(yield_context yield, const ConfigEntry &entry,
+                                LocalTrees *trees) {
+  int error = 0;
+  std::string failed;
+  LocalTree walked(watchTree(yield, entry, assignShard(entry), entry.local_dir,
+                             trees != nullptr, error, failed));
+  if (error != 0)
+    throw std::system_error(error, std::system_category(),
+                            "Watching " + failed);
+  if (trees)
+    (*trees)[&entry] = std::move(walked);
+}
+
+void INotifyWatcher::adoptNewWatches() {
+  std::lock_guard<std::mutex> lock(newWatchesMutex);
+  for (NewWatch &watch : newWatches)
+    // It may already be watched for another entry; it's the same watch
+    if (shardOf(watch.wd).adoptWatch(shardWatch(watch.wd), watch.path)) {
+      LOG_S(9) << "Added inotify watch for: " << watch.path;
+      watchToConfig[watch.wd] = &index().find(watch.path);
+    }
+  newWatches.clear();
+}
+
+void INotifyWatcher::reindex(std::size_t shard, const std::string &path) {
+  int count = shards.size();
+  for (int wd : shards[shard]->watchesUnder(path))
+    watchToConfig[wd * count + int(shard)] =
+        &index().find(shards[shard]->path(wd, ""));
+}
+
+LocalTree INotifyWatcher::watchTree(yield_context yield,
+                                    const ConfigEntry &entry,
+                                    std::size_t shard, const std::string &root,
+                                    bool stat, int &error,
+                                    std::string &failed) {
+  // The walking threads add the watches as they go (inotify_add_watch is
+  // thread safe, our maps aren't), and we take them over in our own thread
+  int handle = shards[shard]->inotify_handle;
+  int count = shards.size();
+  LocalTree walked(walkTree(
+      yield, root,
+      [&entry](const std::string &path) {
+        return entry.shouldIgnoreDirectory(path);
+      },
+      [&](const std::string &path) {
+        // Held across the add, so once we've read an event from the new watch,
+        // adoptNewWatches() is sure to find it
+        std::lock_guard<std::mutex> lock(newWatchesMutex);
+        int wd = inotify_add_watch(handle, path.c_str(), maskToFollow);
+        if (wd != -1)
+          newWatches.push_back({wd * count + int(shard), path});
+        else if (error == 0) {
+          error = errno;
+          failed = path;
+        }
+      },
+      stat));
+  adoptNewWatches();
+  LOG_S(1) << "Watching " << walked.directories.size()
+           << " directories under " << root;
+  return walked;
+}
+
+const std::vector<inotify::Event> &INotifyWatcher::waitForEvents() {
+  for (int wd : gone) {
+    LOG_S(9) << "Removing inotify watch for deleted directory";
+    watchToConfig.erase(wd);
+    shardOf(wd).forgetWatch(shardWatch(wd));
+  }
+  gone.clear();
+  const std::vector<inotify::Event> &events = reader->waitForEvents(yield);
+  // Some may be from watches a walk added while we waited
+  adoptNewWatches();
+  for (const inotify::Event &event : events)
+    if (event.wasIgnored())
+      gone.push_back(event.wd);
+  return events;
+}
+
+std::string INotifyWatcher::path(const inotify::Event &event) const {
+  return shardOf(event.wd).path(shardWatch(event.wd), event.name);
+}
+
+const EntryIndex::Entries &
+INotifyWatcher::entries(const inotify::Event &event) const {
+  auto found = watchToConfig.find(event.wd);
+  return (found == watchToConfig.end()) ? EntryIndex::none : *found->second;
+}
+
+LocalTree INotifyWatcher::directoryCreated(yield_context yield,
+                                           const ConfigEntry &entry,
+                                           const std::string &path, bool) {
+  // Each directory is watched before it's read, so a file is either in the
+  // walk, or has an event (or both)
+  int error = 0;
+  std::string failed;
+  LocalTree result(watchTree(yield, entry, shardFor(entry, path), path, true,
+                             error, failed));
+  if ((error != 0) && (error != ENOENT))
+    // Probably out of watches (fs.inotify.max_user_watches)
+    LOG_S(WARNING) << "Couldn't watch " << failed << ": "
+                   << std::strerror(error);
+  return result;
+}
+
+bool INotifyWatcher::directoryMoved(const std::string &from,
+                                    const std::string &to) {
+  // The kernel's watches follow the directories; we only have to fix up
+  // their paths, on whichever shards have them, and which entries they're
+  // under
+  if (index().ignored(to))
+    return false;
+  bool moved = false;
+  for (std::size_t i = 0; i != shards.size(); ++i) {
+    if (!shards[i]->moveDirectory(from, to))
+      continue;
+    moved = true;
+    reindex(i, to);
+  }
+  if (moved)
+    LOG_S(9) << "Watched directory moved from " << from << " to " << to;
+  return moved;
+}
+
+void INotifyWatcher::directoryGone(const std::string &path) {
+  for (std::size_t i = 0; i != shards.size(); ++i)
+    for (int wd : shards[i]->watchesUnder(path)) {
+      LOG_S(9) << "Removing inotify watch for directory that's gone";
+      watchToConfig.erase(wd * int(shards.size()) + int(i));
+      shards[i]->removeWatch(wd);
+    }
+}
+
+std::vector<const ConfigEntry *>
+INotifyWatcher::overflowed(const inotify::Event &event) const {
+  std::set<const ConfigEntry *> result;
+  int count = shards.size();
+  for (const auto &entry : entryShards)
+    if ((event.wd < 0) && (int(entry.second) == -1 - event.wd))
+      result.insert(entry.first);
+  // Directories moved in from other entries bring their watches with them
+  std::set<const EntryIndex::Entries *> sets;
+  for (const auto &watch : watchToConfig)
+    if ((event.wd < 0) && (watch.first % count == -1 - event.wd))
+      sets.insert(watch.second);
+  for (const EntryIndex::Entries *entries : sets)
+    result.insert(entries->begin(), entries->end());
+  return {result.begin(), result.end()};
+}
+
+void INotifyWatcher::forgetOldConfigs() {
+  // reconfigure() pointed every watch into the newest index
+  while (indexes.size() > 1)
+    indexes.pop_front();
+}
+
+void INotifyWatcher::reconfigure(yield_context yield, const Config &config,
+                                 const std::vector<const ConfigEntry *> &added,
+                                 LocalTrees *trees) {
+  adoptNewWatches();
+  indexes.emplace_back(config);
+  // Point every watch at the entries it's under now, and drop the ones that
+  // aren't under any, or that they all ignore, with everything under them
+  int count = shards.size();
+  std::size_t kept = 0, dropped = 0;
+  for (std::size_t i = 0; i != shards.size(); ++i) {
+    std::vector<std::pair<std::string, int>> watches;
+    for (const auto &watch : shards[i]->watches)
+      watches.emplace_back(shards[i]->path(watch.first, ""), watch.first);
+    std::sort(watches.begin(), watches.end(),
+              [](const std::pair<std::string, int> &a,
+                 const std::pair<std::string, int> &b) {
+                return treeOrder(a.first, b.first);
+              });
+    std::string droppedUnder;
+    for (const auto &watch : watches) {
+      const std::string &path = watch.first;
+      bool under = !droppedUnder.empty() &&
+                   (path.compare(0, droppedUnder.size(), droppedUnder) == 0) &&
+                   (path.size() > droppedUnder.size()) &&
+                   (path[droppedUnder.size()] == '/');
+      if (!under) {
+        if (!index().ignored(path)) {
+          watchToConfig[watch.second * count + int(i)] = &index().find(path);
+          ++kept;
+          continue;
+        }
+        droppedUnder = path;
+      }
+      watchToConfig.erase(watch.second * count + int(i));
+      shards[i]->removeWatch(watch.second);
+      ++dropped;
+    }
+  }
+  LOG_S(INFO) << "Config reloaded: kept " << kept << " inotify watches, and "
+              << "dropped " << dropped;
+
+  // Each entry that was already here keeps the shard it's on
+  std::set<const ConfigEntry *> fresh(added.begin(), added.end());
+  std::vector<const ConfigEntry *> entries;
+  entryShards.clear();
+  for (const ConfigEntry &entry : config.entries()) {
+    if (entry.poll)
+      continue;
+    if (fresh.count(&entry))
+      entries.push_back(&entry);
+    else
+      assignShard(entry);
+  }
+  parentsFirst(entries);
+  for (const ConfigEntry *entry : entries) {
+    try {
+      watchEntry(yield, *entry, trees);
+    } catch (std::system_error &e) {
+      // The rest of the config is still good
+      LOG_S(ERROR) << "Couldn't watch " << entry->local_dir << ": "
+                   << e.what();
+    }
+  }
+}
+
+} /* cdnalizerd  */
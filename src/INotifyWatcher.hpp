@@ -0,0 +1,111 @@
+#pragma once
+/// Watches our directories with an inotify watch on each one. The config
+/// entries are spread over a few inotify handles, each with its own kernel
+/// queue and a thread to read it, so a busy entry can't overflow the others'
+/// queues, and an overflow only costs a rescan of the entries that shared it.
+/// Entries that overlap share the watches where they meet; each watch fans
+/// its events out to every entry its directory is under.
+
+#include "DirectoryWalker.hpp"
+#include "Watcher.hpp"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace cdnalizerd {
+
+class INotifyWatcher : public Watcher {
+private:
+  /// A watch a walking thread has added
+  struct NewWatch {
+    int wd;
+    std::string path;
+  };
+
+  yield_context &yield;
+  // The one for the config we're watching now is at the back. The ones for
+  // the configs before it stay, as entry sets we've handed out point into
+  // them
+  std::list<EntryIndex> indexes;
+  // The handles, and the watches on each. Event and watch handles ('wd's) are
+  // numbered across all of them, the way inotify::Reader numbers them
+  std::vector<std::unique_ptr<inotify::Instance>> shards;
+  // Which shard each entry's top directory is watched on
+  std::map<const ConfigEntry *, std::size_t> entryShards;
+  // The shard the next entry that isn't under another goes on
+  std::size_t nextShard = 0;
+  // Maps inotify watch handles to the config entries their directories are
+  // under. The sets are the index's, so it's a pointer per watch
+  std::unordered_map<int, const EntryIndex::Entries *> watchToConfig;
+  // Watches the kernel has dropped (IN_IGNORED). We forget them at the start
+  // of the next batch, as the events before them still need their paths
+  std::vector<int> gone;
+  // Watches the walking threads have added, that we haven't taken on yet
+  std::mutex newWatchesMutex;
+  std::vector<NewWatch> newWatches;
+  // Declared after the shards, so it stops reading before they're closed
+  std::unique_ptr<inotify::Reader> reader;
+
+  const EntryIndex &index() const { return indexes.back(); }
+  /// The shard a watch handle is on
+  inotify::Instance &shardOf(int wd) const {
+    return *shards[wd % shards.size()];
+  }
+  /// A watch handle as its own shard numbers it
+  int shardWatch(int wd) const { return wd / int(shards.size()); }
+  /// The shard to watch a directory (and everything under it) on: the one
+  /// it's already on, or its parent's, so trees stay together; otherwise
+  /// 'entry's
+  std::size_t shardFor(const ConfigEntry &entry, const std::string &path) const;
+  /// Picks the shard for 'entry's top directory, and notes it
+  std::size_t assignShard(const ConfigEntry &entry);
+  /// Watches everything under 'entry'. Throws std::system_error if a watch
+  /// can't be added
+  void watchEntry(yield_context yield, const ConfigEntry &entry,
+                  LocalTrees *trees);
+  /// Takes on the watches the walking threads have added
+  void adoptNewWatches();
+  /// Points the watches under 'path' on 'shard' at the entries they're under
+  /// now
+  void reindex(std::size_t shard, const std::string &path);
+  /// Watches every directory under 'root' (which is under 'entry') on
+  /// 'shard', walking the tree in parallel, and returns what it found. If a
+  /// watch can't be added, 'error' and 'failed' say why and for which
+  /// directory (the first time)
+  LocalTree watchTree(yield_context yield, const ConfigEntry &entry,
+                      std::size_t shard, const std::string &root, bool stat,
+                      int &error, std::string &failed);
+
+public:
+  /// Adds watches for every directory in 'config'. If 'trees' is given, what
+  /// we find on the way goes in it
+  INotifyWatcher(yield_context &yield, const Config &config,
+                 LocalTrees *trees = nullptr);
+
+  /// Events from different shards can come in any order, but each shard's
+  /// are in order
+  const std::vector<inotify::Event> &waitForEvents() override;
+  std::string path(const inotify::Event &event) const override;
+  const EntryIndex::Entries &
+  entries(const inotify::Event &event) const override;
+  /// We only watch the new directory once we've heard about it, so anything
+  /// made in it before then (mkdir -p, tar x) needs finding
+  LocalTree directoryCreated(yield_context yield, const ConfigEntry &entry,
+                             const std::string &path, bool moved) override;
+  bool directoryMoved(const std::string &from, const std::string &to) override;
+  void directoryGone(const std::string &path) override;
+  /// Every entry with a watch on the shard that overflowed
+  std::vector<const ConfigEntry *>
+  overflowed(const inotify::Event &event) const override;
+  /// The watches stay on the shards they're on; the number of shards is
+  /// fixed when we're made
+  void reconfigure(yield_context yield, const Config &config,
+                   const std::vector<const ConfigEntry *> &added,
+                   LocalTrees *trees = nullptr) override;
+  void forgetOldConfigs() override;
+};
+
+} /* cdnalizerd  */
@@ -0,0 +1,383 @@
+#include "IOURing.hpp"
+
+#include "logging.hpp"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace cdnalizerd {
+
+namespace {
+
+/// How long we wait to submit again when the kernel won't take our ops: at
+/// first, and at most, as it doubles each time it still won't
+const boost::posix_time::milliseconds firstRetryDelay(1);
+const boost::posix_time::milliseconds lastRetryDelay(100);
+
+// There's no liburing here, so we make the syscalls ourselves
+
+int setupRing(unsigned entries, io_uring_params &params) {
+  return syscall(__NR_io_uring_setup, entries, &params);
+}
+
+int enterRing(int fd, unsigned toSubmit) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, nullptr, 0);
+}
+
+int registerRing(int fd, unsigned opcode, void *arg, unsigned args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+template <typename T> T *at(void *base, std::uint32_t offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+io_uring_sqe blankOp(std::uint8_t opcode) {
+  io_uring_sqe sqe;
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  return sqe;
+}
+
+} /* anonymous namespace */
+
+IOURing::IOURing(unsigned depth)
+    : events(service()), retry(service()), retryDelay(firstRetryDelay),
+      poll(service()) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ringFd = setupRing(depth, params);
+  if (ringFd < 0)
+    throw std::system_error(errno, std::system_category(), "io_uring_setup");
+  entries = params.sq_entries;
+  try {
+    // Make sure the kernel knows every operation we use
+    std::vector<char> probeSpace(
+        sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *probe =
+        reinterpret_cast<io_uring_probe *>(probeSpace.data());
+    if (registerRing(ringFd, IORING_REGISTER_PROBE, probe, 256) < 0)
+      throw std::system_error(errno, std::system_category(),
+                              "Probing io_uring");
+    for (int op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+                   IORING_OP_CLOSE})
+      if ((op > probe->last_op) ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        throw std::runtime_error(
+            "This kernel's io_uring can't do statx, openat, read and close");
+
+    sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+    sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) {
+      sqMap = nullptr;
+      throw std::system_error(errno, std::system_category(),
+                              "Mapping io_uring submission queue");
+    }
+    if (single)
+      cqMap = sqMap;
+    else {
+      cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+      if (cqMap == MAP_FAILED) {
+        cqMap = nullptr;
+        throw std::system_error(errno, std::system_category(),
+                                "Mapping io_uring completion queue");
+      }
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqeMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqeMap == MAP_FAILED)
+      throw std::system_error(errno, std::system_category(),
+                              "Mapping io_uring submission entries");
+    sqes = static_cast<io_uring_sqe *>(sqeMap);
+    sqHead = at<unsigned>(sqMap, params.sq_off.head);
+    sqTail = at<unsigned>(sqMap, params.sq_off.tail);
+    sqMask = at<unsigned>(sqMap, params.sq_off.ring_mask);
+    sqArray = at<unsigned>(sqMap, params.sq_off.array);
+    cqHead = at<unsigned>(cqMap, params.cq_off.head);
+    cqTail = at<unsigned>(cqMap, params.cq_off.tail);
+    cqMask = at<unsigned>(cqMap, params.cq_off.ring_mask);
+    cqes = at<io_uring_cqe>(cqMap, params.cq_off.cqes);
+
+    // The kernel bumps this for every completion; asio tells us about it
+    eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (eventFd < 0)
+      throw std::system_error(errno, std::system_category(), "eventfd");
+    if (registerRing(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+      throw std::system_error(errno, std::system_category(),
+                              "Registering io_uring eventfd");
+    events.assign(eventFd);
+    // 'events' owns it now
+    eventFd = -1;
+  } catch (...) {
+    release();
+    throw;
+  }
+  slots.assign(entries, {nullptr, 0});
+  for (unsigned i = entries; i != 0; --i)
+    freeSlots.push_back(i - 1);
+  LOG_S(1) << "io_uring ready. Queue depth: " << entries;
+}
+
+IOURing::~IOURing() {
+  boost::system::error_code ec;
+  events.close(ec);
+  retry.cancel(ec);
+  poll.cancel(ec);
+  release();
+}
+
+void IOURing::release() {
+  if (sqes != nullptr)
+    munmap(sqes, sqesSize);
+  if ((cqMap != nullptr) && (cqMap != sqMap))
+    munmap(cqMap, cqMapSize);
+  if (sqMap != nullptr)
+    munmap(sqMap, sqMapSize);
+  if (eventFd != -1)
+    ::close(eventFd);
+  if (ringFd != -1)
+    ::close(ringFd);
+  sqes = nullptr;
+  cqMap = nullptr;
+  sqMap = nullptr;
+  eventFd = -1;
+  ringFd = -1;
+}
+
+void IOURing::submit() {
+  if (broken) {
+    wait();
+    return;
+  }
+  // Only we ever write the tail
+  unsigned tail = *sqTail;
+  while (!queue.empty() && !freeSlots.empty()) {
+    Call &call = *queue.front();
+    std::uint64_t slot = freeSlots.back();
+    freeSlots.pop_back();
+    slots[slot] = {&call, call.next};
+    unsigned index = tail & *sqMask;
+    sqes[index] = call.ops[call.next];
+    sqes[index].user_data = slot;
+    sqArray[index] = index;
+    ++tail;
+    if (++call.next == call.ops.size())
+      queue.pop_front();
+  }
+  __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+  // This includes anything the kernel couldn't take last time
+  unsigned toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  while (toSubmit > 0) {
+    int submitted = enterRing(ringFd, toSubmit);
+    if (submitted > 0) {
+      toSubmit -= submitted;
+      retryDelay = firstRetryDelay;
+      continue;
+    }
+    if ((submitted < 0) && (errno == EINTR))
+      continue;
+    if ((submitted == 0) || (errno == EAGAIN) || (errno == EBUSY)) {
+      // The kernel is short of something. If it has ops of ours, the next
+      // completion wakes us to try again; if not, nothing would, so we wait
+      // a while
+      if (entries - freeSlots.size() == toSubmit)
+        retryLater();
+      break;
+    }
+    giveUp(errno);
+    break;
+  }
+  wait();
+}
+
+void IOURing::retryLater() {
+  if (retrying)
+    return;
+  retrying = true;
+  retry.expires_from_now(retryDelay);
+  retryDelay = std::min<boost::posix_time::time_duration>(retryDelay * 2,
+                                                          lastRetryDelay);
+  retry.async_wait([this](const boost::system::error_code &ec) {
+    if (ec == asio::error::operation_aborted)
+      // We're being destroyed
+      return;
+    retrying = false;
+    submit();
+  });
+}
+
+void IOURing::wait() {
+  if (waiting || (freeSlots.size() == entries))
+    return;
+  waiting = true;
+  if (polling) {
+    poll.expires_from_now(lastRetryDelay);
+    poll.async_wait([this](const boost::system::error_code &ec) {
+      if (ec == asio::error::operation_aborted)
+        // We're being destroyed
+        return;
+      waiting = false;
+      reap();
+      wait();
+    });
+    return;
+  }
+  events.async_read_some(
+      asio::buffer(&eventCount, sizeof(eventCount)),
+      [this](const boost::system::error_code &ec, std::size_t) {
+        if (ec == asio::error::operation_aborted)
+          // We're being destroyed
+          return;
+        waiting = false;
+        if (ec) {
+          polling = true;
+          giveUp(ec.value());
+        }
+        reap();
+        submit();
+      });
+}
+
+void IOURing::reap() {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  std::vector<Call *> finished;
+  for (; head != tail; ++head) {
+    const io_uring_cqe &cqe = cqes[head & *cqMask];
+    auto &slot = slots[cqe.user_data];
+    Call &call = *slot.first;
+    call.results[slot.second] = cqe.res;
+    slot.first = nullptr;
+    freeSlots.push_back(cqe.user_data);
+    if (++call.done == call.ops.size())
+      finished.push_back(&call);
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  for (Call *call : finished)
+    finish(*call);
+}
+
+void IOURing::giveUp(int error) {
+  if (!broken)
+    LOG_S(ERROR) << "io_uring failed: " << std::strerror(error)
+                 << ". Giving up on it once what it has finishes";
+  broken = true;
+  std::vector<Call *> finished;
+  auto fail = [&finished, error](Call &call, std::size_t op) {
+    call.results[op] = failed(call.ops[op], error);
+    if (++call.done == call.ops.size())
+      finished.push_back(&call);
+  };
+  // Take back what we've put in the submission queue that the kernel hasn't
+  // taken. Nothing else takes from it, as we don't use SQPOLL
+  unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  unsigned tail = *sqTail;
+  for (; head != tail; ++head) {
+    std::uint64_t index = sqes[sqArray[head & *sqMask]].user_data;
+    auto &slot = slots[index];
+    fail(*slot.first, slot.second);
+    slot.first = nullptr;
+    freeSlots.push_back(index);
+  }
+  __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+  for (Call *call : queue)
+    for (; call->next != call->ops.size(); ++call->next)
+      fail(*call, call->next);
+  queue.clear();
+  for (Call *call : finished)
+    finish(*call);
+}
+
+int IOURing::failed(const io_uring_sqe &op, int error) {
+  if (op.opcode != IORING_OP_CLOSE)
+    return -error;
+  return (::close(op.fd) == 0) ? 0 : -errno;
+}
+
+void IOURing::finish(Call &call) {
+  // Post it, so the caller doesn't run in the middle of reap()
+  asio::post(events.get_executor(), std::move(call.finished));
+}
+
+std::vector<int> IOURing::run(yield_context yield,
+                              std::vector<io_uring_sqe> ops) {
+  if (ops.empty())
+    return {};
+  Call call;
+  call.ops = std::move(ops);
+  if (broken) {
+    std::vector<int> results;
+    for (const io_uring_sqe &op : call.ops)
+      results.push_back(failed(op, EIO));
+    return results;
+  }
+  call.results.assign(call.ops.size(), -ECANCELED);
+  boost::asio::async_completion<yield_context,
+                                void(boost::system::error_code)>
+      init(yield);
+  call.finished = [handler = std::move(init.completion_handler)]() mutable {
+    handler(boost::system::error_code());
+  };
+  queue.push_back(&call);
+  submit();
+  init.result.get();
+  return std::move(call.results);
+}
+
+io_uring_sqe IOURing::statx(const char *path, struct statx *out) {
+  io_uring_sqe sqe = blankOp(IORING_OP_STATX);
+  sqe.fd = AT_FDCWD;
+  sqe.addr = reinterpret_cast<std::uintptr_t>(path);
+  sqe.len = STATX_BASIC_STATS;
+  sqe.off = reinterpret_cast<std::uintptr_t>(out);
+  return sqe;
+}
+
+io_uring_sqe IOURing::openat(const char *path, int flags) {
+  io_uring_sqe sqe = blankOp(IORING_OP_OPENAT);
+  sqe.fd = AT_FDCWD;
+  sqe.addr = reinterpret_cast<std::uintptr_t>(path);
+  sqe.open_flags = flags;
+  return sqe;
+}
+
+io_uring_sqe IOURing::read(int fd, void *buffer, unsigned size,
+                           std::uint64_t offset) {
+  io_uring_sqe sqe = blankOp(IORING_OP_READ);
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<std::uintptr_t>(buffer);
+  sqe.len = size;
+  sqe.off = offset;
+  return sqe;
+}
+
+io_uring_sqe IOURing::close(int fd) {
+  io_uring_sqe sqe = blankOp(IORING_OP_CLOSE);
+  sqe.fd = fd;
+  return sqe;
+}
+
+IOURing *_global_io_uring(nullptr);
+
+void ioURing(IOURing *ring) { _global_io_uring = ring; }
+
+IOURing *ioURing() { return _global_io_uring; }
+
+} /* cdnalizerd  */
@@ -0,0 +1,119 @@
+#pragma once
+/// A small io_uring wrapper, so we can have many file system operations
+/// (statx, openat, read) in flight at once instead of doing blocking syscalls
+/// one at a time. Queue depth is what gets throughput out of NVMe and network
+/// file systems.
+///
+/// Completions are signalled through an eventfd that the io_service watches,
+/// so coroutines just sleep while their batch is in the kernel. It's only
+/// used from the io_service thread.
+
+#include "common.hpp"
+#include "https.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <linux/io_uring.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+struct statx;
+
+namespace cdnalizerd {
+
+class IOURing {
+private:
+  /// One caller's batch of operations
+  struct Call {
+    std::vector<io_uring_sqe> ops;
+    std::vector<int> results;
+    std::size_t next = 0;
+    std::size_t done = 0;
+    std::function<void()> finished;
+  };
+
+  int ringFd = -1;
+  int eventFd = -1;
+  unsigned entries = 0;
+  void *sqMap = nullptr;
+  std::size_t sqMapSize = 0;
+  void *cqMap = nullptr;
+  std::size_t cqMapSize = 0;
+  io_uring_sqe *sqes = nullptr;
+  std::size_t sqesSize = 0;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_cqe *cqes;
+
+  asio::posix::stream_descriptor events;
+  std::uint64_t eventCount;
+  bool waiting = false;
+  // For when the kernel won't take our ops, and there's nothing in flight
+  // whose completion would tell us to try again
+  asio::deadline_timer retry;
+  boost::posix_time::time_duration retryDelay;
+  bool retrying = false;
+  // Set when the ring itself fails. Nothing more is submitted, but what's
+  // already in the kernel is still reaped, as it can write into the callers'
+  // buffers until it completes
+  bool broken = false;
+  // Set when the eventfd fails too; we look at the completion queue on a
+  // timer instead
+  bool polling = false;
+  asio::deadline_timer poll;
+
+  /// Which call and op each in flight submission belongs to, by user_data
+  std::vector<std::pair<Call *, std::size_t>> slots;
+  std::vector<std::uint64_t> freeSlots;
+  /// Calls with ops that haven't been submitted yet
+  std::deque<Call *> queue;
+
+  void release();
+  /// Moves as many queued ops into the kernel as there's room for
+  void submit();
+  /// Handles everything in the completion queue
+  void reap();
+  /// Waits on the eventfd, if anything is in flight
+  void wait();
+  /// Calls submit() again after a while, backing off each time
+  void retryLater();
+  /// When the ring itself breaks: fails every op that the kernel doesn't
+  /// have yet, and leaves the rest to be reaped
+  void giveUp(int error);
+  /// The result for 'op' when it can't go through the ring. Closes are done
+  /// here, so their fds don't leak
+  static int failed(const io_uring_sqe &op, int error);
+  void finish(Call &call);
+
+public:
+  /// Sets up a ring that can have 'depth' operations in flight. Throws if the
+  /// kernel doesn't have io_uring, or can't do the operations we need
+  explicit IOURing(unsigned depth = 64);
+  IOURing(const IOURing &) = delete;
+  ~IOURing();
+
+  unsigned depth() const { return entries; }
+
+  /// Runs all of 'ops', keeping the ring as full as possible, and suspends the
+  /// calling coroutine until they've all finished. Returns each one's result,
+  /// in the same order: what the syscall would return, or -errno
+  std::vector<int> run(yield_context yield, std::vector<io_uring_sqe> ops);
+
+  // Make the operations to pass to run()
+  static io_uring_sqe statx(const char *path, struct statx *out);
+  static io_uring_sqe openat(const char *path, int flags);
+  static io_uring_sqe read(int fd, void *buffer, unsigned size,
+                           std::uint64_t offset);
+  static io_uring_sqe close(int fd);
+};
+
+/// Sets the process wide ring. nullptr means we use blocking syscalls instead
+void ioURing(IOURing *ring);
+/// The process wide ring, or nullptr if there isn't one
+IOURing *ioURing();
+
+} /* cdnalizerd  */
@@ -0,0 +1,147 @@
+#include "KTLSStream.hpp"
+
+#include "logging.hpp"
+#include "exception_tags.hpp"
+
+#include <boost/asio/ssl/error.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/exception/enable_error_info.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <cerrno>
+
+namespace cdnalizerd {
+
+namespace asio = boost::asio;
+
+KTLSStream::KTLSStream(asio::ip::tcp::socket &sock, SSL_CTX *ctx,
+                       const std::string &hostname)
+    : sock(sock), ssl(SSL_new(ctx)) {
+  if (ssl == nullptr)
+    BOOST_THROW_EXCEPTION(
+        boost::enable_error_info(std::runtime_error("Unable to create SSL"))
+        << err::action("Starting kTLS session"));
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+  SSL_set_tlsext_host_name(ssl, hostname.c_str());
+  SSL_set1_host(ssl, hostname.c_str());
+  SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
+  // OpenSSL does the reads and writes itself, so the socket must never block
+  sock.non_blocking(true);
+  SSL_set_fd(ssl, sock.native_handle());
+}
+
+KTLSStream::~KTLSStream() { SSL_free(ssl); }
+
+boost::system::error_code
+KTLSStream::check(int ok, asio::socket_base::wait_type &wait) const {
+  if (ok > 0)
+    return {};
+  int error = SSL_get_error(ssl, ok);
+  switch (error) {
+  case SSL_ERROR_WANT_READ:
+    wait = asio::socket_base::wait_read;
+    return asio::error::would_block;
+  case SSL_ERROR_WANT_WRITE:
+    wait = asio::socket_base::wait_write;
+    return asio::error::would_block;
+  case SSL_ERROR_ZERO_RETURN:
+    return asio::error::eof;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0)
+      // The other end dropped the connection without a close_notify
+      return asio::ssl::error::stream_truncated;
+    return boost::system::error_code(errno, boost::system::system_category());
+  default:
+    return boost::system::error_code(static_cast<int>(ERR_get_error()),
+                                     asio::error::get_ssl_category());
+  }
+}
+
+void KTLSStream::handshake(asio::yield_context &yield) {
+  while (true) {
+    ERR_clear_error();
+    asio::socket_base::wait_type wait;
+    boost::system::error_code ec = check(SSL_connect(ssl), wait);
+    if (ec == asio::error::would_block)
+      sock.async_wait(wait, yield);
+    else if (ec)
+      BOOST_THROW_EXCEPTION(boost::enable_error_info(
+                                boost::system::system_error(ec))
+                            << err::action("TLS handshake"));
+    else
+      break;
+  }
+  LOG_S(5) << "TLS handshake done. Kernel encrypts: "
+           << (kernelSends() ? "yes" : "no")
+           << " - Kernel decrypts: " << (kernelReceives() ? "yes" : "no");
+}
+
+void KTLSStream::shutdown(asio::yield_context &yield,
+                          boost::system::error_code &ec) {
+  while (true) {
+    ERR_clear_error();
+    asio::socket_base::wait_type wait;
+    int ok = SSL_shutdown(ssl);
+    // 0 means our close_notify went out, and we're not waiting for theirs
+    ec = check(ok < 0 ? ok : 1, wait);
+    if (ec != asio::error::would_block)
+      return;
+    sock.async_wait(wait, yield[ec]);
+    if (ec)
+      return;
+  }
+}
+
+bool KTLSStream::kernelSends() const {
+#ifdef SSL_OP_ENABLE_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+  return false;
+#endif
+}
+
+bool KTLSStream::kernelReceives() const {
+#ifdef SSL_OP_ENABLE_KTLS
+  return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+  return false;
+#endif
+}
+
+void KTLSStream::sendfile(int fd, std::uint64_t offset, std::size_t size,
+                          asio::yield_context &yield) {
+#ifdef SSL_OP_ENABLE_KTLS
+  while (size > 0) {
+    ERR_clear_error();
+    ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, size, 0);
+    if (sent > 0) {
+      offset += sent;
+      size -= sent;
+      continue;
+    }
+    if (sent == 0)
+      // The file got shorter while we were sending it
+      BOOST_THROW_EXCEPTION(
+          boost::enable_error_info(boost::system::system_error(
+              boost::beast::http::error::short_read))
+          << err::action("sendfile"));
+    asio::socket_base::wait_type wait;
+    boost::system::error_code ec = check(-1, wait);
+    if (ec == asio::error::would_block)
+      sock.async_wait(wait, yield);
+    else
+      BOOST_THROW_EXCEPTION(boost::enable_error_info(
+                                boost::system::system_error(ec))
+                            << err::action("sendfile"));
+  }
+#else
+  BOOST_THROW_EXCEPTION(
+      boost::enable_error_info(std::runtime_error(
+          "This OpenSSL can't hand TLS to the kernel"))
+      << err::action("sendfile"));
+#endif
+}
+
+} /* cdnalizerd  */
@@ -0,0 +1,145 @@
+#pragma once
+/// A TLS client stream that runs OpenSSL straight on the socket, instead of
+/// through asio's memory BIOs, so that OpenSSL can hand the session keys to
+/// the kernel (kTLS) after the handshake.
+///
+/// Once the kernel is doing the encryption, SSL_write goes straight to the
+/// socket and file bodies can be sent with sendfile, without ever being
+/// copied into (or encrypted in) user space. If the kernel or OpenSSL can't do
+/// kTLS, it's just a normal user space TLS stream.
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace cdnalizerd {
+
+class KTLSStream {
+public:
+  using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+private:
+  boost::asio::ip::tcp::socket &sock;
+  SSL *ssl;
+
+  enum Direction { reading, writing };
+
+  /// Turns the result of an SSL call into an error code. Returns
+  /// would_block if we need to wait for the socket, and sets 'wait' to say
+  /// which way
+  boost::system::error_code
+  check(int ok, boost::asio::socket_base::wait_type &wait) const;
+
+  template <typename Buffer, typename Buffers>
+  static Buffer firstBuffer(const Buffers &buffers) {
+    for (auto i = boost::asio::buffer_sequence_begin(buffers);
+         i != boost::asio::buffer_sequence_end(buffers); ++i) {
+      Buffer buffer(*i);
+      if (buffer.size() != 0)
+        return buffer;
+    }
+    return Buffer();
+  }
+
+  /// Runs an SSL_read_ex or SSL_write_ex, waiting on the socket whenever
+  /// OpenSSL says it needs to
+  template <Direction direction, typename Buffer> struct Op {
+    KTLSStream &stream;
+    Buffer buffer;
+    // The result of an attempt that finished before we ever waited. We post
+    // it, so the handler isn't called from inside the initiating function
+    bool waited = false;
+    bool done = false;
+    boost::system::error_code result;
+    std::size_t transferred = 0;
+
+    Op(KTLSStream &stream, Buffer buffer) : stream(stream), buffer(buffer) {}
+
+    template <typename Self>
+    void operator()(Self &self, boost::system::error_code ec = {}) {
+      if (done)
+        return self.complete(result, transferred);
+      if (ec)
+        return self.complete(ec, 0);
+      boost::asio::socket_base::wait_type wait;
+      if (buffer.size() == 0)
+        result = {};
+      else {
+        ERR_clear_error();
+        int ok;
+        if constexpr (direction == reading)
+          ok = SSL_read_ex(stream.ssl, buffer.data(), buffer.size(),
+                           &transferred);
+        else
+          ok = SSL_write_ex(stream.ssl, buffer.data(), buffer.size(),
+                            &transferred);
+        result = stream.check(ok, wait);
+        if (result == boost::asio::error::would_block) {
+          waited = true;
+          stream.sock.async_wait(wait, std::move(self));
+          return;
+        }
+      }
+      if (waited)
+        return self.complete(result, transferred);
+      done = true;
+      boost::asio::post(stream.sock.get_executor(), std::move(self));
+    }
+  };
+
+public:
+  /// Makes an SSL session for 'sock' (which must already be connected),
+  /// asking OpenSSL to use kTLS if it can
+  KTLSStream(boost::asio::ip::tcp::socket &sock, SSL_CTX *ctx,
+             const std::string &hostname);
+  KTLSStream(const KTLSStream &) = delete;
+  ~KTLSStream();
+
+  executor_type get_executor() { return sock.get_executor(); }
+  SSL *native_handle() { return ssl; }
+
+  /// Does the TLS handshake. Throws on failure
+  void handshake(boost::asio::yield_context &yield);
+  /// Sends our close_notify
+  void shutdown(boost::asio::yield_context &yield,
+                boost::system::error_code &ec);
+
+  /// True if the kernel is encrypting what we send
+  bool kernelSends() const;
+  /// True if the kernel is decrypting what we receive
+  bool kernelReceives() const;
+
+  /// Sends 'size' bytes from 'fd', starting at 'offset', without copying
+  /// them through user space. Only works when kernelSends() is true
+  void sendfile(int fd, std::uint64_t offset, std::size_t size,
+                boost::asio::yield_context &yield);
+
+  // Like asio's ssl::stream, we only use the first buffer of a sequence; beast
+  // and asio::async_write call us again for the rest
+  template <typename MutableBuffers, typename Handler>
+  auto async_read_some(const MutableBuffers &buffers, Handler &&handler) {
+    using Buffer = boost::asio::mutable_buffer;
+    return boost::asio::async_compose<Handler, void(boost::system::error_code,
+                                                    std::size_t)>(
+        Op<reading, Buffer>(*this, firstBuffer<Buffer>(buffers)),
+        handler, sock);
+  }
+
+  template <typename ConstBuffers, typename Handler>
+  auto async_write_some(const ConstBuffers &buffers, Handler &&handler) {
+    using Buffer = boost::asio::const_buffer;
+    return boost::asio::async_compose<Handler, void(boost::system::error_code,
+                                                    std::size_t)>(
+        Op<writing, Buffer>(*this, firstBuffer<Buffer>(buffers)),
+        handler, sock);
+  }
+};
+
+} /* cdnalizerd  */
@@ -0,0 +1,417 @@
+#include "TraceWatcher.hpp"
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+
+namespace cdnalizerd {
+
+namespace {
+
+const std::string magic("cdnalizerd events 2\n");
+
+void appendNumber(std::string &out, std::uint64_t number) {
+  while (number >= 0x80) {
+    out.push_back(char(number | 0x80));
+    number >>= 7;
+  }
+  out.push_back(char(number));
+}
+
+void appendString(std::string &out, boost::string_view text) {
+  appendNumber(out, text.size());
+  out.append(text.data(), text.size());
+}
+
+/// Watch handles can be negative (queue overflows), so they're zigzagged to
+/// keep them short
+std::uint64_t zigzag(int wd) {
+  return (std::uint32_t(wd) << 1) ^ std::uint32_t(wd >> 31);
+}
+
+/// Reads a trace from memory. Each read returns false if it runs off the end
+struct TraceReader {
+  const char *at;
+  const char *end;
+
+  bool done() const { return at == end; }
+  bool number(std::uint64_t &result) {
+    result = 0;
+    for (int shift = 0; (at != end) && (shift < 64); shift += 7) {
+      unsigned char byte = *at++;
+      result |= std::uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+        return true;
+    }
+    return false;
+  }
+  bool string(boost::string_view &result) {
+    std::uint64_t size;
+    if (!number(size) || (std::uint64_t(end - at) < size))
+      return false;
+    result = boost::string_view(at, size);
+    at += size;
+    return true;
+  }
+};
+
+} /* anonymous namespace */
+
+TraceSettings _global_trace_settings;
+
+void traceSettings(TraceSettings settings) {
+  _global_trace_settings = std::move(settings);
+}
+
+const TraceSettings &traceSettings() { return _global_trace_settings; }
+
+RecordingWatcher::RecordingWatcher(std::unique_ptr<Watcher> watcher,
+                                   const Config &config,
+                                   const std::string &filename)
+    : watcher(std::move(watcher)),
+      out(filename, std::ios::binary | std::ios::trunc), config(&config) {
+  if (!out)
+    throw std::system_error(errno, std::system_category(),
+                            "Recording events to " + filename);
+  record = magic;
+  appendNumber(record, config.entries().size());
+  for (const ConfigEntry &entry : config.entries()) {
+    numbers.emplace(&entry, numbers.size());
+    recorded.push_back(entry.local_dir);
+    appendString(record, entry.local_dir);
+  }
+  out.write(record.data(), record.size());
+  out.flush();
+  LOG_S(INFO) << "Recording events to " << filename;
+}
+
+const std::vector<inotify::Event> &RecordingWatcher::waitForEvents() {
+  const std::vector<inotify::Event> &events = watcher->waitForEvents();
+  Clock::time_point now = Clock::now();
+  if (last == Clock::time_point())
+    last = now;
+  record.clear();
+  appendNumber(record, std::chrono::duration_cast<std::chrono::microseconds>(
+                           now - last)
+                           .count());
+  last = now;
+  appendNumber(record, events.size());
+  for (const inotify::Event &event : events) {
+    appendNumber(record, event.mask);
+    appendNumber(record, event.cookie);
+    appendNumber(record, zigzag(event.wd));
+    appendString(record, event.name);
+    // Only events for our entries have paths
+    const EntryIndex::Entries *found = &EntryIndex::none;
+    if (!event.wasIgnored() && !event.wasOverflowed())
+      found = &watcher->entries(event);
+    entryNumbers.clear();
+    for (const ConfigEntry *entry : *found) {
+      auto number = numbers.find(entry);
+      if (number != numbers.end())
+        entryNumbers.push_back(number->second);
+    }
+    appendNumber(record, entryNumbers.size());
+    if (entryNumbers.empty())
+      continue;
+    for (std::uint64_t number : entryNumbers)
+      appendNumber(record, number);
+    std::string directory(watcher->path(event));
+    if (!event.name.empty())
+      directory.resize(directory.size() -
+                       std::min(directory.size(), event.name.size() + 1));
+    auto number =
+        directories.emplace(std::move(directory), directories.size() + 1);
+    if (number.second) {
+      appendNumber(record, 0);
+      appendString(record, number.first->first);
+    } else
+      appendNumber(record, number.first->second);
+  }
+  // A whole batch at a time, so a trace that's cut off is still good up to
+  // there
+  out.write(record.data(), record.size());
+  out.flush();
+  return events;
+}
+
+std::string RecordingWatcher::path(const inotify::Event &event) const {
+  return watcher->path(event);
+}
+
+const EntryIndex::Entries &
+RecordingWatcher::entries(const inotify::Event &event) const {
+  return watcher->entries(event);
+}
+
+LocalTree RecordingWatcher::directoryCreated(yield_context yield,
+                                             const ConfigEntry &entry,
+                                             const std::string &path,
+                                             bool moved) {
+  return watcher->directoryCreated(yield, entry, path, moved);
+}
+
+bool RecordingWatcher::directoryMoved(const std::string &from,
+                                      const std::string &to) {
+  return watcher->directoryMoved(from, to);
+}
+
+void RecordingWatcher::directoryGone(const std::string &path) {
+  watcher->directoryGone(path);
+}
+
+std::vector<const ConfigEntry *>
+RecordingWatcher::overflowed(const inotify::Event &event) const {
+  return watcher->overflowed(event);
+}
+
+void RecordingWatcher::reconfigure(
+    yield_context yield, const Config &config,
+    const std::vector<const ConfigEntry *> &added, LocalTrees *trees) {
+  // The header's written, so new entries can only borrow the number of one
+  // in it, as the replay matches them up by directory anyway
+  std::vector<bool> taken(recorded.size());
+  for (const ConfigEntry &entry : config.entries()) {
+    std::size_t i = 0;
+    while ((i != recorded.size()) &&
+           (taken[i] || (recorded[i] != entry.local_dir)))
+      ++i;
+    if (i == recorded.size()) {
+      LOG_S(WARNING) << "Not recording the events for " << entry.local_dir
+                     << ", as it's not in the trace";
+      continue;
+    }
+    taken[i] = true;
+    numbers[&entry] = i;
+  }
+  this->config = &config;
+  watcher->reconfigure(yield, config, added, trees);
+}
+
+void RecordingWatcher::forgetOldConfigs() {
+  std::map<const ConfigEntry *, std::uint64_t> current;
+  for (const ConfigEntry &entry : config->entries()) {
+    auto found = numbers.find(&entry);
+    if (found != numbers.end())
+      current.insert(*found);
+  }
+  numbers.swap(current);
+  watcher->forgetOldConfigs();
+}
+
+ReplayWatcher::ReplayWatcher(yield_context &yield, const Config &config,
+                             const std::string &filename, double speed,
+                             std::function<void()> onReplayed)
+    : yield(yield), speed(speed), onReplayed(std::move(onReplayed)),
+      timer(service()) {
+  indexes.emplace_back(config);
+  for (const ConfigEntry &entry : config.entries())
+    if (!entry.poll)
+      watched.push_back(&entry);
+  read(config, filename);
+}
+
+void ReplayWatcher::read(const Config &config, const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in)
+    throw std::system_error(errno, std::system_category(),
+                            "Replaying events from " + filename);
+  std::string data((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  TraceReader trace{data.data(), data.data() + data.size()};
+  if (data.compare(0, magic.size(), magic) != 0)
+    throw std::runtime_error(filename + " isn't an event trace");
+  trace.at += magic.size();
+  auto corrupt = [&filename]() {
+    return std::runtime_error("The event trace in " + filename +
+                              " is corrupt");
+  };
+
+  // Match the entries it was recorded with up with ours, by directory
+  std::uint64_t count;
+  if (!trace.number(count))
+    throw corrupt();
+  std::vector<const ConfigEntry *> recorded;
+  for (std::uint64_t i = 0; i != count; ++i) {
+    boost::string_view directory;
+    if (!trace.string(directory))
+      throw corrupt();
+    const ConfigEntry *found = nullptr;
+    if ((i < config.entries().size()) &&
+        (config.entries()[i].local_dir == directory))
+      found = &config.entries()[i];
+    for (const ConfigEntry *entry : watched)
+      if ((found == nullptr) && (entry->local_dir == directory))
+        found = entry;
+    if (found == nullptr)
+      LOG_S(WARNING) << "No config entry for " << directory
+                     << "; its events will be ignored";
+    recorded.push_back(found);
+  }
+
+  // The batches. The names all go in 'names', and the events are made once
+  // it's stopped growing, as they point into it
+  struct Raw {
+    std::uint64_t mask, cookie, wd;
+    std::size_t nameAt, nameSize;
+  };
+  std::vector<Raw> raw;
+  std::vector<std::size_t> sizes;
+  std::uint64_t at = 0;
+  while (!trace.done()) {
+    Batch batch;
+    std::uint64_t delta, size;
+    bool whole = trace.number(delta) && trace.number(size);
+    std::size_t first = raw.size();
+    for (std::uint64_t i = 0; whole && (i != size); ++i) {
+      Raw event;
+      boost::string_view name;
+      std::uint64_t found, directory = 0;
+      whole = trace.number(event.mask) && trace.number(event.cookie) &&
+              trace.number(event.wd) && trace.string(name) &&
+              trace.number(found);
+      // Entries we don't have are left out
+      EntryIndex::Entries set;
+      for (std::uint64_t j = 0; whole && (j != found); ++j) {
+        std::uint64_t entry;
+        whole = trace.number(entry);
+        if (whole && (entry >= recorded.size()))
+          throw corrupt();
+        if (whole && (recorded[entry] != nullptr))
+          set.push_back(recorded[entry]);
+      }
+      if (whole && (found != 0)) {
+        whole = trace.number(directory);
+        if (whole && (directory == 0)) {
+          boost::string_view path;
+          whole = trace.string(path);
+          if (whole)
+            directories.emplace_back(path.data(), path.size());
+          directory = directories.size();
+        }
+      }
+      if (!whole)
+        break;
+      if (directory > directories.size())
+        throw corrupt();
+      event.nameAt = names.size();
+      event.nameSize = name.size();
+      names.append(name.data(), name.size());
+      raw.push_back(event);
+      batch.entries.push_back(&*sets.insert(std::move(set)).first);
+      batch.directories.push_back((directory == 0) ? 0 : directory - 1);
+    }
+    if (!whole) {
+      LOG_S(WARNING) << "The event trace in " << filename
+                     << " was cut short; replaying the " << batches.size()
+                     << " whole batches before that";
+      raw.resize(first);
+      break;
+    }
+    at += delta;
+    batch.at = at;
+    sizes.push_back(raw.size() - first);
+    batches.push_back(std::move(batch));
+  }
+  const Raw *event = raw.data();
+  for (std::size_t i = 0; i != batches.size(); ++i)
+    for (std::size_t j = 0; j != sizes[i]; ++j, ++event)
+      batches[i].events.emplace_back(j, event->mask, event->cookie,
+                                     names.data() + event->nameAt,
+                                     event->nameSize);
+  LOG_S(INFO) << "Replaying " << raw.size() << " events in " << batches.size()
+              << " batches from " << filename << ", over "
+              << (at / 1000000.0) << "s as recorded";
+}
+
+const std::vector<inotify::Event> &ReplayWatcher::waitForEvents() {
+  if (next == batches.size()) {
+    if (onReplayed) {
+      LOG_S(INFO) << "Replayed every event";
+      std::function<void()> done(std::move(onReplayed));
+      onReplayed = nullptr;
+      done();
+    }
+    // Nothing else is coming
+    timer.expires_at(boost::posix_time::pos_infin);
+    boost::system::error_code ec;
+    timer.async_wait(yield[ec]);
+    return none;
+  }
+  if (next == 0)
+    started = Clock::now();
+  const Batch &batch = batches[next];
+  if (speed > 0) {
+    Clock::time_point due =
+        started + std::chrono::microseconds(std::uint64_t(batch.at / speed));
+    Clock::time_point now = Clock::now();
+    // If the dispatcher has fallen behind, it gets the batch straight away
+    if (due > now) {
+      timer.expires_from_now(boost::posix_time::microseconds(
+          std::chrono::duration_cast<std::chrono::microseconds>(due - now)
+              .count()));
+      boost::system::error_code ec;
+      timer.async_wait(yield[ec]);
+    }
+  }
+  ++next;
+  return batch.events;
+}
+
+std::string ReplayWatcher::path(const inotify::Event &event) const {
+  const Batch &batch = current();
+  std::string result(directories[batch.directories[event.wd]]);
+  if (!event.name.empty()) {
+    if (result.empty() || (result.back() != '/'))
+      result.push_back('/');
+    result.append(event.name.data(), event.name.size());
+  }
+  return result;
+}
+
+const EntryIndex::Entries &
+ReplayWatcher::entries(const inotify::Event &event) const {
+  return *current().entries[event.wd];
+}
+
+LocalTree ReplayWatcher::directoryCreated(yield_context yield,
+                                          const ConfigEntry &entry,
+                                          const std::string &path, bool) {
+  return walkTree(yield, path,
+                  [&entry](const std::string &directory) {
+                    return entry.shouldIgnoreDirectory(directory);
+                  },
+                  nullptr, true);
+}
+
+bool ReplayWatcher::directoryMoved(const std::string &,
+                                   const std::string &to) {
+  return !indexes.back().ignored(to);
+}
+
+void ReplayWatcher::directoryGone(const std::string &) {}
+
+std::vector<const ConfigEntry *>
+ReplayWatcher::overflowed(const inotify::Event &) const {
+  return watched;
+}
+
+void ReplayWatcher::reconfigure(yield_context, const Config &config,
+                                const std::vector<const ConfigEntry *> &,
+                                LocalTrees *) {
+  indexes.emplace_back(config);
+  watched.clear();
+  for (const ConfigEntry &entry : config.entries())
+    if (!entry.poll)
+      watched.push_back(&entry);
+}
+
+void ReplayWatcher::forgetOldConfigs() {
+  while (indexes.size() > 1)
+    indexes.pop_front();
+}
+
+} /* cdnalizerd  */
@@ -0,0 +1,163 @@
+#pragma once
+/// Records the events a watcher gives us to a file, and plays them back
+/// later in place of the kernel, so a real workload can be run through the
+/// dispatcher again and again (see bench/benchReplay.cpp), at the pace it
+/// happened or faster.
+///
+/// A trace starts with "cdnalizerd events 2\n" and the local directories of
+/// the config entries it was recorded with. Then there's a record for each
+/// batch of events, as waitForEvents() returned them: the microseconds since
+/// the last batch, and each event's wd, mask, cookie and name, the config
+/// entries it was for, and the directory it happened in. All the numbers are
+/// varints, and directories are numbered the first time they come up, so
+/// each path is only written once. A trace cut short (the daemon was killed)
+/// is good up to its last whole batch.
+
+#include "Watcher.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cdnalizerd {
+
+struct TraceSettings {
+  /// If set, every event we get is written to this file
+  std::string record;
+  /// If set, events come from this trace instead of the kernel
+  std::string replay;
+  /// How many times faster than it was recorded to replay the trace. 0 for
+  /// as fast as the dispatcher can take them
+  double speed = 1;
+  /// Called once the replay has given out its last batch
+  std::function<void()> onReplayed;
+};
+
+/// Sets what makeWatcher() records or replays
+void traceSettings(TraceSettings settings);
+const TraceSettings &traceSettings();
+
+/// Passes everything through to another watcher, and writes down the events
+/// it gives us
+class RecordingWatcher : public Watcher {
+private:
+  using Clock = std::chrono::steady_clock;
+
+  std::unique_ptr<Watcher> watcher;
+  std::ofstream out;
+  // The local directories of the entries in the trace's header
+  std::vector<std::string> recorded;
+  // Numbered by their place in the header. Entries from configs reloaded
+  // since then have the number of one there with the same directory, if
+  // there was one; the others are left out
+  std::map<const ConfigEntry *, std::uint64_t> numbers;
+  // The config we were last made or reconfigured with
+  const Config *config;
+  // Each directory's number, from 1
+  std::unordered_map<std::string, std::uint64_t> directories;
+  // When the last batch came; unset until the first one
+  Clock::time_point last;
+  // The batch being written
+  std::string record;
+  // The numbers of an event's entries
+  std::vector<std::uint64_t> entryNumbers;
+
+public:
+  /// Records what 'watcher' (made for 'config') gives us to 'filename'
+  RecordingWatcher(std::unique_ptr<Watcher> watcher, const Config &config,
+                   const std::string &filename);
+
+  const std::vector<inotify::Event> &waitForEvents() override;
+  std::string path(const inotify::Event &event) const override;
+  const EntryIndex::Entries &
+  entries(const inotify::Event &event) const override;
+  LocalTree directoryCreated(yield_context yield, const ConfigEntry &entry,
+                             const std::string &path, bool moved) override;
+  bool directoryMoved(const std::string &from, const std::string &to) override;
+  void directoryGone(const std::string &path) override;
+  std::vector<const ConfigEntry *>
+  overflowed(const inotify::Event &event) const override;
+  void reconfigure(yield_context yield, const Config &config,
+                   const std::vector<const ConfigEntry *> &added,
+                   LocalTrees *trees = nullptr) override;
+  void forgetOldConfigs() override;
+};
+
+/// Gives out the events from a trace, in its batches. The files they name are
+/// read from disk as usual, so it should be replayed over the trees it was
+/// recorded on. Each event's 'wd' is its place in the batch
+class ReplayWatcher : public Watcher {
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Batch {
+    // Microseconds after the first batch
+    std::uint64_t at;
+    std::vector<inotify::Event> events;
+    // For each event, its config entries (one of 'sets'), and its directory
+    std::vector<const EntryIndex::Entries *> entries;
+    std::vector<std::uint32_t> directories;
+  };
+
+  yield_context &yield;
+  // The current config's is at the back
+  std::list<EntryIndex> indexes;
+  std::vector<const ConfigEntry *> watched;
+  // Each set of entries the events were for, once
+  std::set<EntryIndex::Entries> sets;
+  double speed;
+  std::function<void()> onReplayed;
+  std::vector<std::string> directories;
+  // Every event's name; the events point into it
+  std::string names;
+  std::vector<Batch> batches;
+  // The batch we'll give out next
+  std::size_t next = 0;
+  Clock::time_point started;
+  boost::asio::deadline_timer timer;
+  const std::vector<inotify::Event> none;
+
+  void read(const Config &config, const std::string &filename);
+  const Batch &current() const { return batches[next - 1]; }
+
+public:
+  /// Replays 'filename', which must have been recorded with the same entries
+  /// as 'config' (those that aren't polled)
+  ReplayWatcher(yield_context &yield, const Config &config,
+                const std::string &filename, double speed = 1,
+                std::function<void()> onReplayed = nullptr);
+
+  /// Once the trace runs out, it never returns
+  const std::vector<inotify::Event> &waitForEvents() override;
+  std::string path(const inotify::Event &event) const override;
+  const EntryIndex::Entries &
+  entries(const inotify::Event &event) const override;
+  /// Walks the new directory, as the kernel watchers do; there's nothing to
+  /// watch
+  LocalTree directoryCreated(yield_context yield, const ConfigEntry &entry,
+                             const std::string &path, bool moved) override;
+  bool directoryMoved(const std::string &from, const std::string &to) override;
+  void directoryGone(const std::string &path) override;
+  /// Every entry we replay for
+  std::vector<const ConfigEntry *>
+  overflowed(const inotify::Event &event) const override;
+  /// The trace's events stay with the entries it was read with
+  void reconfigure(yield_context yield, const Config &config,
+                   const std::vector<const ConfigEntry *> &added,
+                   LocalTrees *trees = nullptr) override;
+  /// The trace's events still point at the entries it was read with, so
+  /// once those are forgotten, the rest of it is for nobody
+  void forgetOldConfigs() override;
+};
+
+} /* cdnalizerd  */
@@ -0,0 +1,63 @@
+#include "Watcher.hpp"
+
+#include "FANotifyWatcher.hpp"
+#include "INotifyWatcher.hpp"
+#include "TraceWatcher.hpp"
+#include "logging.hpp"
+
+#include <system_error>
+
+namespace cdnalizerd {
+
+WatcherKind _global_watcher_kind(WatcherKind::inotify);
+
+void watcherKind(WatcherKind kind) { _global_watcher_kind = kind; }
+
+WatcherKind watcherKind() { return _global_watcher_kind; }
+
+unsigned _global_inotify_shards(4);
+
+void inotifyShards(unsigned count) { _global_inotify_shards = count; }
+
+unsigned inotifyShards() { return _global_inotify_shards; }
+
+namespace {
+
+std::unique_ptr<Watcher> makeKernelWatcher(yield_context &yield,
+                                           const Config &config,
+                                           LocalTrees *trees) {
+  std::unique_ptr<Watcher> result;
+  if (watcherKind() == WatcherKind::fanotify) {
+    try {
+      result.reset(new FANotifyWatcher(yield, config));
+      LOG_S(INFO) << "Watching for changes with fanotify";
+      return result;
+    } catch (std::system_error &e) {
+      LOG_S(WARNING) << "Can't use fanotify (" << e.what()
+                     << "). Using inotify instead";
+    }
+  }
+  result.reset(new INotifyWatcher(yield, config, trees));
+  return result;
+}
+
+} /* anonymous namespace */
+
+std::unique_ptr<Watcher> makeWatcher(yield_context &yield,
+                                     const Config &config,
+                                     LocalTrees *trees) {
+  const TraceSettings &trace = traceSettings();
+  std::unique_ptr<Watcher> result;
+  if (!trace.replay.empty()) {
+    result.reset(new ReplayWatcher(yield, config, trace.replay, trace.speed,
+                                   trace.onReplayed));
+    return result;
+  }
+  result = makeKernelWatcher(yield, config, trees);
+  if (!trace.record.empty())
+    result.reset(
+        new RecordingWatcher(std::move(result), config, trace.record));
+  return result;
+}
+
+} /* cdnalizerd  */
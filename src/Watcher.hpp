@@ -0,0 +1,90 @@
+#pragma once
+/// Tells us about changes to the files under our config entries' directories.
+/// There's one implementation per kernel API: inotify, which needs a watch on
+/// every directory, and fanotify, which watches whole file systems at once.
+
+#include "DirectoryWalker.hpp"
+#include "EntryIndex.hpp"
+#include "common.hpp"
+#include "config/config.hpp"
+#include "inotify.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+
+/// Both backends give us inotify::Events; fanotify's event bits are the same
+/// as inotify's. What an event's 'wd' means is up to the watcher that made it
+class Watcher {
+public:
+  virtual ~Watcher() {}
+  /// Waits for events, then returns every one we have, in order. They're only
+  /// valid until the next call
+  virtual const std::vector<inotify::Event> &waitForEvents() = 0;
+  /// The full path of the file (or directory) an event happened to
+  virtual std::string path(const inotify::Event &event) const = 0;
+  /// The config entries an event belongs to; none if it's not ours (for
+  /// example, a queue overflow). Overlapping entries share their watches, so
+  /// one event can be for several. They point into the Config the watcher was
+  /// made with
+  virtual const EntryIndex::Entries &
+  entries(const inotify::Event &event) const = 0;
+  /// Called when a directory turns up under 'entry': made there, or 'moved'
+  /// in. Watches it and everything under it, and returns the files that were
+  /// already in it, that we won't get events for. Suspends the coroutine
+  /// while it walks the tree. It's fine to call it for a directory that's
+  /// already watched
+  virtual LocalTree directoryCreated(yield_context yield,
+                                     const ConfigEntry &entry,
+                                     const std::string &path, bool moved) = 0;
+  /// A directory in our trees has been renamed from 'from' to 'to'. Returns
+  /// false if we can't follow it; then it's gone, and the new one has to be
+  /// treated as a new directory
+  virtual bool directoryMoved(const std::string &from,
+                              const std::string &to) = 0;
+  /// A directory has left our trees. Stops watching it and everything under it
+  virtual void directoryGone(const std::string &path) = 0;
+  /// The config entries that may have lost events, when 'event' says a
+  /// kernel queue overflowed
+  virtual std::vector<const ConfigEntry *>
+  overflowed(const inotify::Event &event) const = 0;
+  /// The config has been reloaded as 'config', which must outlive us. What's
+  /// still under one of its entries stays watched as it is, and gets its
+  /// events for the new entries from now on; what isn't is dropped. 'added'
+  /// are its entries that weren't in the old one; their trees are watched,
+  /// and if 'trees' is given, what we found goes in it. Events and entry sets
+  /// already handed out stay good, pointing into the old config, so that must
+  /// stay until forgetOldConfigs(). Suspends the coroutine while it walks
+  virtual void reconfigure(yield_context yield, const Config &config,
+                           const std::vector<const ConfigEntry *> &added,
+                           LocalTrees *trees = nullptr) = 0;
+  /// Lets go of everything for the configs before the one we were last
+  /// reconfigured with. Call once nothing we've handed out for them is in use
+  /// any more; then they can go
+  virtual void forgetOldConfigs() = 0;
+};
+
+enum class WatcherKind { inotify, fanotify };
+
+/// Sets which kind of watcher makeWatcher() tries to make
+void watcherKind(WatcherKind kind);
+WatcherKind watcherKind();
+
+/// Sets how many inotify handles (each read by a thread of its own) the
+/// inotify watcher spreads the config entries over. Each handle has its own
+/// kernel queue, so more of them means more room before one overflows
+void inotifyShards(unsigned count);
+unsigned inotifyShards();
+
+/// Makes a watcher for the entries of 'config' that aren't polled, and starts
+/// watching. If we can't use fanotify (it needs CAP_SYS_ADMIN and
+/// CAP_DAC_READ_SEARCH), we fall back to inotify. If the watcher walks the
+/// trees to set up, it leaves what it found in 'trees'. If traceSettings() says so, the events are recorded, or
+/// come from a recording instead (see TraceWatcher.hpp)
+std::unique_ptr<Watcher> makeWatcher(yield_context &yield,
+                                     const Config &config,
+                                     LocalTrees *trees = nullptr);
+
+} /* cdnalizerd  */
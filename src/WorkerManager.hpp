@@ -14,12 +14,21 @@ private:
   /// Maps a url to a list of workers with open connections to that URL
   std::map<std::string, std::list<Worker>> workers;
 public:
+  /// The workers for one URL. It stays put, so it can be looked up once and
+  /// kept
+  using Lane = std::map<std::string, std::list<Worker>>::value_type;
+  Lane &lane(const std::string &url) {
+    return *workers.emplace(url, std::list<Worker>()).first;
+  }
   /// Returns an iterator to the worker with the least load; creates a worker if
   /// necessary
   std::list<Worker>::iterator getWorker(const std::string &url, const Rackspace& rs) {
-    std::list<Worker> &list(workers[url]);
+    return getWorker(lane(url), rs);
+  }
+  std::list<Worker>::iterator getWorker(Lane &lane, const Rackspace &rs) {
+    std::list<Worker> &list(lane.second);
     if (list.size() < MAX_WORKERS_PER_URL) {
-      list.push_front(Worker(rs, url));
+      list.push_front(Worker(rs, lane.first));
       auto result = list.begin();
       result->launch([result, &list, this]() { list.erase(result); });
       return result;
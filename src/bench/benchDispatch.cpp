@@ -0,0 +1,101 @@
+/// Times how fast file events can be turned into where their jobs go: the
+/// account, the workers for its URL and the object's URL. It does it the old
+/// way (looking the account and workers up by name, then building the URL out
+/// of its parts and parsing it) and from each entry's precomputed
+/// Destination, and checks they come up with the same answers.
+///
+/// Usage: benchDispatch [events]
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../processes/destinations.hpp"
+
+using namespace cdnalizerd;
+using namespace cdnalizerd::processes;
+namespace fs = boost::filesystem;
+using Clock = std::chrono::steady_clock;
+
+constexpr int entryCount = 20;
+
+/// A login with 'url' as its cloud files in region 'r'
+Rackspace standInAccount(const std::string &url) {
+  json endpoints = json::array();
+  endpoints.push_back(
+      json{{"region", "r"}, {"publicURL", url}, {"internalURL", url}});
+  json cloudFiles{{"name", "cloudFiles"}, {"endpoints", endpoints}};
+  json catalog = json::array();
+  catalog.push_back(cloudFiles);
+  json login{{"access",
+              {{"token", {{"id", "bench"}}}, {"serviceCatalog", catalog}}}};
+  return Rackspace(std::move(login));
+}
+
+void report(const char *name, std::size_t events, double took) {
+  std::cout << name << ": " << took << "s - " << std::size_t(events / took)
+            << " events a second" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t count = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+  Config config;
+  for (int i = 0; i != entryCount; ++i) {
+    std::string site(std::to_string(i));
+    config.addEntry(ConfigEntry("user", "key", "r", "site-" + site, false,
+                                false, "/var/www/site-" + site + "/",
+                                "/uploads", {}, {}));
+  }
+  AccountCache accounts;
+  accounts.emplace("user", standInAccount(
+                               "https://storage.example.com/v1/MossoCloudFS"));
+  WorkerManager workers;
+  Destinations destinations(config, accounts, workers);
+
+  // Files laid out like a site's uploads
+  std::mt19937 random(42);
+  std::vector<std::pair<const ConfigEntry *, std::string>> events;
+  for (std::size_t i = 0; i != count; ++i) {
+    const ConfigEntry &entry = config.entries()[random() % entryCount];
+    events.emplace_back(&entry, entry.local_dir +
+                                    std::to_string(2010 + random() % 10) +
+                                    "/" + std::to_string(1 + random() % 12) +
+                                    "/photo " + std::to_string(i) + ".jpg");
+  }
+
+  // Where each event's job would go
+  using Job = std::pair<const WorkerManager::Lane *, std::string>;
+  std::vector<Job> old;
+  old.reserve(count);
+  auto start = Clock::now();
+  for (const auto &event : events) {
+    const ConfigEntry &entry = *event.first;
+    const Rackspace &rs = accounts.find(entry.username)->second;
+    URL url(rs.getURL(entry.region, entry.snet));
+    WorkerManager::Lane &lane = workers.lane(url.whole());
+    URL object(url / entry.container / entry.remote_dir /
+               fs::path(event.second).lexically_relative(entry.local_dir)
+                   .string());
+    old.emplace_back(&lane, object.whole());
+  }
+  std::chrono::duration<double> took(Clock::now() - start);
+  report("by name", count, took.count());
+
+  std::vector<Job> precomputed;
+  precomputed.reserve(count);
+  start = Clock::now();
+  for (const auto &event : events) {
+    const Destination &destination = destinations[*event.first];
+    URL object(destination.object(event.second));
+    precomputed.emplace_back(destination.lane, object.whole());
+  }
+  took = Clock::now() - start;
+  report("precomputed", count, took.count());
+
+  // Both should have picked the same workers and made the same URLs
+  return old == precomputed ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+/// Replays a storm of synthetic inotify events from a memfd, comparing the old
+/// way of reading them (one event's worth per read, then shuffling the
+/// leftovers to the front of the buffer) with reading 64 KiB at a time and
+/// parsing every event in place.
+///
+/// Usage: benchINotify [event count]
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../inotify.hpp"
+
+using namespace cdnalizerd;
+using Clock = std::chrono::steady_clock;
+
+/// Makes what the kernel would give us: events with names padded with nulls
+/// to a multiple of 16 bytes
+std::string makeEvents(std::size_t count) {
+  std::string result;
+  for (std::size_t i = 0; i != count; ++i) {
+    std::string name("file-" + std::to_string(i) + ".jpg");
+    inotify_event event;
+    event.wd = 1 + (i % 100);
+    event.mask = (i % 3 == 0) ? IN_CREATE : IN_CLOSE_WRITE;
+    event.cookie = 0;
+    // Some events (on the watched directory itself) have no name at all
+    event.len = (i % 50 == 0) ? 0 : (name.size() + 16) & ~std::size_t(15);
+    result.append(reinterpret_cast<const char *>(&event), sizeof(event));
+    if (event.len != 0) {
+      name.resize(event.len, '\0');
+      result.append(name);
+    }
+  }
+  return result;
+}
+
+void report(const std::string &name, Clock::duration took, std::size_t events,
+            std::size_t reads) {
+  double seconds = std::chrono::duration<double>(took).count();
+  std::cout << std::setw(16) << std::left << name << std::fixed
+            << std::setprecision(3) << seconds << "s  "
+            << std::setprecision(2) << (events / seconds / 1000000)
+            << "M events/s  " << reads << " reads" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t count = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+  std::string events(makeEvents(count));
+  int fd = memfd_create("benchINotify", MFD_CLOEXEC);
+  if ((fd == -1) ||
+      (write(fd, events.data(), events.size()) !=
+       static_cast<ssize_t>(events.size()))) {
+    std::cerr << "Unable to make the memfd: " << std::strerror(errno)
+              << std::endl;
+    return 1;
+  }
+  std::cout << "Replaying " << count << " events (" << events.size()
+            << " bytes)" << std::endl;
+  int result = 0;
+
+  {
+    // The old way: read up to one event's worth, make the event, then move
+    // what's left to the front of the buffer
+    lseek(fd, 0, SEEK_SET);
+    char buffer[sizeof(inotify_event) + NAME_MAX + 1];
+    char *end = buffer;
+    std::size_t made = 0;
+    std::size_t reads = 0;
+    auto start = Clock::now();
+    while (true) {
+      std::size_t size = end - buffer;
+      if ((size < sizeof(inotify_event)) ||
+          (size < sizeof(inotify_event) +
+                      reinterpret_cast<inotify_event *>(buffer)->len)) {
+        ssize_t got = read(fd, end, sizeof(buffer) - size);
+        ++reads;
+        if (got <= 0)
+          break;
+        end += got;
+        continue;
+      }
+      const inotify_event *event = reinterpret_cast<inotify_event *>(buffer);
+      inotify::Event made_event(event->wd, event->mask, event->cookie,
+                                event->name, event->len);
+      ++made;
+      std::size_t used = sizeof(inotify_event) + event->len;
+      std::copy(buffer + used, end, buffer);
+      end -= used;
+    }
+    report("one at a time", Clock::now() - start, made, reads);
+    if (made != count)
+      result = 1;
+  }
+
+  {
+    // The new way: read a lot, and parse all of it in place
+    lseek(fd, 0, SEEK_SET);
+    std::vector<char> buffer(inotify::Instance::bufferSize);
+    std::size_t pending = 0;
+    std::size_t made = 0;
+    std::size_t reads = 0;
+    std::vector<inotify::Event> batch;
+    auto start = Clock::now();
+    while (true) {
+      ssize_t got = read(fd, buffer.data() + pending, buffer.size() - pending);
+      ++reads;
+      if (got <= 0)
+        break;
+      std::size_t size = pending + got;
+      batch.clear();
+      std::size_t used = inotify::forEachEvent(
+          buffer.data(), size, [&](const inotify_event &event) {
+            batch.emplace_back(event.wd, event.mask, event.cookie,
+                               event.name, event.len);
+          });
+      made += batch.size();
+      pending = size - used;
+      std::memmove(buffer.data(), buffer.data() + used, pending);
+    }
+    report("batched", Clock::now() - start, made, reads);
+    if (made != count)
+      result = 1;
+  }
+  close(fd);
+  return result;
+}
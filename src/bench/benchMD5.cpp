@@ -0,0 +1,75 @@
+/// Compares hashing lots of files one by one with openssl, against hashing
+/// them together through each of the multi-buffer md5 engines.
+///
+/// Usage: benchMD5 [file count] [file size in bytes]
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../jobs/md5.hpp"
+#include "../jobs/multiMD5.hpp"
+
+using namespace cdnalizerd::jobs;
+namespace fs = boost::filesystem;
+using Clock = std::chrono::steady_clock;
+
+void report(const std::string &name, Clock::duration took, size_t bytes) {
+  double seconds = std::chrono::duration<double>(took).count();
+  std::cout << std::setw(20) << std::left << name << std::fixed
+            << std::setprecision(3) << seconds << "s  "
+            << std::setprecision(1) << (bytes / seconds / 1024 / 1024)
+            << " MiB/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = (argc > 1) ? std::stoul(argv[1]) : 2000;
+  size_t size = (argc > 2) ? std::stoul(argv[2]) : 256 * 1024;
+  std::cout << "Hashing " << count << " files of " << size << " bytes"
+            << std::endl;
+
+  fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  std::vector<fs::path> paths;
+  std::string data(size, '\0');
+  for (size_t i = 0; i != size; ++i)
+    data[i] = static_cast<char>(i * 7 + 3);
+  for (size_t i = 0; i != count; ++i) {
+    fs::path path = dir / std::to_string(i);
+    std::ofstream(path.native(), std::ios::binary) << data;
+    paths.push_back(path);
+  }
+  size_t total = count * size;
+
+  // Warm the page cache, so we're measuring hashing rather than the disk
+  std::vector<std::string> expected;
+  for (const fs::path &path : paths)
+    expected.push_back(md5_from_file(path));
+
+  auto start = Clock::now();
+  for (const fs::path &path : paths)
+    md5_from_file(path);
+  report("openssl one by one", Clock::now() - start, total);
+
+  int result = 0;
+  for (MD5Engine engine :
+       {MD5Engine::scalar, MD5Engine::avx2, MD5Engine::avx512}) {
+    if (!md5EngineSupported(engine))
+      continue;
+    start = Clock::now();
+    std::vector<std::string> got = md5_from_files(paths, engine);
+    report(md5EngineName(engine), Clock::now() - start, total);
+    if (got != expected) {
+      std::cerr << md5EngineName(engine) << " got the wrong answer"
+                << std::endl;
+      ++result;
+    }
+  }
+  fs::remove_all(dir);
+  return result;
+}
@@ -0,0 +1,326 @@
+/// Plays a trace of file events (recorded with cdnalizerd --go
+/// --record-events) through the daemon's dispatcher, against a local stand-in
+/// for cloud files, and reports how long it took and what the server was
+/// asked to do.
+///
+/// The stand-in keeps nothing: listings are empty, HEADs and server side
+/// copies find nothing (so everything gets uploaded), PUTs are hashed and get
+/// their md5 back as the ETag, and DELETEs succeed. The files the events name
+/// are read from disk, so replay it over the trees it was recorded on. The
+/// startup sync runs alongside the events, as it does in the daemon, and its
+/// time is included.
+///
+/// Usage: benchReplay <trace> <config file> [speed, 0 for as fast as we can]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "../AccountCache.hpp"
+#include "../BlockingPool.hpp"
+#include "../TraceWatcher.hpp"
+#include "../config/config_reader.hpp"
+#include "../https.hpp"
+#include "../jobs/md5.hpp"
+#include "../processes/mainProcess.hpp"
+
+using namespace cdnalizerd;
+namespace fs = boost::filesystem;
+using Clock = std::chrono::steady_clock;
+
+/// Makes a throw away key and self signed certificate for 'localhost'
+void makeCertificate(EVP_PKEY *&key, X509 *&cert) {
+  EVP_PKEY_CTX *keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY_keygen_init(keyCtx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1);
+  key = nullptr;
+  EVP_PKEY_keygen(keyCtx, &key);
+  EVP_PKEY_CTX_free(keyCtx);
+
+  cert = X509_new();
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509V3_CTX v3;
+  X509V3_set_ctx_nodb(&v3);
+  X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+  X509_EXTENSION *san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name,
+                                            (char *)"DNS:localhost");
+  X509_add_ext(cert, san, -1);
+  X509_EXTENSION_free(san);
+  X509_sign(cert, key, EVP_sha256());
+}
+
+/// A blocking HTTPS server, with a thread per connection, that answers like
+/// an empty cloud files account
+class StandInServer {
+private:
+  asio::io_service ios;
+  tcp::acceptor acceptor;
+  SSL_CTX *ctx;
+  std::thread thread;
+  std::mutex mutex;
+  std::vector<std::thread> connections;
+  // The sockets still open, to shut down when we're done
+  std::set<int> sockets;
+
+  bool readSome(SSL *ssl, std::string &buffer) {
+    char chunk[256 * 1024];
+    int got = SSL_read(ssl, chunk, sizeof(chunk));
+    if (got <= 0)
+      return false;
+    buffer.append(chunk, got);
+    return true;
+  }
+
+  void serve(SSL *ssl) {
+    std::string buffer;
+    while (true) {
+      std::size_t headerEnd;
+      while ((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos)
+        if (!readSome(ssl, buffer))
+          return;
+      std::string headers(buffer, 0, headerEnd + 2);
+      buffer.erase(0, headerEnd + 4);
+      for (char &c : headers)
+        c = std::tolower(c);
+      std::string method(headers, 0, headers.find(' '));
+      std::size_t length = 0;
+      std::size_t found = headers.find("\r\ncontent-length:");
+      if (found != std::string::npos)
+        length = std::stoull(headers.substr(found + 17));
+      jobs::MD5Stream md5;
+      std::size_t remain = length;
+      while (remain > 0) {
+        if (buffer.empty() && !readSome(ssl, buffer))
+          return;
+        std::size_t amount = std::min(remain, buffer.size());
+        md5.update(buffer.data(), amount);
+        buffer.erase(0, amount);
+        remain -= amount;
+      }
+      md5.finish();
+      std::string status;
+      if (method == "get") {
+        ++lists;
+        status = "204 No Content";
+      } else if (method == "head") {
+        ++heads;
+        status = "404 Not Found";
+      } else if ((method == "put") &&
+                 (headers.find("\r\nx-copy-from:") != std::string::npos)) {
+        ++copies;
+        status = "404 Not Found";
+      } else if (method == "put") {
+        ++puts;
+        received += length;
+        status = "201 Created\r\nEtag: " + md5.hex();
+      } else if (method == "delete") {
+        ++deletes;
+        status = "204 No Content";
+      } else
+        status = "405 Method Not Allowed";
+      lastRequest = Clock::now().time_since_epoch().count();
+      std::string response("HTTP/1.1 " + status +
+                           "\r\nContent-Length: 0\r\n\r\n");
+      SSL_write(ssl, response.data(), response.size());
+    }
+  }
+
+  void connection(tcp::socket sock) {
+    int fd = sock.native_handle();
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1) {
+      serve(ssl);
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    std::lock_guard<std::mutex> lock(mutex);
+    sockets.erase(fd);
+    --open;
+  }
+
+  void run() {
+    while (true) {
+      tcp::socket sock(ios);
+      boost::system::error_code ec;
+      acceptor.accept(sock, ec);
+      if (ec)
+        return;
+      std::lock_guard<std::mutex> lock(mutex);
+      sockets.insert(sock.native_handle());
+      ++open;
+      connections.emplace_back(&StandInServer::connection, this,
+                               std::move(sock));
+    }
+  }
+
+public:
+  std::atomic<std::uint64_t> lists{0}, heads{0}, puts{0}, copies{0},
+      deletes{0}, received{0};
+  // Connections open now
+  std::atomic<int> open{0};
+  // When the last response went out, as Clock ticks
+  std::atomic<Clock::rep> lastRequest{0};
+
+  StandInServer(EVP_PKEY *key, X509 *cert)
+      : acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0)),
+        ctx(SSL_CTX_new(TLS_server_method())) {
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_use_certificate(ctx, cert);
+    SSL_CTX_use_PrivateKey(ctx, key);
+    thread = std::thread([this]() { run(); });
+  }
+  ~StandInServer() {
+    boost::system::error_code ec;
+    acceptor.close(ec);
+    thread.join();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (int fd : sockets)
+        shutdown(fd, SHUT_RDWR);
+    }
+    for (std::thread &connection : connections)
+      connection.join();
+    SSL_CTX_free(ctx);
+  }
+  unsigned short port() const { return acceptor.local_endpoint().port(); }
+};
+
+/// A login for every account in 'config', with 'url' as its cloud files in
+/// every region
+AccountCache standInAccounts(const Config &config, const std::string &url) {
+  std::map<std::string, std::set<std::string>> regions;
+  for (const ConfigEntry &entry : config.entries())
+    regions[entry.username].insert(entry.region);
+  AccountCache result;
+  for (const auto &account : regions) {
+    json endpoints = json::array();
+    for (const std::string &region : account.second)
+      endpoints.push_back(
+          json{{"region", region}, {"publicURL", url}, {"internalURL", url}});
+    json cloudFiles{{"name", "cloudFiles"}, {"endpoints", endpoints}};
+    json catalog = json::array();
+    catalog.push_back(cloudFiles);
+    json login{{"access",
+                {{"token", {{"id", "bench"}}}, {"serviceCatalog", catalog}}}};
+    result.emplace(account.first, Rackspace(std::move(login)));
+  }
+  return result;
+}
+
+double seconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: benchReplay <trace> <config file> [speed, 0 for as "
+                 "fast as we can]"
+              << std::endl;
+    return 1;
+  }
+  init_logging(WARNING);
+  Config config = read_config(argv[2]);
+  double speed = (argc > 3) ? std::stod(argv[3]) : 1;
+
+  EVP_PKEY *key;
+  X509 *cert;
+  makeCertificate(key, cert);
+  fs::path caFile = fs::temp_directory_path() / fs::unique_path();
+  FILE *pem = fopen(caFile.c_str(), "w");
+  PEM_write_X509(pem, cert);
+  fclose(pem);
+
+  StandInServer server(key, cert);
+  TLSSettings tls;
+  tls.caFile = caFile.native();
+  tls.port = std::to_string(server.port());
+  tlsSettings(tls);
+
+  asio::io_service ios;
+  service(&ios);
+  BlockingPool pool(4);
+  blockingPool(&pool);
+  AccountCache accounts(standInAccounts(config, "https://localhost/v1/bench"));
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point replayed;
+  TraceSettings trace;
+  trace.replay = argv[1];
+  trace.speed = speed;
+  trace.onReplayed = [&]() {
+    replayed = Clock::now();
+    // Wait for the workers to finish their jobs and hang up
+    asio::spawn(ios, [&](yield_context yield) {
+      asio::deadline_timer timer(ios);
+      while ((server.open != 0) ||
+             (Clock::now() - Clock::time_point(Clock::duration(
+                                 server.lastRequest)) <
+              std::chrono::seconds(2))) {
+        timer.expires_from_now(boost::posix_time::milliseconds(100));
+        timer.async_wait(yield);
+      }
+      ios.stop();
+    });
+  };
+  traceSettings(trace);
+  asio::spawn(ios, [&](yield_context yield) {
+    processes::watchForFileChanges(yield, config, &accounts);
+  });
+  ios.run();
+  if (replayed == Clock::time_point()) {
+    std::cerr << "The replay didn't finish" << std::endl;
+    return 1;
+  }
+
+  Clock::time_point caughtUp = std::max(
+      replayed, Clock::time_point(Clock::duration(server.lastRequest)));
+  std::cout << std::fixed << std::setprecision(3) << "Replayed in "
+            << seconds(replayed - start) << "s ";
+  if (speed > 0)
+    std::cout << "at " << speed << "x";
+  else
+    std::cout << "as fast as we could";
+  std::cout << "; the server was done " << seconds(caughtUp - replayed)
+            << "s later" << std::endl
+            << "  " << server.lists << " listings, " << server.heads
+            << " HEADs, " << server.puts << " uploads ("
+            << std::setprecision(1) << (server.received / 1024.0 / 1024.0)
+            << " MiB), " << server.copies << " copies, " << server.deletes
+            << " deletes" << std::endl;
+  fs::remove(caFile);
+  // The dispatcher never returns, any more than the daemon does, so we leave
+  // it where it is
+  std::cout.flush();
+  std::_Exit(0);
+}
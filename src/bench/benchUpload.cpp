@@ -0,0 +1,227 @@
+/// Uploads the same file again and again to a local stand-in for cloud files,
+/// once over asio's user space TLS, and once through KTLSStream, where the
+/// kernel does the encryption (if it can) and bodies go out with sendfile.
+///
+/// The stand-in server is just enough HTTPS to accept PUTs: it hashes what it
+/// gets and sends the md5 back as the ETag, like cloud files does.
+///
+/// Usage: benchUpload [upload count] [file size in bytes]
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "../https.hpp"
+#include "../jobs/md5.hpp"
+#include "../jobs/upload.hpp"
+
+using namespace cdnalizerd;
+namespace fs = boost::filesystem;
+using Clock = std::chrono::steady_clock;
+
+/// Makes a throw away key and self signed certificate for 'localhost'
+void makeCertificate(EVP_PKEY *&key, X509 *&cert) {
+  EVP_PKEY_CTX *keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY_keygen_init(keyCtx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1);
+  key = nullptr;
+  EVP_PKEY_keygen(keyCtx, &key);
+  EVP_PKEY_CTX_free(keyCtx);
+
+  cert = X509_new();
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509V3_CTX v3;
+  X509V3_set_ctx_nodb(&v3);
+  X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+  X509_EXTENSION *san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name,
+                                            (char *)"DNS:localhost");
+  X509_add_ext(cert, san, -1);
+  X509_EXTENSION_free(san);
+  X509_sign(cert, key, EVP_sha256());
+}
+
+/// A blocking, one connection at a time, HTTPS server that takes PUTs
+class StandInServer {
+private:
+  asio::io_service ios;
+  tcp::acceptor acceptor;
+  SSL_CTX *ctx;
+  std::thread thread;
+
+  bool readSome(SSL *ssl, std::string &buffer) {
+    char chunk[256 * 1024];
+    int got = SSL_read(ssl, chunk, sizeof(chunk));
+    if (got <= 0)
+      return false;
+    buffer.append(chunk, got);
+    return true;
+  }
+
+  void serve(SSL *ssl) {
+    std::string buffer;
+    while (true) {
+      // Read the headers
+      std::size_t headerEnd;
+      while ((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos)
+        if (!readSome(ssl, buffer))
+          return;
+      std::string headers(buffer, 0, headerEnd);
+      buffer.erase(0, headerEnd + 4);
+      for (char &c : headers)
+        c = std::tolower(c);
+      std::size_t length = 0;
+      std::size_t found = headers.find("content-length:");
+      if (found != std::string::npos)
+        length = std::stoull(headers.substr(found + 15));
+      // Hash the body as it comes in
+      jobs::MD5Stream md5;
+      std::size_t remain = length;
+      while (remain > 0) {
+        if (buffer.empty() && !readSome(ssl, buffer))
+          return;
+        std::size_t amount = std::min(remain, buffer.size());
+        md5.update(buffer.data(), amount);
+        buffer.erase(0, amount);
+        remain -= amount;
+      }
+      md5.finish();
+      received += length;
+      std::string response("HTTP/1.1 201 Created\r\nEtag: " + md5.hex() +
+                           "\r\nContent-Length: 0\r\n\r\n");
+      SSL_write(ssl, response.data(), response.size());
+    }
+  }
+
+  void run() {
+    while (true) {
+      tcp::socket sock(ios);
+      boost::system::error_code ec;
+      acceptor.accept(sock, ec);
+      if (ec)
+        return;
+      SSL *ssl = SSL_new(ctx);
+      SSL_set_fd(ssl, sock.native_handle());
+      if (SSL_accept(ssl) == 1) {
+        serve(ssl);
+        SSL_shutdown(ssl);
+      }
+      SSL_free(ssl);
+    }
+  }
+
+public:
+  std::atomic<std::uint64_t> received{0};
+
+  StandInServer(EVP_PKEY *key, X509 *cert)
+      : acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0)),
+        ctx(SSL_CTX_new(TLS_server_method())) {
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_use_certificate(ctx, cert);
+    SSL_CTX_use_PrivateKey(ctx, key);
+    thread = std::thread([this]() { run(); });
+  }
+  ~StandInServer() {
+    boost::system::error_code ec;
+    acceptor.close(ec);
+    thread.join();
+    SSL_CTX_free(ctx);
+  }
+  unsigned short port() const { return acceptor.local_endpoint().port(); }
+};
+
+int main(int argc, char *argv[]) {
+  size_t count = (argc > 1) ? std::stoul(argv[1]) : 16;
+  size_t size = (argc > 2) ? std::stoul(argv[2]) : 64 * 1024 * 1024;
+  std::cout << "Uploading a " << size << " byte file " << count << " times"
+            << std::endl;
+
+  fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  fs::path file = dir / "upload";
+  {
+    std::string data(size, '\0');
+    for (size_t i = 0; i != size; ++i)
+      data[i] = static_cast<char>(i * 7 + 3);
+    std::ofstream(file.native(), std::ios::binary) << data;
+  }
+  // Warm the page cache
+  jobs::md5_from_file(file);
+
+  EVP_PKEY *key;
+  X509 *cert;
+  makeCertificate(key, cert);
+  fs::path caFile = dir / "ca.pem";
+  FILE *pem = fopen(caFile.c_str(), "w");
+  PEM_write_X509(pem, cert);
+  fclose(pem);
+
+  int result = 0;
+  {
+    StandInServer server(key, cert);
+    asio::io_service ios;
+    service(&ios);
+    for (bool kernelTLS : {false, true}) {
+      TLSSettings settings;
+      settings.kernelTLS = kernelTLS;
+      settings.caFile = caFile.native();
+      settings.port = std::to_string(server.port());
+      tlsSettings(settings);
+      std::uint64_t before = server.received;
+      Clock::duration took;
+      bool kernelSends = false;
+      asio::spawn(ios, [&](asio::yield_context yield) {
+        HTTPS conn(yield, "localhost");
+        kernelSends = conn.kernelSends();
+        URL dest("https://localhost/bench/upload");
+        auto start = Clock::now();
+        for (size_t i = 0; i != count; ++i)
+          jobs::makeUploadJob(file, dest).go(conn, "token");
+        took = Clock::now() - start;
+      });
+      ios.run();
+      ios.reset();
+      std::uint64_t sent = server.received - before;
+      double seconds = std::chrono::duration<double>(took).count();
+      std::string name(kernelTLS ? (kernelSends ? "kTLS + sendfile"
+                                                : "KTLSStream, user space")
+                                 : "asio ssl::stream");
+      std::cout << std::setw(24) << std::left << name << std::fixed
+                << std::setprecision(3) << seconds << "s  "
+                << std::setprecision(1) << (sent / seconds / 1024 / 1024)
+                << " MiB/s" << std::endl;
+      if (sent != count * size) {
+        std::cout << "  Server only got " << sent << " bytes" << std::endl;
+        result = 1;
+      }
+    }
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  fs::remove_all(dir);
+  return result;
+}
@@ -0,0 +1,78 @@
+/// Compares the old single threaded, stat per entry, tree walk with the
+/// parallel getdents64 one, on a tree it makes.
+///
+/// Usage: benchWalk [directories] [files per directory] [threads]
+/// Drop the page cache between runs (echo 3 > /proc/sys/vm/drop_caches) to
+/// see what it's like cold.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+
+#include "../BlockingPool.hpp"
+#include "../DirectoryWalker.hpp"
+
+using namespace cdnalizerd;
+namespace fs = boost::filesystem;
+using Clock = std::chrono::steady_clock;
+
+/// Makes 'directories' directories, nested up to three deep, with 'files'
+/// files in each
+void makeTree(const fs::path &root, std::size_t directories,
+              std::size_t files) {
+  for (std::size_t d = 0; d != directories; ++d) {
+    fs::path directory(root / std::to_string(d % 10) /
+                       std::to_string(d % 100) / std::to_string(d));
+    fs::create_directories(directory);
+    for (std::size_t f = 0; f != files; ++f)
+      std::ofstream(
+          (directory / ("file-" + std::to_string(f) + ".jpg")).native())
+          << f;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t directories = (argc > 1) ? std::stoul(argv[1]) : 10000;
+  std::size_t files = (argc > 2) ? std::stoul(argv[2]) : 20;
+  std::size_t threads = (argc > 3) ? std::stoul(argv[3]) : 4;
+  fs::path root(fs::temp_directory_path() / fs::unique_path());
+  std::cout << "Making " << directories << " directories with " << files
+            << " files each in " << root.native() << std::endl;
+  makeTree(root, directories, files);
+
+  {
+    // The old way: recursive_directory_iterator, and a stat for each entry
+    auto start = Clock::now();
+    std::size_t found = 0;
+    for (auto d = fs::recursive_directory_iterator(root); d != decltype(d)();
+         ++d) {
+      boost::system::error_code ec;
+      if (fs::is_directory(d->status(ec)))
+        ++found;
+    }
+    std::chrono::duration<double> took(Clock::now() - start);
+    std::cout << "recursive_directory_iterator: " << took.count() << "s - "
+              << found << " directories" << std::endl;
+  }
+
+  asio::io_service ios;
+  service(&ios);
+  BlockingPool pool(threads);
+  blockingPool(&pool);
+  asio::spawn(ios, [&root](yield_context yield) {
+    auto start = Clock::now();
+    LocalTree tree(walkTree(yield, root.native(), nullptr));
+    std::chrono::duration<double> took(Clock::now() - start);
+    std::cout << "walkTree: " << took.count() << "s - "
+              << tree.directories.size() << " directories, "
+              << tree.files.size() << " files" << std::endl;
+  });
+  ios.run();
+  blockingPool(nullptr);
+  fs::remove_all(root);
+  return 0;
+}
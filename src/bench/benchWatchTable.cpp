@@ -0,0 +1,96 @@
+/// Compares how much memory the old watch table (a map from watch handle to
+/// the watch and its path, and another from path to handle) takes with the
+/// tree of interned names, for a lot of watches, and how long it takes to get
+/// paths back out of each.
+///
+/// Usage: benchWatchTable [watches]
+
+#include <malloc.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "../DirectoryTree.hpp"
+
+using namespace cdnalizerd;
+using Clock = std::chrono::steady_clock;
+
+/// The path of the i'th directory; laid out like a site's uploads, so there
+/// are plenty of shared names
+std::string makePath(std::size_t i) {
+  return "/var/www/site-" + std::to_string(i % 50) + "/uploads/" +
+         std::to_string(2010 + (i / 50) % 10) + "/" +
+         std::to_string(1 + (i / 500) % 12) + "/" + std::to_string(i / 6000);
+}
+
+std::size_t allocated() { return mallinfo2().uordblks; }
+
+/// What inotify::Instance used to keep per watch
+struct OldWatch {
+  int inotify_handle;
+  int handle;
+  std::string path;
+};
+
+struct OldTable {
+  std::map<int, OldWatch> watches;
+  std::map<std::string, int> paths;
+};
+
+struct NewTable {
+  DirectoryTree directories;
+  std::unordered_map<int, DirectoryTree::Node> watches;
+};
+
+void report(const char *name, std::size_t bytes, std::size_t count,
+            double took) {
+  std::cout << name << ": " << bytes / (1024 * 1024) << " MiB - "
+            << bytes / count << " bytes per watch - " << took
+            << "s to make every path" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t count = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+  std::size_t total = 0;
+  {
+    std::size_t before = allocated();
+    std::unique_ptr<OldTable> table(new OldTable);
+    for (std::size_t i = 0; i != count; ++i) {
+      std::string path(makePath(i));
+      table->paths.emplace(path, i + 1);
+      table->watches.emplace(i + 1, OldWatch{3, int(i + 1), std::move(path)});
+    }
+    std::size_t bytes = allocated() - before;
+    auto start = Clock::now();
+    for (std::size_t i = 0; i != count; ++i) {
+      // It used to copy the directory's path, then add the name
+      std::string path(table->watches.at(i + 1).path);
+      total += path.size();
+    }
+    std::chrono::duration<double> took(Clock::now() - start);
+    report("maps of paths", bytes, count, took.count());
+  }
+  {
+    std::size_t before = allocated();
+    std::unique_ptr<NewTable> table(new NewTable);
+    for (std::size_t i = 0; i != count; ++i)
+      table->watches.emplace(i + 1, table->directories.add(makePath(i)));
+    std::size_t bytes = allocated() - before;
+    auto start = Clock::now();
+    std::string path;
+    for (std::size_t i = 0; i != count; ++i) {
+      path.clear();
+      table->directories.appendPath(table->watches.at(i + 1), path);
+      total -= path.size();
+    }
+    std::chrono::duration<double> took(Clock::now() - start);
+    report("directory tree", bytes, count, took.count());
+    std::cout << "(" << table->directories.size() << " nodes)" << std::endl;
+  }
+  // Both should have made the same paths
+  return total == 0 ? 0 : 1;
+}
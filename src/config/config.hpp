@@ -1,6 +1,7 @@
 #pragma once
 
 #include "errors.hpp"
+#include "ignore_matcher.hpp"
 #include "../common.hpp"
 
 #include <algorithm>
@@ -23,20 +24,32 @@ struct ConfigEntry {
   std::string container;
   bool snet;
   bool move; // Move file to cloud instead of just copy
+  // Look for changes by polling, for file systems where inotify doesn't see
+  // changes made elsewhere (NFS, GlusterFS)
+  bool poll = false;
   std::string local_dir;
   std::string remote_dir;
-  std::vector<std::regex> filesToIgnore;
-  std::vector<std::regex> directoriesToIgnore;
+  // The ignore patterns (regexes), as they were written. They're compiled
+  // into the matchers below, so add to them with addFileToIgnore() and
+  // addDirectoryToIgnore()
+  std::vector<std::string> filesToIgnore;
+  std::vector<std::string> directoriesToIgnore;
+  // Both lists together, and just the directories
+  IgnoreMatcher fileMatcher;
+  IgnoreMatcher directoryMatcher;
   ConfigEntry(std::string username, std::string apikey, std::string region,
               std::string container, bool snet, bool move,
               std::string local_dir, std::string remote_dir,
-              std::vector<std::regex> filesToIgnore,
-              std::vector<std::regex> directoriesToIgnore)
+              std::vector<std::string> filesToIgnore,
+              std::vector<std::string> directoriesToIgnore)
       : username(username), apikey(apikey), region(region),
         container(container), snet(snet), move(move),
-        local_dir(std::move(local_dir)), remote_dir(std::move(remote_dir)),
-        filesToIgnore(std::move(filesToIgnore)),
-        directoriesToIgnore(std::move(directoriesToIgnore)) {}
+        local_dir(std::move(local_dir)), remote_dir(std::move(remote_dir)) {
+    for (std::string &file : filesToIgnore)
+      addFileToIgnore(std::move(file));
+    for (std::string &directory : directoriesToIgnore)
+      addDirectoryToIgnore(std::move(directory));
+  }
 
   ConfigEntry() = default;
   ConfigEntry(const ConfigEntry&) = default;
@@ -50,12 +63,17 @@ struct ConfigEntry {
   /// Returns true if a directory should be ignored
   bool shouldIgnoreDirectory(const std::string &dirName) const;
 
-  /// Add a new file to ignore
-  void addFileToIgnore(std::regex file) {
+  /// Add a new file to ignore. Throws std::regex_error if it's not a valid
+  /// regex
+  void addFileToIgnore(std::string file) {
+    fileMatcher.add(file);
     filesToIgnore.emplace_back(std::move(file));
   }
-  /// Add a new directory to ignore
-  void addDirectoryToIgnore(std::regex directory) {
+  /// Add a new directory to ignore. Throws std::regex_error if it's not a
+  /// valid regex
+  void addDirectoryToIgnore(std::string directory) {
+    directoryMatcher.add(directory);
+    fileMatcher.add(directory);
     directoriesToIgnore.emplace_back(std::move(directory));
   }
 
@@ -72,14 +90,16 @@ struct ConfigEntry {
            (remote_dir < other.remote_dir) || (username < other.username) ||
            (region < other.region) || (container < other.container) ||
            (apikey < other.apikey) || (snet < other.snet) ||
-           (move < other.move);
+           (move < other.move) || (poll < other.poll);
   }
   bool operator==(const std::string &path) const { return local_dir == path; }
   bool operator==(const ConfigEntry &other) const {
     return (local_dir == other.local_dir) && (remote_dir == other.remote_dir) &&
            (username == other.username) && (region == other.region) &&
            (container == other.container) && (apikey == other.apikey) &&
-           (snet == other.snet) && (move == other.move);
+           (snet == other.snet) && (move == other.move) &&
+           (poll == other.poll) && (filesToIgnore == other.filesToIgnore) &&
+           (directoriesToIgnore == other.directoriesToIgnore);
   }
 };
 
@@ -29,6 +29,7 @@
  * region = DFW
  * container = cdn.supa.ws
  * snet = false
+ * poll = false
  * local_path = /var/www/vhosts/supa.ws/images/
  * remote_path = /images/
  *
@@ -67,12 +68,27 @@ namespace cdnalizerd {
 
 using boost::property_tree::ptree;
 
+/// Whether we know how to read 'filename', by its extension
+bool isConfigFile(const std::string &filename) {
+  return boost::iends_with(filename, ".ini") ||
+         boost::iends_with(filename, ".json") ||
+         boost::iends_with(filename, ".xml") ||
+         boost::iends_with(filename, ".info");
+}
+
 struct ConfigReader {
 
   Config config;
+  bool strict;
+
+  explicit ConfigReader(bool strict) : strict(strict) {}
 
   void readFile(const std::string &filename) {
     try {
+      if (strict && !isConfigFile(filename)) {
+        LOG_S(1) << "Not a config file: " << filename;
+        return;
+      }
       DLOG_S(9) << "Reading config file " << filename;
       ptree pt;
       // We can read any kind of config file from here:
@@ -90,6 +106,8 @@ struct ConfigReader {
       LOG_S(ERROR) << "Unable to load config file: '" << filename << "': "
                    << boost::current_exception_diagnostic_information(true)
                    << std::endl;
+      if (strict)
+        throw;
     }
   }
 
@@ -102,14 +120,15 @@ struct ConfigReader {
     entry.local_dir = pt.get<std::string>("local_dir");
     entry.remote_dir = pt.get<std::string>("remote_dir");
     entry.snet = pt.get("snet", false);
+    entry.poll = pt.get("poll", false);
     auto filesToIgnore = pt.get_child_optional("files-to-ignore");
     if (filesToIgnore)
       for( const auto& file : *filesToIgnore )
-        entry.addFileToIgnore(std::regex(file.second.get_value<std::string>()));
+        entry.addFileToIgnore(file.second.get_value<std::string>());
     auto directoriesToIgnore = pt.get_child_optional("directories-to-ignore");
     if (directoriesToIgnore)
       for( const auto& file : *directoriesToIgnore )
-        entry.addDirectoryToIgnore(std::regex(file.second.get_value<std::string>()));
+        entry.addDirectoryToIgnore(file.second.get_value<std::string>());
     config.addEntry(std::move(entry));
   }
 
@@ -119,10 +138,10 @@ struct ConfigReader {
 };
 
 /// Reads a configuration directory (eg. /etc/cdnalizerd)
-Config read_config(const std::string &dir_name) {
+Config read_config(const std::string &dir_name, bool strict) {
   namespace fs = boost::filesystem;
 
-  ConfigReader reader;
+  ConfigReader reader(strict);
 
   try {
     fs::path dir(dir_name);
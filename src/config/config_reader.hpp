@@ -8,8 +8,14 @@
 
 namespace cdnalizerd {
 
+/// Whether we know how to read 'filename' (.ini, .json, .xml or .info)
+bool isConfigFile(const std::string &filename);
+
 /** Reads in a config file.
  *
+ * If 'strict' is set, a file we can't read is an error, rather than being
+ * left out; a reload shouldn't drop the entries of a file that's half written.
+ * Files we don't know how to read are skipped then, rather than failing.
  **/
-Config read_config(const std::string& filename);
+Config read_config(const std::string& filename, bool strict = false);
 }
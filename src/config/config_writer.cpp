@@ -26,6 +26,7 @@ void writeEntry(std::string filename) {
   pt.put("region", "DFW");
   pt.put("container", "cloud-files-container");
   pt.put("snet", false);
+  pt.put("poll", false);
   pt.put("local_dir", "/var/www/mysite/images/");
   pt.put("remote_dir", "/images/");
   ptree filesToIgnore;
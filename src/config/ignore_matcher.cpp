@@ -0,0 +1,674 @@
+#include "ignore_matcher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <map>
+
+namespace cdnalizerd {
+
+namespace {
+
+// Bytes, then a made up one for the end of the path. A state's transition on
+// it says whether the path matches if it ends there
+constexpr int endSymbol = 256;
+constexpr int symbolCount = 257;
+using Symbols = std::bitset<symbolCount>;
+
+/// Past these, the patterns are left to std::regex
+constexpr std::size_t maxNodes = 20000;
+constexpr std::size_t maxStates = 2000;
+
+// Every DFA starts with these two states: nothing can match from here on,
+// and something already has
+constexpr std::uint32_t dead = 0;
+constexpr std::uint32_t matched = 1;
+
+/// How many directories each thread remembers the DFA's state for, across
+/// all the matchers
+constexpr std::size_t cacheSlots = 8;
+
+/// Thrown for what we don't compile; the pattern goes to std::regex instead
+struct Unsupported {};
+
+Symbols one(int symbol) {
+  Symbols result;
+  result.set(symbol);
+  return result;
+}
+
+Symbols range(int from, int to) {
+  Symbols result;
+  for (int i = from; i <= to; ++i)
+    result.set(i);
+  return result;
+}
+
+const Symbols &allBytes() {
+  static const Symbols result(range(0, 255));
+  return result;
+}
+
+const Symbols &digits() {
+  static const Symbols result(range('0', '9'));
+  return result;
+}
+
+const Symbols &wordBytes() {
+  static const Symbols result(range('a', 'z') | range('A', 'Z') |
+                              range('0', '9') | one('_'));
+  return result;
+}
+
+const Symbols &spaces() {
+  static const Symbols result(one(' ') | range('\t', '\r'));
+  return result;
+}
+
+/// The only symbol in 'symbols'
+int only(const Symbols &symbols) {
+  for (int i = 0; i != symbolCount; ++i)
+    if (symbols.test(i))
+      return i;
+  return -1;
+}
+
+/// A parsed pattern
+struct Ast {
+  enum Kind { set, concat, alternate, repeat, begins, ends };
+  Kind kind;
+  Symbols symbols{};
+  std::vector<Ast> children{};
+  // For repeats; -1 for no limit
+  int min = 0;
+  int max = 0;
+
+  static Ast setOf(Symbols symbols) {
+    Ast result{set};
+    result.symbols = symbols;
+    return result;
+  }
+};
+
+/// Parses the ECMAScript regexes we can make a DFA from
+class Parser {
+private:
+  boost::string_view pattern;
+  std::size_t at = 0;
+
+  bool done() const { return at == pattern.size(); }
+  char peek() const { return pattern[at]; }
+
+  Ast alternation() {
+    Ast first(concatenation());
+    if (done() || (peek() != '|'))
+      return first;
+    Ast result{Ast::alternate};
+    result.children.push_back(std::move(first));
+    while (!done() && (peek() == '|')) {
+      ++at;
+      result.children.push_back(concatenation());
+    }
+    return result;
+  }
+
+  Ast concatenation() {
+    Ast result{Ast::concat};
+    while (!done() && (peek() != '|') && (peek() != ')'))
+      result.children.push_back(repetition());
+    return result;
+  }
+
+  Ast repetition() {
+    Ast atom(this->atom());
+    if (done())
+      return atom;
+    Ast result{Ast::repeat};
+    switch (peek()) {
+    case '*':
+      result.max = -1;
+      ++at;
+      break;
+    case '+':
+      result.min = 1;
+      result.max = -1;
+      ++at;
+      break;
+    case '?':
+      result.max = 1;
+      ++at;
+      break;
+    case '{':
+      bounds(result.min, result.max);
+      break;
+    default:
+      return atom;
+    }
+    // Lazy or greedy makes no odds to whether it matches
+    if (!done() && (peek() == '?'))
+      ++at;
+    result.children.push_back(std::move(atom));
+    return result;
+  }
+
+  /// "{n}", "{n,}" or "{n,m}"
+  void bounds(int &min, int &max) {
+    ++at;
+    auto number = [this](int &result) {
+      std::size_t from = at;
+      result = 0;
+      while (!done() && std::isdigit(static_cast<unsigned char>(peek()))) {
+        result = result * 10 + (peek() - '0');
+        if (result > 1000)
+          throw Unsupported();
+        ++at;
+      }
+      return at != from;
+    };
+    if (!number(min))
+      throw Unsupported();
+    max = min;
+    if (!done() && (peek() == ',')) {
+      ++at;
+      if (!number(max))
+        max = -1;
+    }
+    if (done() || (peek() != '}') || ((max != -1) && (max < min)))
+      throw Unsupported();
+    ++at;
+  }
+
+  Ast atom() {
+    char c = pattern[at++];
+    switch (c) {
+    case '(': {
+      if (!done() && (peek() == '?')) {
+        // Only non capturing groups; lookaheads need more than a DFA
+        if ((at + 1 == pattern.size()) || (pattern[at + 1] != ':'))
+          throw Unsupported();
+        at += 2;
+      }
+      Ast inner(alternation());
+      if (done() || (peek() != ')'))
+        throw Unsupported();
+      ++at;
+      return inner;
+    }
+    case '.':
+      return Ast::setOf(allBytes() & ~(one('\n') | one('\r')));
+    case '[':
+      return Ast::setOf(bracket());
+    case '\\':
+      return Ast::setOf(escape(false));
+    case '^':
+      return Ast{Ast::begins};
+    case '$':
+      return Ast{Ast::ends};
+    case ')':
+    case ']':
+    case '{':
+    case '}':
+    case '*':
+    case '+':
+    case '?':
+      throw Unsupported();
+    default:
+      return Ast::setOf(one(static_cast<unsigned char>(c)));
+    }
+  }
+
+  /// After a '\'
+  Symbols escape(bool inBracket) {
+    if (done())
+      throw Unsupported();
+    char c = pattern[at++];
+    switch (c) {
+    case 'd':
+      return digits();
+    case 'D':
+      return allBytes() & ~digits();
+    case 'w':
+      return wordBytes();
+    case 'W':
+      return allBytes() & ~wordBytes();
+    case 's':
+      return spaces();
+    case 'S':
+      return allBytes() & ~spaces();
+    case 'n':
+      return one('\n');
+    case 'r':
+      return one('\r');
+    case 't':
+      return one('\t');
+    case 'f':
+      return one('\f');
+    case 'v':
+      return one('\v');
+    case '0':
+      if (!done() && std::isdigit(static_cast<unsigned char>(peek())))
+        throw Unsupported();
+      return one(0);
+    case 'x': {
+      if (at + 2 > pattern.size())
+        throw Unsupported();
+      std::string hex(pattern.substr(at, 2));
+      if (!std::isxdigit(static_cast<unsigned char>(hex[0])) ||
+          !std::isxdigit(static_cast<unsigned char>(hex[1])))
+        throw Unsupported();
+      at += 2;
+      return one(std::stoi(hex, nullptr, 16));
+    }
+    case 'b':
+      // A backspace in brackets, otherwise a word boundary
+      if (inBracket)
+        return one('\b');
+      throw Unsupported();
+    default:
+      // Back references, word boundaries, control letters and the like
+      if (std::isalnum(static_cast<unsigned char>(c)))
+        throw Unsupported();
+      return one(static_cast<unsigned char>(c));
+    }
+  }
+
+  /// After a '['
+  Symbols bracket() {
+    bool negate = !done() && (peek() == '^');
+    if (negate)
+      ++at;
+    Symbols result;
+    bool first = true;
+    while (true) {
+      if (done())
+        throw Unsupported();
+      char c = pattern[at++];
+      if (c == ']') {
+        // "[]" and "[^]" mean different things to different engines
+        if (first)
+          throw Unsupported();
+        break;
+      }
+      first = false;
+      // POSIX classes, collating elements and equivalence classes
+      if ((c == '[') && !done() &&
+          ((peek() == ':') || (peek() == '.') || (peek() == '=')))
+        throw Unsupported();
+      Symbols low(c == '\\' ? escape(true)
+                            : one(static_cast<unsigned char>(c)));
+      if ((low.count() == 1) && (at + 1 < pattern.size()) && (peek() == '-') &&
+          (pattern[at + 1] != ']')) {
+        ++at;
+        char d = pattern[at++];
+        Symbols high(d == '\\' ? escape(true)
+                               : one(static_cast<unsigned char>(d)));
+        if ((high.count() != 1) || (only(high) < only(low)))
+          throw Unsupported();
+        result |= range(only(low), only(high));
+      } else
+        result |= low;
+    }
+    return negate ? (allBytes() & ~result) : result;
+  }
+
+public:
+  explicit Parser(boost::string_view pattern) : pattern(pattern) {}
+
+  Ast parse() {
+    Ast result(alternation());
+    if (!done())
+      throw Unsupported();
+    return result;
+  }
+};
+
+/// The text a match of 'ast' always has in it. 'exact' is set if that's all
+/// a match ever is
+struct Literal {
+  bool exact;
+  std::string text;
+};
+
+Literal literalIn(const Ast &ast) {
+  switch (ast.kind) {
+  case Ast::set:
+    if (ast.symbols.count() != 1)
+      return {false, ""};
+    return {true, std::string(1, char(only(ast.symbols)))};
+  case Ast::begins:
+  case Ast::ends:
+    // Anchors don't take up any text
+    return {true, ""};
+  case Ast::concat: {
+    // Runs of exact text, and the longest we've seen
+    Literal result{true, ""};
+    std::string run;
+    auto keep = [&result](const std::string &text) {
+      if (text.size() > result.text.size())
+        result.text = text;
+    };
+    for (const Ast &child : ast.children) {
+      Literal literal(literalIn(child));
+      if (literal.exact) {
+        run += literal.text;
+        continue;
+      }
+      result.exact = false;
+      keep(run);
+      keep(literal.text);
+      run.clear();
+    }
+    if (result.exact)
+      result.text = run;
+    else
+      keep(run);
+    return result;
+  }
+  case Ast::repeat: {
+    if (ast.min == 0)
+      return {false, ""};
+    Literal literal(literalIn(ast.children.front()));
+    if ((ast.min == 1) && (ast.max == 1))
+      return literal;
+    return {false, literal.text};
+  }
+  case Ast::alternate:
+  default:
+    return {false, ""};
+  }
+}
+
+/// A Thompson NFA for all the patterns together
+class Nfa {
+public:
+  enum Kind { reads, split, begins, ends, match };
+  struct Node {
+    Kind kind;
+    // The node after, and for a split, the other one (if there is one)
+    int out = -1;
+    int other = -1;
+    // What a reading node takes
+    int set = -1;
+  };
+  std::vector<Node> nodes;
+  std::vector<Symbols> sets;
+  int start;
+
+private:
+  int add(Node node) {
+    if (nodes.size() == maxNodes)
+      throw Unsupported();
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+  int read(const Symbols &symbols, int next) {
+    sets.push_back(symbols);
+    return add({reads, next, -1, int(sets.size()) - 1});
+  }
+  int branch(int out, int other) { return add({split, out, other}); }
+
+  /// Adds the nodes for 'ast', going on to 'next' after it. Returns its first
+  int emit(const Ast &ast, int next) {
+    switch (ast.kind) {
+    case Ast::set:
+      return read(ast.symbols, next);
+    case Ast::begins:
+      return add({begins, next});
+    case Ast::ends:
+      return add({ends, next});
+    case Ast::concat:
+      for (auto child = ast.children.rbegin(); child != ast.children.rend();
+           ++child)
+        next = emit(*child, next);
+      return next;
+    case Ast::alternate: {
+      int first = emit(ast.children.back(), next);
+      for (std::size_t i = ast.children.size() - 1; i-- != 0;)
+        first = branch(emit(ast.children[i], next), first);
+      return first;
+    }
+    case Ast::repeat:
+    default: {
+      const Ast &child = ast.children.front();
+      int first = next;
+      if (ast.max == -1) {
+        // Loop back to a split that either goes round again or leaves
+        int loop = branch(-1, next);
+        nodes[loop].out = emit(child, loop);
+        first = loop;
+      } else
+        for (int i = ast.min; i != ast.max; ++i)
+          first = branch(emit(child, first), next);
+      for (int i = 0; i != ast.min; ++i)
+        first = emit(child, first);
+      return first;
+    }
+    }
+  }
+
+public:
+  explicit Nfa(const std::vector<Ast> &patterns) {
+    int matches = add({match});
+    int first = -1;
+    for (auto pattern = patterns.rbegin(); pattern != patterns.rend();
+         ++pattern) {
+      int begin = emit(*pattern, matches);
+      first = (first == -1) ? begin : branch(begin, first);
+    }
+    // A match can start anywhere, so we skip over anything to get to one
+    start = branch(-1, first);
+    nodes[start].out = read(allBytes(), start);
+  }
+};
+
+std::atomic<std::uint64_t> nextId(1);
+
+struct CachedDirectory {
+  std::uint64_t id = 0;
+  std::string directory;
+  std::uint32_t state = dead;
+};
+
+thread_local CachedDirectory directoryCache[cacheSlots];
+
+} /* anonymous namespace */
+
+struct IgnoreMatcher::Compiled {
+  // So the directory cache can tell matchers apart
+  std::uint64_t id = nextId++;
+  // symbolCount for each state
+  std::vector<std::uint32_t> transitions;
+  // The state once the start of the path has been read
+  std::uint32_t start = dead;
+  // If every path that can match has one of these in it; otherwise empty
+  std::vector<std::string> literals;
+  // The patterns the DFA doesn't do
+  std::vector<std::regex> fallback;
+
+  bool hasDfa() const { return !transitions.empty(); }
+
+  std::uint32_t run(std::uint32_t state, boost::string_view text) const {
+    const std::uint32_t *table = transitions.data();
+    for (char c : text) {
+      state = table[state * symbolCount + static_cast<unsigned char>(c)];
+      if (state <= matched)
+        break;
+    }
+    return state;
+  }
+
+  bool matches(std::uint32_t state) const {
+    return (state == matched) ||
+           ((state != dead) &&
+            (transitions[state * symbolCount + endSymbol] == matched));
+  }
+
+  bool mayMatch(boost::string_view path) const {
+    if (literals.empty())
+      return true;
+    for (const std::string &literal : literals)
+      if (path.find(literal) != boost::string_view::npos)
+        return true;
+    return false;
+  }
+
+  /// Builds the DFA from 'nfa', a state at a time. A state is the set of
+  /// nodes that read a byte, or wait for the end of the path
+  void build(const Nfa &nfa) {
+    std::map<std::vector<int>, std::uint32_t> states;
+    std::vector<std::vector<int>> pending;
+    transitions.assign(2 * symbolCount, dead);
+    std::fill(transitions.begin() + symbolCount, transitions.end(), matched);
+    // The nodes we can get to from 'from' without reading. '^' only holds
+    // at the start, and '$' at the end
+    auto follow = [&nfa](const std::vector<int> &from, bool atStart,
+                         bool atEnd, std::vector<int> &waiting) {
+      std::vector<bool> seen(nfa.nodes.size());
+      std::vector<int> stack(from);
+      while (!stack.empty()) {
+        int node = stack.back();
+        stack.pop_back();
+        if ((node == -1) || seen[node])
+          continue;
+        seen[node] = true;
+        const Nfa::Node &n = nfa.nodes[node];
+        switch (n.kind) {
+        case Nfa::match:
+          return true;
+        case Nfa::reads:
+          waiting.push_back(node);
+          break;
+        case Nfa::split:
+          stack.push_back(n.out);
+          stack.push_back(n.other);
+          break;
+        case Nfa::begins:
+          if (atStart)
+            stack.push_back(n.out);
+          break;
+        case Nfa::ends:
+          if (atEnd)
+            stack.push_back(n.out);
+          else
+            waiting.push_back(node);
+          break;
+        }
+      }
+      return false;
+    };
+    auto stateFor = [&](const std::vector<int> &from,
+                        bool atStart) -> std::uint32_t {
+      std::vector<int> waiting;
+      if (follow(from, atStart, false, waiting))
+        return matched;
+      if (waiting.empty())
+        return dead;
+      std::sort(waiting.begin(), waiting.end());
+      // The start state is the only one where '^' holds at the end too, so
+      // it's never shared
+      if (atStart)
+        waiting.push_back(-1);
+      auto found = states.find(waiting);
+      if (found != states.end())
+        return found->second;
+      if (states.size() == maxStates)
+        throw Unsupported();
+      std::uint32_t state = states.size() + 2;
+      states.emplace(waiting, state);
+      pending.push_back(std::move(waiting));
+      transitions.resize(transitions.size() + symbolCount, dead);
+      return state;
+    };
+    start = stateFor({nfa.start}, true);
+    for (std::uint32_t state = 2; state - 2 != pending.size(); ++state) {
+      // 'pending' grows as we go, so no references into it
+      std::vector<int> waiting(pending[state - 2]);
+      bool atStart = !waiting.empty() && (waiting.back() == -1);
+      if (atStart)
+        waiting.pop_back();
+      std::vector<int> next;
+      for (int symbol = 0; symbol != endSymbol; ++symbol) {
+        next.clear();
+        for (int node : waiting)
+          if ((nfa.nodes[node].kind == Nfa::reads) &&
+              nfa.sets[nfa.nodes[node].set].test(symbol))
+            next.push_back(nfa.nodes[node].out);
+        transitions[state * symbolCount + symbol] = stateFor(next, false);
+      }
+      // Whether it's a match if the path ends here
+      std::vector<int> ignored;
+      transitions[state * symbolCount + endSymbol] =
+          follow(waiting, atStart, true, ignored) ? matched : dead;
+    }
+  }
+};
+
+void IgnoreMatcher::add(const std::string &pattern) {
+  // std::regex decides what's valid
+  std::regex checked(pattern);
+  patterns.push_back(pattern);
+
+  std::shared_ptr<Compiled> result(std::make_shared<Compiled>());
+  std::vector<Ast> parsed;
+  bool everyLiteral = true;
+  for (const std::string &each : patterns) {
+    try {
+      parsed.push_back(Parser(each).parse());
+      Literal literal(literalIn(parsed.back()));
+      if (literal.text.empty())
+        everyLiteral = false;
+      else if (std::find(result->literals.begin(), result->literals.end(),
+                         literal.text) == result->literals.end())
+        result->literals.push_back(literal.text);
+    } catch (Unsupported &) {
+      result->fallback.emplace_back(each);
+    }
+  }
+  if (!everyLiteral)
+    result->literals.clear();
+  if (!parsed.empty()) {
+    try {
+      result->build(Nfa(parsed));
+    } catch (Unsupported &) {
+      // Too big; it's std::regex for everything
+      result->transitions.clear();
+      result->literals.clear();
+      result->fallback.clear();
+      for (const std::string &each : patterns)
+        result->fallback.emplace_back(each);
+    }
+  }
+  compiled = std::move(result);
+}
+
+bool IgnoreMatcher::search(boost::string_view path) const {
+  if (!compiled)
+    return false;
+  const Compiled &c = *compiled;
+  if (c.hasDfa()) {
+    // The files in a directory usually come together, so we start from
+    // where the DFA got to at the end of the directory last time
+    std::size_t slash = path.rfind('/');
+    boost::string_view directory(
+        path.substr(0, (slash == boost::string_view::npos) ? 0 : slash + 1));
+    CachedDirectory &cached = directoryCache[c.id % cacheSlots];
+    if ((cached.id == c.id) && (cached.directory == directory)) {
+      if (c.matches(c.run(cached.state, path.substr(directory.size()))))
+        return true;
+    } else if (c.mayMatch(path)) {
+      std::uint32_t state = c.run(c.start, directory);
+      cached.id = c.id;
+      cached.directory.assign(directory.data(), directory.size());
+      cached.state = state;
+      if (c.matches(c.run(state, path.substr(directory.size()))))
+        return true;
+    }
+  }
+  for (const std::regex &regex : c.fallback)
+    if (std::regex_search(path.begin(), path.end(), regex))
+      return true;
+  return false;
+}
+
+} /* cdnalizerd  */
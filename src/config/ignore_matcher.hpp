@@ -0,0 +1,44 @@
+#pragma once
+/// Matches paths against a set of ignore patterns all at once.
+///
+/// The patterns are ECMAScript regexes, as std::regex takes them, and a path
+/// is ignored if any of them matches somewhere in it. Rather than running
+/// each regex over the path in turn, they're compiled together into one DFA,
+/// which reads the path once, a byte at a time, however many patterns there
+/// are. Before that, a path without any of the literal text the patterns
+/// need ("tmp" for "\.tmp$", say) is turned away without running the DFA at
+/// all. And the DFA's state at the end of the last directory each thread saw
+/// is kept, so the files in one directory only cost their names.
+///
+/// Patterns that need what a DFA can't do (back references, lookahead, word
+/// boundaries, POSIX classes) are left to std::regex, as is every pattern if
+/// the DFA would get too big.
+
+#include <boost/utility/string_view.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+
+class IgnoreMatcher {
+private:
+  struct Compiled;
+  std::vector<std::string> patterns;
+  // Shared between copies, as it never changes once made
+  std::shared_ptr<const Compiled> compiled;
+
+public:
+  /// Adds 'pattern', and compiles the lot again. Throws std::regex_error if
+  /// it's not a valid regex
+  void add(const std::string &pattern);
+  /// True if any of the patterns matches somewhere in 'path'. Safe to call
+  /// from any thread
+  bool search(boost::string_view path) const;
+  bool empty() const { return patterns.empty(); }
+};
+
+} /* cdnalizerd  */
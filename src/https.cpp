@@ -15,5 +15,13 @@ asio::io_service& service() {
   assert(_global_ios);
   return *_global_ios;
 }
+
+TLSSettings _global_tls_settings;
+
+void tlsSettings(const TLSSettings &settings) {
+  _global_tls_settings = settings;
+}
+
+const TLSSettings &tlsSettings() { return _global_tls_settings; }
   
 } /* cdnalizerd  */ 
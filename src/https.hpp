@@ -5,10 +5,14 @@
 #include <boost/asio/spawn.hpp>
 #include <boost/beast.hpp>
 
+#include "KTLSStream.hpp"
 #include "logging.hpp"
 #include "exception_tags.hpp"
 #include "version.hpp"
 
+#include <cstdint>
+#include <memory>
+
 namespace cdnalizerd {
 
 namespace asio = boost::asio;
@@ -22,14 +26,64 @@ namespace http = boost::beast::http;
 void service(asio::io_service* ios);
 asio::io_service& service();
 
+/// How new HTTPS connections are made. Set once at start up
+struct TLSSettings {
+  /// Run TLS through our own OpenSSL session on the socket, so the kernel can
+  /// take over the encryption (kTLS), and uploads can use sendfile
+  bool kernelTLS = false;
+  /// An extra CA file to trust, as well as the system ones
+  std::string caFile;
+  /// The port to connect to
+  std::string port = "https";
+};
+
+void tlsSettings(const TLSSettings &settings);
+const TLSSettings &tlsSettings();
+
+/// What we talk HTTP over: either asio's TLS stream, or our own one that can
+/// hand the encryption to the kernel
+class HTTPSStream {
+public:
+  using AsioTLS = ssl::stream<tcp::socket &>;
+  using executor_type = tcp::socket::executor_type;
+
+private:
+  AsioTLS *asioTLS = nullptr;
+  KTLSStream *kernelTLS = nullptr;
+
+public:
+  HTTPSStream() = default;
+  HTTPSStream(AsioTLS &stream) : asioTLS(&stream) {}
+  HTTPSStream(KTLSStream &stream) : kernelTLS(&stream) {}
+  executor_type get_executor() {
+    return kernelTLS ? kernelTLS->get_executor() : asioTLS->get_executor();
+  }
+  template <typename MutableBuffers, typename Handler>
+  auto async_read_some(const MutableBuffers &buffers, Handler &&handler) {
+    if (kernelTLS)
+      return kernelTLS->async_read_some(buffers,
+                                        std::forward<Handler>(handler));
+    return asioTLS->async_read_some(buffers, std::forward<Handler>(handler));
+  }
+  template <typename ConstBuffers, typename Handler>
+  auto async_write_some(const ConstBuffers &buffers, Handler &&handler) {
+    if (kernelTLS)
+      return kernelTLS->async_write_some(buffers,
+                                         std::forward<Handler>(handler));
+    return asioTLS->async_write_some(buffers, std::forward<Handler>(handler));
+  }
+};
+
 class HTTPS {
 public:
-  using Stream = ssl::stream<asio::ip::tcp::socket &>;
+  using Stream = HTTPSStream;
 private:
   asio::io_service &ios;
   ssl::context ctx;
   tcp::socket sock;
-  std::unique_ptr<Stream> s;
+  std::unique_ptr<Stream::AsioTLS> s;
+  std::unique_ptr<KTLSStream> k;
+  Stream wrapped;
   std::string hostname;
 
 public:
@@ -37,18 +91,31 @@ public:
   boost::beast::flat_buffer read_buffer;
   void connect() {
     tcp::resolver dns{ios};
-    auto const lookup = dns.async_resolve({hostname, "https"}, yield);
+    auto const lookup =
+        dns.async_resolve({hostname, tlsSettings().port}, yield);
     asio::async_connect(sock, lookup, yield);
     sock.set_option(tcp::no_delay(true));
-    s.reset(new Stream(sock, ctx));
+    if (tlsSettings().kernelTLS) {
+      s.reset();
+      k.reset(new KTLSStream(sock, ctx.native_handle(), hostname));
+      k->handshake(yield);
+      wrapped = Stream(*k);
+      return;
+    }
+    k.reset();
+    s.reset(new Stream::AsioTLS(sock, ctx));
     s->set_verify_mode(ssl::verify_peer);
     s->set_verify_callback(ssl::rfc2818_verification(hostname));
-    s->handshake(Stream::client);
+    s->handshake(Stream::AsioTLS::client);
+    wrapped = Stream(*s);
   }
   void disconnect() {
     DLOG_S(9) << "Shutting down https connection: " << hostname;
     boost::system::error_code ec;
-    s->async_shutdown(yield[ec]);
+    if (k)
+      k->shutdown(yield, ec);
+    else
+      s->async_shutdown(yield[ec]);
     using asio::error::misc_errors;
     using asio::error::basic_errors;
     const auto &misc_cat = asio::error::get_misc_category();
@@ -57,8 +124,9 @@ public:
     // underlying transport (TCP FIN) without shutting down the SSL.
     // It may be a truncate attack attempt, but nothing we can do about it
     // except close the connection.
-    if (ec.category() == ssl_cat &&
-        ec.value() == ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ)) {
+    if ((ec == ssl::error::stream_truncated) ||
+        (ec.category() == ssl_cat &&
+         ec.value() == ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ))) {
       // SSL Shutdown - remote party just dropped TCP FIN instead of closing
       // SSL protocol. Possible truncate attack - closing connection.
       return;
@@ -90,16 +158,26 @@ public:
       : ios(cdnalizerd::service()), yield(yield), ctx(ssl::context::tlsv12),
         sock(ios), hostname(hostname) {
     ctx.set_default_verify_paths();
+    if (!tlsSettings().caFile.empty())
+      ctx.load_verify_file(tlsSettings().caFile);
     connect();
   }
   ~HTTPS() {
-    if (!s)
+    if (!s && !k)
       return;
     disconnect();
   }
   Stream &stream() {
-    assert(s);
-    return *s;
+    assert(s || k);
+    return wrapped;
+  }
+  /// True if the kernel is doing our encryption, so sendfile() can be used
+  bool kernelSends() const { return k && k->kernelSends(); }
+  /// Sends part of a file straight from the page cache. Only works if
+  /// kernelSends() is true
+  void sendfile(int fd, std::uint64_t offset, std::size_t size) {
+    assert(k);
+    k->sendfile(fd, offset, size, yield);
   }
   void reconnect() {
     disconnect();
@@ -1,11 +1,20 @@
 #include "inotify.hpp"
 
+#include <boost/asio/deadline_timer.hpp>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+
 namespace cdnalizerd {
 namespace inotify {
   
 std::ostream &operator<<(std::ostream &out, const Event &e) {
   using namespace std;
-  out << "Event: path(" << e.path() << ") ";
+  out << "Event: watch(" << e.wd << ") name(" << e.name << ") ";
   if (e.wasAccessed())
     out << " Accessed ";
   if (e.wasModified())
@@ -47,5 +56,151 @@ std::ostream &operator<<(std::ostream &out, const Event &e) {
   return out;
 }
 
+struct Reader::Shared {
+  // service() is per thread, so the threads need it from us
+  asio::io_service &ios = service();
+  std::mutex mutex;
+  // Read, but not taken yet; the events point into the buffers
+  std::vector<Event> events;
+  std::vector<std::vector<char>> buffers;
+  // Buffers we've finished with, for the threads to read into again
+  std::vector<std::vector<char>> spare;
+  // The io_service thread is waiting on 'wake' for events
+  bool waiting = false;
+  asio::deadline_timer wake{ios};
+  // The threads wait on this while there are too many events waiting
+  std::condition_variable roomy;
+  bool stopping = false;
+  // Why a thread stopped reading, for waitForEvents() to throw
+  std::exception_ptr error;
+
+  /// Wakes the io_service thread, if it's waiting. Call with 'mutex' held
+  void wakeUp(std::shared_ptr<Shared> self) {
+    if (waiting) {
+      waiting = false;
+      ios.post([self]() { self->wake.cancel(); });
+    }
+  }
+
+  /// Hands the io_service thread the error that stopped a thread
+  void fail(std::shared_ptr<Shared> self, int code, const char *what) {
+    LOG_S(ERROR) << what << ": " << std::strerror(code);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = std::make_exception_ptr(
+          std::system_error(code, std::system_category(), what));
+    wakeUp(self);
+  }
+};
+
+Reader::Reader(const std::vector<int> &handles)
+    : shared(std::make_shared<Shared>()),
+      stopHandle(eventfd(0, EFD_CLOEXEC)) {
+  if (stopHandle == -1)
+    throw std::system_error(errno, std::system_category(), "eventfd");
+  for (std::size_t i = 0; i != handles.size(); ++i)
+    threads.emplace_back(run, shared, handles[i], stopHandle, int(i),
+                         int(handles.size()));
+}
+
+Reader::~Reader() {
+  {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->stopping = true;
+  }
+  shared->roomy.notify_all();
+  std::uint64_t one = 1;
+  if (write(stopHandle, &one, sizeof(one)) == -1)
+    LOG_S(ERROR) << "Couldn't stop the inotify threads: "
+                 << std::strerror(errno);
+  for (std::thread &thread : threads)
+    thread.join();
+  close(stopHandle);
+}
+
+void Reader::run(std::shared_ptr<Shared> shared, int handle, int stop,
+                 int index, int count) {
+  std::vector<char> buffer;
+  std::vector<Event> parsed;
+  while (true) {
+    pollfd handles[2] = {{handle, POLLIN, 0}, {stop, POLLIN, 0}};
+    if (poll(handles, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      shared->fail(shared, errno, "Waiting for inotify events");
+      return;
+    }
+    if (handles[1].revents != 0)
+      return;
+    {
+      std::unique_lock<std::mutex> lock(shared->mutex);
+      // Leave the rest in the kernel's queue until the io_service thread
+      // catches up. If it fills, the kernel tells us it overflowed, and
+      // we rescan, rather than us running out of memory
+      shared->roomy.wait(lock, [&shared]() {
+        return shared->stopping || (shared->events.size() < maxBacklog);
+      });
+      if (shared->stopping)
+        return;
+      if (!shared->spare.empty()) {
+        buffer = std::move(shared->spare.back());
+        shared->spare.pop_back();
+      }
+    }
+    // Only ever shrunk after this, so it's never reallocated
+    buffer.resize(Instance::bufferSize);
+    ssize_t got = read(handle, buffer.data(), buffer.size());
+    if (got == -1) {
+      if ((errno == EAGAIN) || (errno == EINTR))
+        continue;
+      shared->fail(shared, errno, "Reading inotify events");
+      return;
+    }
+    buffer.resize(got);
+    parsed.clear();
+    // The kernel only gives us whole events
+    forEachEvent(buffer.data(), buffer.size(),
+                 [&parsed, index, count](const inotify_event &event) {
+                   int wd = (event.wd < 0) ? -1 - index
+                                           : event.wd * count + index;
+                   parsed.emplace_back(wd, event.mask, event.cookie,
+                                       event.name, event.len);
+                 });
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->events.insert(shared->events.end(), parsed.begin(), parsed.end());
+    shared->buffers.push_back(std::move(buffer));
+    buffer.clear();
+    shared->wakeUp(shared);
+  }
+}
+
+const std::vector<Event> &Reader::waitForEvents(yield_context yield) {
+  LOG_SCOPE_F(9, "Event processing");
+  std::unique_lock<std::mutex> lock(shared->mutex);
+  // Nothing points into the last lot of buffers any more
+  for (std::vector<char> &buffer : buffers)
+    shared->spare.push_back(std::move(buffer));
+  buffers.clear();
+  events.clear();
+  while (shared->events.empty() && !shared->error) {
+    // The threads only cancel the timer from this thread, so they can't do it
+    // before we've started waiting
+    shared->waiting = true;
+    shared->wake.expires_at(boost::posix_time::pos_infin);
+    lock.unlock();
+    boost::system::error_code ec;
+    shared->wake.async_wait(yield[ec]);
+    lock.lock();
+  }
+  // Hand over what was read before the error first
+  if (shared->events.empty())
+    std::rethrow_exception(shared->error);
+  std::swap(events, shared->events);
+  std::swap(buffers, shared->buffers);
+  shared->roomy.notify_all();
+  DLOG_S(9) << "Got " << events.size() << " events";
+  return events;
+}
+
 }
-} /* cdnalizerd  */ 
+} /* cdnalizerd  */
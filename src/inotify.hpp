@@ -4,8 +4,13 @@
 
 #include <sys/inotify.h>
 #include <unistd.h>
+#include <cstring>
 #include <system_error>
 #include <ios>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/asio/buffers_iterator.hpp>
 #include <boost/asio/io_service.hpp>
@@ -13,8 +18,10 @@
 #include <boost/asio/read.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
 #include <boost/filesystem.hpp>
 
+#include "DirectoryTree.hpp"
 #include "utils.hpp"
 #include "https.hpp"
 #include "logging.hpp"
@@ -26,84 +33,23 @@ namespace inotify {
 
 namespace fs = boost::filesystem;
 
-/// A watch on a single directory
-class Watch {
-private:
-  int inotify_handle = 0;
-  int _handle = -1;
-  // Erases all knowledge of our resources
-  void die() {
-    inotify_handle = 0;
-    _handle = -1;
-  }
-
-public:
-  std::string path;
-  Watch(int inotify_handle, std::string path, uint32_t mask)
-      : inotify_handle(inotify_handle),
-        _handle(inotify_add_watch(inotify_handle, path.c_str(), mask)),
-        path(std::move(path)) {
-    if (_handle == -1)
-      throw std::system_error(errno, std::system_category());
-  }
-  Watch(const Watch &other) = delete; // Can't copy it, it's a real resource
-  // Move is fine
-  Watch(Watch &&other)
-      : inotify_handle(other.inotify_handle), _handle(other._handle),
-        path(std::move(other.path)) {
-    other.die(); // Make the other one forget about our resources, so that
-                 // when the destructor is called, it won't try to free them,
-                 // as we own them now
-  }
-  // Clean up resources on destruction
-  ~Watch() {
-    if (_handle != -1)
-      inotify_rm_watch(inotify_handle, _handle);
-  }
-  // Move assignment is fine
-  Watch &operator=(Watch &&other) {
-    inotify_handle = other.inotify_handle;
-    _handle = other._handle;
-    other.die(); // Make the other one forget about our resources, so that
-                 // when the destructor is called, it won't try to free them,
-                 // as we own them now
-    return *this;
-  }
-  bool operator==(const Watch &other) {
-    return (inotify_handle == other.inotify_handle) &&
-           (_handle == other._handle);
-  }
-  int handle() const { return _handle; }
-};
-
-/// An event that happened to a file
+/// An event that happened to a file. It's a plain value: the watch is just
+/// its handle, and the name points into the buffer it was read into, so it's
+/// only good until the next call to waitForEvents(). Use Instance::path() to
+/// get the full path, when it's needed.
 struct Event {
-  using GetWatch = std::function<const Watch &(void)>;
-  GetWatch watch; // Is filled in in waitForEvent
+  int wd;          /* Handle of the watch it happened in */
   uint32_t mask;   /* Mask of events */
   uint32_t cookie; /* Unique cookie associating related
                       events (for rename(2)) */
-  std::string name;
-  // If it's a move or copy operation, 'destination' is the destination event
-  std::unique_ptr<Event> destination;
+  boost::string_view name;
 
-  Event(GetWatch watch, uint32_t mask, uint32_t cookie,
-        const char *namePtr, int nameLen)
-      : watch(watch), mask(mask), cookie(cookie) {
-    name.reserve(nameLen);
-    DLOG_S(9) << "Making event - namePtr: " << namePtr << " - len: " << nameLen;
-    auto out = std::back_inserter(name);
-    while ((*namePtr != '\0') && (namePtr < namePtr + nameLen)) {
-      *out = *namePtr;
-      ++namePtr;
-      ++out;
-    }
-  }
-
-  std::string path() const {
-    fs::path out = watch().path;
-    return (out / name).native();
-  }
+  Event(int wd, uint32_t mask, uint32_t cookie, const char *namePtr,
+        int nameLen)
+      : wd(wd), mask(mask), cookie(cookie),
+        // The kernel pads names with nulls; and there's no name at all for
+        // events on the watched directory itself
+        name(namePtr, strnlen(namePtr, nameLen)) {}
 
   /* Events we can watch for */
   bool wasAccessed() const { return mask & IN_ACCESS; }
@@ -152,137 +98,167 @@ struct Event {
 /// Print the event info
 std::ostream &operator<<(std::ostream &out, const Event &e);
 
-/// Print an inotify watch
-inline std::ostream &operator<<(std::ostream &out, const Watch &watch) {
-  out << watch.handle() << " - " << watch.path;
-  return out;
-}
 namespace asio = boost::asio;
 
-/// A collection of Watches
+/// Calls 'onEvent' for each complete inotify_event in 'data', in place.
+/// Returns how many bytes it used; anything after that is the start of an
+/// event that hasn't been read in full yet
+template <typename OnEvent>
+std::size_t forEachEvent(const char *data, std::size_t size, OnEvent onEvent) {
+  std::size_t used = 0;
+  while (size - used >= sizeof(inotify_event)) {
+    const inotify_event *event =
+        reinterpret_cast<const inotify_event *>(data + used);
+    std::size_t length = sizeof(inotify_event) + event->len;
+    if (size - used < length)
+      break;
+    onEvent(*event);
+    used += length;
+  }
+  return used;
+}
+
+/// A collection of watches on one inotify handle. We don't keep each watch's
+/// path; the directories are kept as a tree of names, and their paths are put
+/// together when asked for. The watches all go when the handle is closed.
+/// Events are read by a Reader
 struct Instance {
-  yield_context &yield;
+  /// How much we read at once. Big enough to drain the kernel queue in a few
+  /// reads during an event storm
+  static constexpr std::size_t bufferSize = 64 * 1024;
   int inotify_handle;
-  asio::io_service& ios;
-  asio::posix::stream_descriptor stream;
-  char buffer[sizeof(inotify_event) + NAME_MAX + 1];
-  char* buffer_data_end = buffer;
 
-  // Watch handle to watcher lookup
-  std::map<int, Watch> watches;
-  // Path to watcher handle lookup
-  std::map<std::string, int> paths;
+  // Every directory we watch
+  DirectoryTree directories;
+  // Watch handle to directory lookup, and back
+  std::unordered_map<int, DirectoryTree::Node> watches;
+  std::unordered_map<DirectoryTree::Node, int> handles;
 
-  Instance(yield_context &yield)
-      : yield(yield), inotify_handle(inotify_init1(IN_NONBLOCK)),
-        ios(service()), stream(ios) {
+  Instance() : inotify_handle(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
     if (inotify_handle == -1)
       throw std::system_error(errno, std::system_category());
-    stream.assign(inotify_handle);
   }
-  const Watch &watchFromHandle(int handle) const { return watches.at(handle); }
-  Watch &addWatch(const char *path, uint32_t mask) {
+  Instance(const Instance &) = delete;
+  ~Instance() { close(inotify_handle); }
+  /// Starts watching 'path'. Returns the watch handle
+  int addWatch(const std::string &path, uint32_t mask) {
     LOG_S(5) << "Watching path: " << path << " mask(" << std::hex << mask
              << ") inotify handle(" << inotify_handle << ")" << std::endl;
-    DLOG_S(9) << "paths: find " << path;
-    auto found = paths.find(path);
-    if (found != paths.end())
+    if (alreadyWatching(path))
       throw std::logic_error("Can't watch the same path twice");
-    auto watch = Watch(inotify_handle, path, mask);
-    LOG_S(5) << "watch handle for path (" << path << ") = " << watch.handle()
+    int handle = inotify_add_watch(inotify_handle, path.c_str(), mask);
+    if (handle == -1)
+      throw std::system_error(errno, std::system_category());
+    LOG_S(5) << "watch handle for path (" << path << ") = " << handle
              << std::endl;
-    DLOG_S(9) << "paths: insert " << path << " - " << watch.handle();
-    paths.insert({watch.path, watch.handle()});
-    DLOG_S(9) << "watches: adding: " << watch;
-    auto result =
-        watches.emplace(std::make_pair(watch.handle(), std::move(watch)));
-    return result.first->second;
+    if (!adoptWatch(handle, path))
+      throw std::logic_error("Can't watch the same directory twice");
+    return handle;
+  }
+  /// Takes ownership of a watch that was added with inotify_add_watch (on
+  /// another thread, say). Returns false if we already have it; the same
+  /// directory can be reached by two paths
+  bool adoptWatch(int handle, const std::string &path) {
+    if (watches.count(handle) || alreadyWatching(path))
+      return false;
+    DLOG_S(9) << "watches: adopting: " << handle << " - " << path;
+    DirectoryTree::Node node = directories.add(path);
+    watches.emplace(handle, node);
+    handles.emplace(node, handle);
+    return true;
+  }
+  /// Stops watching a directory
+  void removeWatch(int handle) {
+    if (watches.count(handle)) {
+      inotify_rm_watch(inotify_handle, handle);
+      forgetWatch(handle);
+    }
   }
-  void removeWatch(const Watch &watch) {
-    DLOG_S(9) << "watches: find " << watch;
-    auto found = watches.find(watch.handle());
+  /// Forgets a watch the kernel has already dropped (IN_IGNORED)
+  void forgetWatch(int handle) {
+    auto found = watches.find(handle);
     if (found != watches.end()) {
-      DLOG_S(9) << "paths: delete " << found->second.path;
-      paths.erase(found->second.path);
-      DLOG_S(9) << "watches: delete " << watch;
+      DLOG_S(9) << "watches: delete " << handle;
+      handles.erase(found->second);
+      directories.remove(found->second);
       watches.erase(found);
     }
   }
-  void removeWatch(const std::string &path) {
-    DLOG_S(9) << "paths: find " << path;
-    auto found = paths.find(path);
-    if (found != paths.end()) {
-      int handle = found->second;
-      DLOG_S(9) << "watches: delete " << handle;
-      watches.erase(handle);
-      DLOG_S(9) << "paths: delete " << found->first;
-      paths.erase(found);
+  /// A watched directory has been renamed; so have all the ones under it
+  bool moveDirectory(const std::string &from, const std::string &to) {
+    DLOG_S(9) << "directories: move " << from << " to " << to;
+    return directories.move(from, to);
+  }
+  /// The handles of the watches on 'path' and every directory under it
+  std::vector<int> watchesUnder(const std::string &path) const {
+    std::vector<int> result;
+    DirectoryTree::Node top = directories.find(path);
+    if (top == DirectoryTree::none)
+      return result;
+    for (DirectoryTree::Node node : directories.under(top)) {
+      auto found = handles.find(node);
+      if (found != handles.end())
+        result.push_back(found->second);
     }
+    return result;
   }
   bool alreadyWatching(const std::string &path) const {
-    DLOG_S(9) << "paths: find " << path;
-    auto found = paths.find(path);
-    return (found != paths.end());
+    return directories.find(path) != DirectoryTree::none;
   }
-  Event waitForEvent() {
-    // First check in the buffer if we have anything left over from last time
-    LOG_SCOPE_F(9, "Event processing");
-    size_t size = std::distance(buffer, buffer_data_end);
-    DLOG_S(9) << "Starting buffer size: " << size;
-    size_t toRead = sizeof(inotify_event);
-    if (size < sizeof(inotify_event)) {
-      // If we don't already have enough data in the buffer, read some more
-      toRead -= size;
-      DLOG_S(9) << "toRead: " << toRead;
-      DLOG_S(9) << "NAME_MAX: " << NAME_MAX;
-      DLOG_S(9) << "sizeof(inotify_event): " << sizeof(inotify_event);
-      size_t maxRead(sizeof(buffer) - size);
-      DLOG_S(9) << "Max Read: " << maxRead;
-      int bytesRead = boost::asio::async_read(
-          stream, asio::buffer(buffer_data_end, maxRead),
-          boost::asio::transfer_at_least(toRead), yield);
-      DLOG_S(9) << "bytesRead: " << bytesRead;
-      buffer_data_end += bytesRead;
-      size = std::distance(buffer, buffer_data_end);
-      DLOG_S(9) << "New size: " << size;
-    }
-    assert(size >= sizeof(inotify_event));
-    assert(size <= sizeof(buffer));
-    inotify_event* event = (inotify_event*)(buffer);
-    // Make sure we've read the whole length of the file name
-    if (size < (sizeof(inotify_event) + event->len)) {
-      toRead = sizeof(inotify_event) + event->len - size;
-      DLOG_S(9) << "Getting rest of event name. Buffer size(" << size
-                << ") - len(" << event->len << ") - toRead(" << toRead << ")";
-      int bytesRead = boost::asio::async_read(
-          stream, asio::buffer(buffer_data_end, sizeof(buffer) - size),
-          boost::asio::transfer_at_least(toRead), yield);
-    }
-    DLOG_S(9) << "Raw event: \n"
-              << "wd: " << event->wd << "\nmask: " << event->mask
-              << "\ncookie: " << event->cookie << "\nlen: " << event->len
-              << "\nname: " << event->name << "\n";
-    // Now read the event name
-    Event result(
-        [ this, wd = event->wd ]()->const Watch & { return watches.at(wd); },
-        event->mask, event->cookie, event->name, event->len);
-    // Now clean up our buffer
-    if (size > (sizeof(inotify_event) + event->len)) {
-      // Copy / move the next event data to the beginning
-      DLOG_S(9) << "Readying buffer for next read";
-      size_t start(sizeof(inotify_event) + event->len);
-      DLOG_S(9) << "New data found at: " << start;
-      std::copy(&buffer[start], buffer_data_end, buffer);
-      buffer_data_end -= start;
-    } else {
-      // Buffer is empty
-      DLOG_S(9) << "Buffer is already clean because the buffer is " << size
-                << " bytes, and the event is "
-                << (sizeof(inotify_event) + event->len);
-      buffer_data_end = buffer;
+  /// The full path of the file (or directory) called 'name' in the directory
+  /// watched by 'handle'
+  std::string path(int handle, boost::string_view name) const {
+    std::string result;
+    result.reserve(64);
+    directories.appendPath(watches.at(handle), result);
+    if (!name.empty()) {
+      if (result.empty() || (result.back() != '/'))
+        result.push_back('/');
+      result.append(name.data(), name.size());
     }
     return result;
   }
 };
+
+/// Reads events from several inotify handles, each on a thread of its own.
+/// The threads drain the kernel's queues as fast as they fill, even while the
+/// io_service thread is busy, and parse the events themselves; the io_service
+/// thread takes everything they've read in one go.
+///
+/// The handles share one numbering of watches: an event from handle 'i' of
+/// 'n' has a 'wd' of (its own wd * n + i), and a queue overflow on it has a
+/// 'wd' of (-1 - i)
+///
+/// If the io_service thread falls too far behind, the threads stop reading
+/// and let the kernel's queues overflow instead. If one can't read, the
+/// error is thrown from waitForEvents()
+class Reader {
+private:
+  /// How many events may wait for the io_service thread
+  static constexpr std::size_t maxBacklog = 256 * 1024;
+
+  struct Shared;
+  std::shared_ptr<Shared> shared;
+  // Wakes the threads up to stop
+  int stopHandle;
+  std::vector<std::thread> threads;
+  // What waitForEvents() returned last, and the buffers it points into
+  std::vector<Event> events;
+  std::vector<std::vector<char>> buffers;
+
+  static void run(std::shared_ptr<Shared> shared, int handle, int stop,
+                  int index, int count);
+
+public:
+  /// Starts reading 'handles'. They must outlive us
+  explicit Reader(const std::vector<int> &handles);
+  Reader(const Reader &) = delete;
+  /// Stops the threads. Anything they'd read and we hadn't taken is lost
+  ~Reader();
+  /// Suspends the coroutine until there are events, then returns every one
+  /// that's been read, in order for each handle. They're only valid until the
+  /// next call. Throws std::system_error if a thread stopped reading
+  const std::vector<Event> &waitForEvents(yield_context yield);
+};
 }
 } /* cdnalizerd  */
@@ -1,5 +1,6 @@
 #include "delete.hpp"
 
+#include "listObjects.hpp"
 #include "../url.hpp"
 
 using namespace std::literals;
@@ -46,6 +47,18 @@ Job makeRemoteDeleteJob(URL dest) {
              std::bind(deleteRemoteFile, std::move(dest), std::placeholders::_1,
                        std::placeholders::_2));
 }
-    
+
+Job makeRemoteDeleteTreeJob(URL container, std::string prefix) {
+  std::string name("Remote delete job for everything under "s +
+                   container.whole() + "/" + prefix);
+  Job::Work go = [container, prefix](HTTPS &conn, const std::string &token) {
+    // If we're retried, we'll just find less
+    for (const std::string &object :
+         listObjects(conn, token, container, prefix))
+      deleteRemoteFile(URL(container / object), conn, token);
+  };
+  return Job(std::move(name), go);
+}
+
 } /* jobs */ 
 } /* cdnalizerd  */ 
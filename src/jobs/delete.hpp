@@ -6,8 +6,15 @@
 namespace cdnalizerd {
 namespace jobs {
 
+/// Wipes a file from the destination server, on a job's connection
+void deleteRemoteFile(URL dest, HTTPS &conn, const std::string &token);
+
 /// Returns a job that will wipe a file from the destination server
 Job makeRemoteDeleteJob(URL dest);
 
+/// Returns a job that will wipe every object in 'container' under 'prefix'
+/// (a directory, ending in '/') from the destination server
+Job makeRemoteDeleteTreeJob(URL container, std::string prefix);
+
 } /* jobs */
 } /* cdnalizerd  */
@@ -0,0 +1,340 @@
+#include "hashCache.hpp"
+
+#include "md5.hpp"
+#include "../logging.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <system_error>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace {
+
+constexpr char magic[8] = {'C', 'D', 'N', 'H', 'A', 'S', 'H', '1'};
+constexpr std::uint32_t fileVersion = 1;
+
+/// Files whose mtime or ctime is closer to now than this aren't remembered
+constexpr std::int64_t minAge_ns = 2000000000;
+
+std::int64_t nanoseconds(const struct timespec &time) {
+  return static_cast<std::int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/// Spreads device and inode numbers (which tend to be sequential) over the
+/// table
+std::uint64_t mix(std::uint64_t device, std::uint64_t inode) {
+  std::uint64_t result = (inode ^ (device << 32) ^ (device >> 32)) *
+                         0x9E3779B97F4A7C15ull;
+  return result ^ (result >> 29);
+}
+
+std::int64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return nanoseconds(now);
+}
+
+int fromHex(char c) {
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  return -1;
+}
+
+} /* anonymous namespace */
+
+/// The start of the file
+struct HashCache::Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t recordSize;
+  std::uint64_t capacity; // Always a power of 2
+  std::uint64_t count;
+  char padding[32];
+};
+
+/// One slot in the (open addressed) hash table. An inode of 0 means the slot
+/// is empty
+struct HashCache::Record {
+  std::uint64_t device;
+  std::uint64_t inode;
+  std::uint64_t size;
+  std::int64_t mtime_ns;
+  std::int64_t ctime_ns;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+  // Guards against records that were half written when we crashed
+  std::uint32_t check;
+  std::uint32_t unused;
+};
+
+static_assert(sizeof(HashCache::Header) == 64, "Header should be 64 bytes");
+static_assert(sizeof(HashCache::Record) == 64, "Records should be 64 bytes");
+
+namespace {
+
+/// FNV-1a over everything in the record before the check field
+std::uint32_t checksum(const HashCache::Record &record) {
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(&record);
+  std::uint32_t result = 2166136261u;
+  for (std::size_t i = 0; i != offsetof(HashCache::Record, check); ++i) {
+    result ^= data[i];
+    result *= 16777619u;
+  }
+  return result;
+}
+
+} /* anonymous namespace */
+
+bool HashCache::keyFor(const fs::path &path, Key &key) {
+  struct stat sb;
+  if ((::stat(path.c_str(), &sb) != 0) || (!S_ISREG(sb.st_mode)))
+    return false;
+  key.device = sb.st_dev;
+  key.inode = sb.st_ino;
+  key.size = sb.st_size;
+  key.mtime_ns = nanoseconds(sb.st_mtim);
+  key.ctime_ns = nanoseconds(sb.st_ctim);
+  return true;
+}
+
+HashCache::HashCache(std::string filename, std::uint64_t initialCapacity)
+    : filename(std::move(filename)) {
+  open(initialCapacity);
+}
+
+HashCache::~HashCache() { close(); }
+
+void HashCache::open(std::uint64_t capacity) {
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1)
+    throw std::system_error(errno, std::system_category(),
+                            "Opening hash cache " + filename);
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    int error = errno;
+    close();
+    throw std::system_error(error, std::system_category(),
+                            "Reading hash cache " + filename);
+  }
+  bool fresh = true;
+  if (static_cast<std::size_t>(sb.st_size) >= sizeof(Header)) {
+    Header existing;
+    bool ok = (pread(fd, &existing, sizeof(existing), 0) == sizeof(existing)) &&
+              (std::memcmp(existing.magic, magic, sizeof(magic)) == 0) &&
+              (existing.version == fileVersion) &&
+              (existing.recordSize == sizeof(Record)) &&
+              (existing.capacity > 0) &&
+              ((existing.capacity & (existing.capacity - 1)) == 0) &&
+              (static_cast<std::uint64_t>(sb.st_size) ==
+               sizeof(Header) + existing.capacity * sizeof(Record));
+    if (ok) {
+      fresh = false;
+      capacity = existing.capacity;
+    } else
+      LOG_S(WARNING) << "Hash cache " << filename
+                     << " isn't one we can read. Starting a new one";
+  }
+  if (fresh) {
+    std::uint64_t rounded = 64;
+    while (rounded < capacity)
+      rounded *= 2;
+    capacity = rounded;
+  }
+  mapSize = sizeof(Header) + capacity * sizeof(Record);
+  if (fresh && ((ftruncate(fd, 0) != 0) || (ftruncate(fd, mapSize) != 0))) {
+    int error = errno;
+    close();
+    throw std::system_error(error, std::system_category(),
+                            "Sizing hash cache " + filename);
+  }
+  map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    int error = errno;
+    map = nullptr;
+    close();
+    throw std::system_error(error, std::system_category(),
+                            "Mapping hash cache " + filename);
+  }
+  header = static_cast<Header *>(map);
+  records = reinterpret_cast<Record *>(header + 1);
+  if (fresh) {
+    std::memcpy(header->magic, magic, sizeof(magic));
+    header->version = fileVersion;
+    header->recordSize = sizeof(Record);
+    header->capacity = capacity;
+    header->count = 0;
+  }
+  LOG_S(1) << "Hash cache " << filename << " knows " << header->count
+           << " files. Capacity: " << header->capacity;
+}
+
+void HashCache::close() {
+  if (map != nullptr)
+    munmap(map, mapSize);
+  if (fd != -1)
+    ::close(fd);
+  map = nullptr;
+  header = nullptr;
+  records = nullptr;
+  mapSize = 0;
+  fd = -1;
+}
+
+HashCache::Record &HashCache::slotFor(const Key &key) {
+  std::uint64_t mask = header->capacity - 1;
+  std::uint64_t slot = mix(key.device, key.inode) & mask;
+  // We never let the table fill up, so this always finds a slot
+  while (true) {
+    Record &record = records[slot];
+    if ((record.inode == 0) ||
+        ((record.inode == key.inode) && (record.device == key.device)))
+      return record;
+    slot = (slot + 1) & mask;
+  }
+}
+
+void HashCache::grow() {
+  std::string newName(filename + ".new");
+  // Get rid of any leftovers from a grow that didn't finish
+  ::unlink(newName.c_str());
+  HashCache bigger(newName, header->capacity * 2);
+  for (std::uint64_t i = 0; i != header->capacity; ++i) {
+    const Record &record = records[i];
+    if ((record.inode == 0) || (record.check != checksum(record)))
+      continue;
+    Key key;
+    key.device = record.device;
+    key.inode = record.inode;
+    Record &slot = bigger.slotFor(key);
+    if (slot.inode == 0)
+      ++bigger.header->count;
+    slot = record;
+  }
+  if (::rename(newName.c_str(), filename.c_str()) != 0)
+    throw std::system_error(errno, std::system_category(),
+                            "Replacing hash cache " + filename);
+  // Take over the bigger cache's resources
+  close();
+  std::swap(fd, bigger.fd);
+  std::swap(map, bigger.map);
+  std::swap(mapSize, bigger.mapSize);
+  std::swap(header, bigger.header);
+  std::swap(records, bigger.records);
+  LOG_S(1) << "Hash cache " << filename << " grew to " << header->capacity;
+}
+
+void HashCache::erase(Record &record) {
+  std::uint64_t mask = header->capacity - 1;
+  std::uint64_t hole = &record - records;
+  // Anything after the hole that would have been put in or before it if the
+  // hole had been empty, moves up, so slotFor still finds it
+  for (std::uint64_t slot = (hole + 1) & mask; records[slot].inode != 0;
+       slot = (slot + 1) & mask) {
+    std::uint64_t home = mix(records[slot].device, records[slot].inode) & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      records[hole] = records[slot];
+      hole = slot;
+    }
+  }
+  std::memset(&records[hole], 0, sizeof(Record));
+  --header->count;
+}
+
+std::string HashCache::find(const std::string &path, const Key &key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  const Record &record = slotFor(key);
+  if ((record.inode == 0) || (record.size != key.size) ||
+      (record.mtime_ns != key.mtime_ns) || (record.ctime_ns != key.ctime_ns) ||
+      (record.check != checksum(record)))
+    return "";
+  paths[path] = {key.device, key.inode};
+  return md5_to_hex(record.md5);
+}
+
+void HashCache::store(const std::string &path, const Key &key,
+                      const std::string &md5) {
+  std::int64_t age = now_ns() - std::max(key.mtime_ns, key.ctime_ns);
+  if (age < minAge_ns)
+    return;
+  Record updated;
+  std::memset(&updated, 0, sizeof(updated));
+  if (md5.size() != MD5_DIGEST_LENGTH * 2)
+    return;
+  for (int i = 0; i != MD5_DIGEST_LENGTH; ++i) {
+    int high = fromHex(md5[i * 2]);
+    int low = fromHex(md5[i * 2 + 1]);
+    if ((high == -1) || (low == -1))
+      return;
+    updated.md5[i] = (high << 4) | low;
+  }
+  updated.device = key.device;
+  updated.inode = key.inode;
+  updated.size = key.size;
+  updated.mtime_ns = key.mtime_ns;
+  updated.ctime_ns = key.ctime_ns;
+  updated.check = checksum(updated);
+  std::lock_guard<std::mutex> lock(mutex);
+  Record *slot = &slotFor(key);
+  if (slot->inode == 0) {
+    // Keep the table no more than 70% full
+    if ((header->count + 1) * 10 > header->capacity * 7) {
+      grow();
+      slot = &slotFor(key);
+    }
+    ++header->count;
+  }
+  *slot = updated;
+  paths[path] = {key.device, key.inode};
+}
+
+void HashCache::forget(const std::string &path, bool isDir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string from(isDir ? path + "/" : path);
+  auto first = paths.lower_bound(from);
+  auto last = first;
+  while ((last != paths.end()) &&
+         (isDir ? (last->first.compare(0, from.size(), from) == 0)
+                : (last->first == from)))
+    ++last;
+  for (auto i = first; i != last; ++i) {
+    Key key;
+    key.device = i->second.first;
+    key.inode = i->second.second;
+    Record &record = slotFor(key);
+    if (record.inode != 0)
+      erase(record);
+  }
+  paths.erase(first, last);
+}
+
+std::uint64_t HashCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return header->count;
+}
+
+std::uint64_t HashCache::capacity() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return header->capacity;
+}
+
+HashCache *_global_hash_cache(nullptr);
+
+void hashCache(HashCache *cache) { _global_hash_cache = cache; }
+
+HashCache *hashCache() { return _global_hash_cache; }
+
+} /* jobs */
+} /* cdnalizerd  */
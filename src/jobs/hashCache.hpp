@@ -0,0 +1,100 @@
+#pragma once
+/// Remembers the md5s of files we've already read, so that we don't have to
+/// read them again unless they change. It lives in a memory mapped file so it
+/// survives restarts.
+///
+/// A file is identified by its device and inode. The entry is only trusted if
+/// the size, mtime and ctime all still match, so any change to the file (or
+/// the inode being reused) makes us hash it again. Files changed in the last
+/// couple of seconds aren't remembered at all: a write straight after we read
+/// one could leave its times as they were, if the filesystem's clock is
+/// coarse.
+///
+/// Files that are deleted or moved away are forgotten, so the table doesn't
+/// fill up with inodes that are gone. Only the files we've looked up or
+/// stored since we started can be found by path, though.
+
+#include <boost/filesystem.hpp>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace fs = boost::filesystem;
+
+class HashCache {
+public:
+  /// Everything we can find out about a file without reading it
+  struct Key {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    std::int64_t ctime_ns = 0;
+    bool operator==(const Key &other) const {
+      return (device == other.device) && (inode == other.inode) &&
+             (size == other.size) && (mtime_ns == other.mtime_ns) &&
+             (ctime_ns == other.ctime_ns);
+    }
+    bool operator!=(const Key &other) const { return !(*this == other); }
+  };
+
+  /// Fills in 'key' from the file on disk. Returns false if we couldn't stat
+  /// it, or it's not a regular file
+  static bool keyFor(const fs::path &path, Key &key);
+
+  /// The on disk layout
+  struct Header;
+  struct Record;
+
+private:
+  // Hashing happens on the blocking pool, so many threads use us at once
+  mutable std::mutex mutex;
+  std::string filename;
+  int fd = -1;
+  void *map = nullptr;
+  std::size_t mapSize = 0;
+  Header *header = nullptr;
+  Record *records = nullptr;
+  // Device and inode of the files we've seen this run, by path
+  std::map<std::string, std::pair<std::uint64_t, std::uint64_t>> paths;
+
+  void open(std::uint64_t capacity);
+  void close();
+  /// Returns the slot that holds 'key', or the empty slot where it should go
+  Record &slotFor(const Key &key);
+  /// Doubles our capacity, into a new file that replaces the old one
+  void grow();
+  /// Empties 'record', moving up any that had to go past it
+  void erase(Record &record);
+
+public:
+  /// Opens (or creates) the cache file
+  HashCache(std::string filename, std::uint64_t initialCapacity = 1 << 16);
+  HashCache(const HashCache &) = delete;
+  ~HashCache();
+
+  /// Returns the hex md5 for 'key' (of the file at 'path'), or "" if we
+  /// don't know it
+  std::string find(const std::string &path, const Key &key);
+  /// Remembers the hex md5 of the file at 'path', described by 'key'
+  void store(const std::string &path, const Key &key, const std::string &md5);
+  /// Forgets the file at 'path', or everything under it if it's a directory
+  void forget(const std::string &path, bool isDir);
+  /// The number of files we know about
+  std::uint64_t size() const;
+  std::uint64_t capacity() const;
+};
+
+/// Sets the process wide hash cache. nullptr turns caching off
+void hashCache(HashCache *cache);
+/// The process wide hash cache; nullptr if we're not caching
+HashCache *hashCache();
+
+} /* jobs */
+} /* cdnalizerd  */
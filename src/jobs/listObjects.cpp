@@ -0,0 +1,100 @@
+#include "listObjects.hpp"
+
+#include "../exception_tags.hpp"
+#include "../logging.hpp"
+
+#include <boost/exception/enable_error_info.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace {
+
+/// How many names the server gives us at a time (its maximum)
+constexpr std::size_t pageSize = 10000;
+
+/// urlencode() leaves the characters that split up a query string alone
+std::string queryEncode(const std::string &value) {
+  std::string result;
+  for (char ch : urlencode(value)) {
+    switch (ch) {
+    case '&':
+      result.append("%26");
+      break;
+    case '+':
+      result.append("%2B");
+      break;
+    case '=':
+      result.append("%3D");
+      break;
+    case ';':
+      result.append("%3B");
+      break;
+    default:
+      result.push_back(ch);
+    }
+  }
+  return result;
+}
+
+} /* anonymous namespace */
+
+std::vector<std::string> listObjects(HTTPS &conn, const std::string &token,
+                                     const URL &container,
+                                     const std::string &prefix) {
+  LOG_SCOPE_F(5, "listObjects");
+  std::vector<std::string> result;
+  http::request<http::empty_body> req{http::verb::get, container.path, 11};
+  req.set(http::field::host, container.host);
+  req.set(http::field::user_agent, userAgent());
+  req.set(http::field::accept, "text/plain");
+  req.set("X-Auth-Token", token);
+  std::string marker;
+  while (true) {
+    std::string target(container.path + "?limit=" + std::to_string(pageSize) +
+                       "&prefix=" + queryEncode(prefix));
+    if (!marker.empty())
+      target += "&marker=" + queryEncode(marker);
+    req.target(target);
+    DLOG_S(9) << "HTTP Request: " << req;
+    http::async_write(conn.stream(), req, conn.yield);
+    http::response<http::string_body> response;
+    http::async_read(conn.stream(), conn.read_buffer, response, conn.yield);
+    DLOG_S(9) << "HTTP Response: " << response.base();
+    std::size_t count = 0;
+    switch (response.result()) {
+    case http::status::ok: {
+      const std::string &body = response.body();
+      for (std::size_t start = 0; start < body.size();) {
+        std::size_t end = body.find('\n', start);
+        if (end == std::string::npos)
+          end = body.size();
+        if (end != start) {
+          result.emplace_back(body, start, end - start);
+          ++count;
+        }
+        start = end + 1;
+      }
+      break;
+    }
+    case http::status::no_content:
+    case http::status::not_found:
+      // Nothing there
+      break;
+    default:
+      BOOST_THROW_EXCEPTION(
+          boost::enable_error_info(std::runtime_error("HTTP Bad Response"))
+          << err::http_status(response.result())
+          << err::action("Listing objects under " + prefix));
+    }
+    if (count < pageSize)
+      break;
+    marker = result.back();
+  }
+  LOG_S(5) << "Found " << result.size() << " objects under " << prefix;
+  return result;
+}
+
+} /* jobs */
+} /* cdnalizerd  */
@@ -0,0 +1,20 @@
+#pragma once
+/// Lists the objects under a prefix, on a job's own connection
+
+#include "../https.hpp"
+#include "../url.hpp"
+
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+namespace jobs {
+
+/// Returns the names of all the objects in 'container' that start with
+/// 'prefix'. Follows the server's pages until there are no more
+std::vector<std::string> listObjects(HTTPS &conn, const std::string &token,
+                                     const URL &container,
+                                     const std::string &prefix);
+
+} /* jobs */
+} /* cdnalizerd  */
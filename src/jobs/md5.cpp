@@ -0,0 +1,68 @@
+#include "md5.hpp"
+
+#include "hashCache.hpp"
+#include "../logging.hpp"
+#include "../exception_tags.hpp"
+
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/exception/enable_error_info.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace cdnalizerd {
+namespace jobs {
+
+std::string md5_to_hex(const unsigned char *digest) {
+  static const char digits[] = "0123456789abcdef";
+  std::string result(MD5_DIGEST_LENGTH * 2, '0');
+  for (int i = 0; i != MD5_DIGEST_LENGTH; ++i) {
+    result[i * 2] = digits[digest[i] >> 4];
+    result[i * 2 + 1] = digits[digest[i] & 0x0F];
+  }
+  return result;
+}
+
+std::string md5_from_file(const fs::path &path) {
+  LOG_SCOPE_F(5, "md5_from_file");
+  unsigned char result[MD5_DIGEST_LENGTH];
+  HashCache *cache = hashCache();
+  HashCache::Key key;
+  try {
+    if (!HashCache::keyFor(path, key)) {
+      LOG_S(0) << "File may have been removed since event happened. Upload aborted";
+      return "";
+    }
+    if (cache) {
+      std::string found = cache->find(path.native(), key);
+      if (!found.empty()) {
+        DLOG_S(9) << "Hash cache hit: " << path.native();
+        return found;
+      }
+    }
+    if (fs::file_size(path) == 0) {
+      // Empty files can't be mapped, but they still have an md5
+      MD5(nullptr, 0, result);
+    } else {
+      boost::iostreams::mapped_file_source src(path.native());
+      MD5((const unsigned char *)src.data(), src.size(), result);
+    }
+  } catch (std::exception &e) {
+    LOG_S(WARNING) << boost::diagnostic_information(e, true);
+    BOOST_THROW_EXCEPTION(boost::enable_error_info(e)
+                          << err::action("Taking md5"));
+  } catch (...) {
+    LOG_S(WARNING) << boost::current_exception_diagnostic_information(true);
+    BOOST_THROW_EXCEPTION(
+        boost::enable_error_info(std::runtime_error("Unknown exception"))
+        << err::action("Taking md5"));
+  }
+  std::string hex = md5_to_hex(result);
+  // Only remember it if the file didn't change while we were reading it
+  HashCache::Key after;
+  if (cache && HashCache::keyFor(path, after) && (after == key))
+    cache->store(path.native(), key, hex);
+  return hex;
+}
+
+} /* jobs */
+} /* cdnalizerd  */
@@ -0,0 +1,47 @@
+#pragma once
+/// MD5 helpers. Cloud files reports an object's md5 (in lower case hex) as its
+/// ETag, so that's the format we work in.
+
+#include <boost/filesystem.hpp>
+#include <openssl/md5.h>
+
+#include <string>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace fs = boost::filesystem;
+
+/// Returns the md5 of a file's contents as hex.
+/// Returns "" if the file has gone away since we were asked about it
+std::string md5_from_file(const fs::path &path);
+
+/// Turns a raw md5 digest into lower case hex
+std::string md5_to_hex(const unsigned char *digest);
+
+/// Calculates an md5 a bit at a time, as data streams past
+class MD5Stream {
+private:
+  MD5_CTX ctx;
+  std::string _hex;
+
+public:
+  MD5Stream() { reset(); }
+  void reset() {
+    MD5_Init(&ctx);
+    _hex.clear();
+  }
+  void update(const void *data, size_t size) { MD5_Update(&ctx, data, size); }
+  /// Call once all the data has been seen
+  void finish() {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &ctx);
+    _hex = md5_to_hex(digest);
+  }
+  bool finished() const { return !_hex.empty(); }
+  /// The md5 as hex. Empty until finish() is called
+  const std::string &hex() const { return _hex; }
+};
+
+} /* jobs */
+} /* cdnalizerd  */
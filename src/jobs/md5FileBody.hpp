@@ -0,0 +1,154 @@
+#pragma once
+/// A beast Body that sends a file, and works out its md5 on the way through.
+/// This way an upload only has to read the file from disk once, and we can
+/// check the ETag that the server sends back against what we actually sent.
+///
+/// The writer reads the file a chunk at a time into a buffer. When the kernel
+/// is doing the TLS, sendWith() lets the body go out with sendfile instead,
+/// from the page cache; we still read each chunk to hash it. The file isn't
+/// memory mapped: if it's truncated while we send it (rsync and deploy tools
+/// rewrite files in place), a read comes up short and the upload fails,
+/// where touching a map past the new end would kill us with SIGBUS.
+
+#include "md5.hpp"
+
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/optional.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace cdnalizerd {
+namespace jobs {
+
+struct MD5FileBody {
+  /// How much of the file we read (and hash) at a time
+  static constexpr std::size_t chunkSize = 1024 * 1024;
+
+  class value_type {
+  private:
+    friend struct MD5FileBody;
+    int fd = -1;
+    std::uint64_t _size = 0;
+    MD5Stream md5;
+
+    void close() {
+      if (fd != -1)
+        ::close(fd);
+      fd = -1;
+      _size = 0;
+    }
+
+    /// Reads the chunk at 'offset' into 'buffer'. A file that's shrunk since
+    /// we opened it is a short_read
+    std::size_t read(std::vector<char> &buffer, std::uint64_t offset,
+                     boost::system::error_code &ec) const {
+      std::size_t amount = static_cast<std::size_t>(
+          std::min<std::uint64_t>(_size - offset, chunkSize));
+      buffer.resize(amount);
+      ssize_t got;
+      do
+        got = pread(fd, buffer.data(), amount, offset);
+      while ((got == -1) && (errno == EINTR));
+      if (got == -1)
+        ec.assign(errno, boost::system::system_category());
+      else if (got == 0)
+        ec = boost::beast::http::error::short_read;
+      return (got > 0) ? got : 0;
+    }
+
+  public:
+    value_type() = default;
+    value_type(const value_type &) = delete;
+    ~value_type() { close(); }
+    bool is_open() const { return fd != -1; }
+    std::uint64_t size() const { return _size; }
+    void open(const char *path, boost::system::error_code &ec) {
+      close();
+      ec = {};
+      fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      struct stat sb;
+      if ((fd == -1) || (fstat(fd, &sb) != 0)) {
+        ec.assign(errno, boost::system::system_category());
+        close();
+        return;
+      }
+      _size = sb.st_size;
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    /// Sends the whole file by calling 'send(fd, offset, size)' for each
+    /// chunk, hashing it on the way. For when something other than beast
+    /// writes the body, like sendfile. Sets 'ec' and stops if a read fails
+    template <typename Send>
+    void sendWith(Send send, boost::system::error_code &ec) {
+      ec = {};
+      md5.reset();
+      std::vector<char> buffer;
+      for (std::uint64_t offset = 0; offset != _size;) {
+        std::size_t got = read(buffer, offset, ec);
+        if (ec)
+          return;
+        md5.update(buffer.data(), got);
+        send(fd, offset, got);
+        offset += got;
+      }
+      md5.finish();
+    }
+    /// The hex md5 of what was sent. Empty until the whole body has been
+    /// written
+    const std::string &sentMD5() const { return md5.hex(); }
+  };
+
+  static std::uint64_t size(const value_type &body) { return body.size(); }
+
+  class writer {
+  private:
+    value_type &body;
+    std::uint64_t offset = 0;
+    std::vector<char> buffer;
+
+  public:
+    using const_buffers_type = boost::asio::const_buffer;
+
+    template <bool isRequest, class Fields>
+    writer(const boost::beast::http::header<isRequest, Fields> &,
+           value_type &body)
+        : body(body) {}
+
+    void init(boost::system::error_code &ec) {
+      ec = {};
+      offset = 0;
+      body.md5.reset();
+    }
+
+    boost::optional<std::pair<const_buffers_type, bool>>
+    get(boost::system::error_code &ec) {
+      ec = {};
+      if (offset == body._size) {
+        if (!body.md5.finished())
+          body.md5.finish();
+        return boost::none;
+      }
+      std::size_t got = body.read(buffer, offset, ec);
+      if (ec)
+        return boost::none;
+      offset += got;
+      body.md5.update(buffer.data(), got);
+      if (offset == body._size)
+        body.md5.finish();
+      return {{const_buffers_type{buffer.data(), got}, offset != body._size}};
+    }
+  };
+};
+
+} /* jobs */
+} /* cdnalizerd  */
@@ -0,0 +1,455 @@
+#include "multiMD5.hpp"
+
+#include "md5.hpp"
+#include "hashCache.hpp"
+#include "../logging.hpp"
+
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace {
+
+/// Feeds a file through a lane one 64 byte block at a time, finishing with
+/// md5's padding and length blocks. The file is read a chunk at a time with
+/// pread rather than memory mapped, so if it's truncated while we hash it
+/// (rsync and deploy tools rewrite files in place) the read comes up short
+/// and we give up on it, where touching a map past the new end would kill us
+/// with SIGBUS.
+struct LaneInput {
+  /// How much of the file we read at a time. A whole number of blocks
+  static constexpr std::size_t chunkSize = 256 * 1024;
+  int fd = -1;
+  std::uint64_t size = 0;
+  /// Where in the file buffer[used] came from
+  std::uint64_t offset = 0;
+  std::vector<unsigned char> buffer;
+  std::size_t used = 0;
+  std::size_t filled = 0;
+  unsigned char tail[128];
+  int tailBlocks = 0;
+  int tailUsed = 0;
+  /// Set if the file couldn't be read to the end
+  boost::system::error_code error;
+
+  LaneInput() = default;
+  LaneInput(const LaneInput &) = delete;
+  ~LaneInput() { close(); }
+
+  void close() {
+    if (fd != -1)
+      ::close(fd);
+    fd = -1;
+  }
+
+  /// Opens 'path' to be hashed. Returns false, with 'error' set, if we can't
+  bool start(const char *path) {
+    close();
+    error = {};
+    offset = 0;
+    used = filled = 0;
+    tailBlocks = tailUsed = 0;
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if ((fd == -1) || (fstat(fd, &sb) != 0)) {
+      error.assign(errno, boost::system::system_category());
+      close();
+      return false;
+    }
+    size = sb.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+  }
+
+  /// Reads the next chunk into the buffer. A file that's shrunk since we
+  /// opened it is an error
+  bool fill() {
+    std::size_t amount = static_cast<std::size_t>(
+        std::min<std::uint64_t>(size - offset, chunkSize));
+    buffer.resize(chunkSize);
+    used = filled = 0;
+    while (filled != amount) {
+      ssize_t got = pread(fd, buffer.data() + filled, amount - filled,
+                          offset + filled);
+      if ((got == -1) && (errno == EINTR))
+        continue;
+      if (got == -1)
+        error.assign(errno, boost::system::system_category());
+      else if (got == 0)
+        error = boost::system::errc::make_error_code(
+            boost::system::errc::io_error);
+      if (got <= 0)
+        return false;
+      filled += got;
+    }
+    return true;
+  }
+
+  /// The last partial block, plus padding, plus the length in bits
+  void makeTail() {
+    std::size_t remainder = size - offset;
+    tailBlocks = (remainder < 56) ? 1 : 2;
+    std::memset(tail, 0, sizeof(tail));
+    if (remainder > 0)
+      std::memcpy(tail, buffer.data() + used, remainder);
+    tail[remainder] = 0x80;
+    std::uint64_t bits = size * 8;
+    for (int i = 0; i != 8; ++i)
+      tail[tailBlocks * 64 - 8 + i] = (bits >> (i * 8)) & 0xFF;
+  }
+
+  /// Returns the next block to hash, or nullptr once we're finished or if a
+  /// read failed
+  const unsigned char *next() {
+    if (tailBlocks == 0) {
+      // Chunks are whole blocks, so we only run dry between them, or before
+      // the last partial block
+      if ((used == filled) && (offset != size) && !fill())
+        return nullptr;
+      if (offset + 64 <= size) {
+        const unsigned char *result = buffer.data() + used;
+        used += 64;
+        offset += 64;
+        return result;
+      }
+      makeTail();
+    }
+    if (tailUsed < tailBlocks)
+      return tail + 64 * tailUsed++;
+    return nullptr;
+  }
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Per step constants and rotations from RFC 1321
+constexpr std::uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+constexpr int S[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                       5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+                       4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                       6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+constexpr std::uint32_t initialState[4] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                           0x10325476};
+
+// One 32 bit word per lane
+typedef std::uint32_t u32x8 __attribute__((vector_size(32)));
+typedef std::uint32_t u32x16 __attribute__((vector_size(64)));
+
+/// Runs one block from each lane through the md5 rounds. 'Vec' holds one word
+/// from each lane, so every operation below works on all the lanes at once.
+/// It's always inlined so that it picks up the instruction set of whichever
+/// target specific function calls it.
+template <typename Vec, std::size_t Lanes>
+inline __attribute__((always_inline)) void
+transformLanes(std::uint32_t (&state)[4][Lanes],
+               const unsigned char *const *blocks) {
+  static_assert(sizeof(Vec) == sizeof(std::uint32_t) * Lanes,
+                "Vec must hold one word per lane");
+  // Transpose the blocks so that m[w] holds word 'w' from every lane
+  Vec m[16];
+  for (int w = 0; w != 16; ++w) {
+    std::uint32_t words[Lanes];
+    for (std::size_t lane = 0; lane != Lanes; ++lane)
+      std::memcpy(&words[lane], blocks[lane] + w * 4, 4);
+    std::memcpy(&m[w], words, sizeof(Vec));
+  }
+  Vec a, b, c, d;
+  std::memcpy(&a, state[0], sizeof(Vec));
+  std::memcpy(&b, state[1], sizeof(Vec));
+  std::memcpy(&c, state[2], sizeof(Vec));
+  std::memcpy(&d, state[3], sizeof(Vec));
+  const Vec a0 = a, b0 = b, c0 = c, d0 = d;
+  for (int i = 0; i != 64; ++i) {
+    Vec f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) & 15;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) & 15;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7 * i) & 15;
+    }
+    f = f + a + K[i] + m[g];
+    a = d;
+    d = c;
+    c = b;
+    b = b + ((f << S[i]) | (f >> (32 - S[i])));
+  }
+  a += a0;
+  b += b0;
+  c += c0;
+  d += d0;
+  std::memcpy(state[0], &a, sizeof(Vec));
+  std::memcpy(state[1], &b, sizeof(Vec));
+  std::memcpy(state[2], &c, sizeof(Vec));
+  std::memcpy(state[3], &d, sizeof(Vec));
+}
+
+__attribute__((target("avx2"))) void
+transformAVX2(std::uint32_t (&state)[4][8], const unsigned char *const *blocks) {
+  transformLanes<u32x8, 8>(state, blocks);
+}
+
+__attribute__((target("avx512f"))) void
+transformAVX512(std::uint32_t (&state)[4][16],
+                const unsigned char *const *blocks) {
+  transformLanes<u32x16, 16>(state, blocks);
+}
+
+/// Hashes all the files in 'paths', 'Lanes' at a time. When a lane finishes a
+/// file, the next file in the list takes its place.
+template <std::size_t Lanes, typename Transform>
+void hashInLanes(const std::vector<fs::path> &paths,
+                 std::vector<std::string> &results, Transform transform) {
+  struct Lane {
+    LaneInput input;
+    std::size_t file = 0;
+    bool active = false;
+  };
+  std::array<Lane, Lanes> lanes;
+  std::uint32_t state[4][Lanes];
+  const unsigned char *blocks[Lanes];
+  // Lanes with nothing to do hash this, and we throw the result away
+  static const unsigned char idle[64] = {};
+  std::size_t nextFile = 0;
+
+  // Puts the next readable file into a lane. Returns false if there are none
+  auto load = [&](std::size_t lane) {
+    Lane &l = lanes[lane];
+    l.active = false;
+    l.input.close();
+    while (nextFile < paths.size()) {
+      std::size_t file = nextFile++;
+      const fs::path &path = paths[file];
+      try {
+        if (!fs::is_regular_file(path)) {
+          LOG_S(0) << "File may have been removed before we could hash it: "
+                   << path.native();
+          continue;
+        }
+        if (!l.input.start(path.c_str())) {
+          LOG_S(WARNING) << "Unable to hash " << path.native() << ": "
+                         << l.input.error.message();
+          continue;
+        }
+        l.file = file;
+        l.active = true;
+        for (int word = 0; word != 4; ++word)
+          state[word][lane] = initialState[word];
+        return true;
+      } catch (std::exception &e) {
+        LOG_S(WARNING) << "Unable to hash " << path.native() << ": "
+                       << boost::diagnostic_information(e, true);
+      }
+    }
+    return false;
+  };
+
+  // Records the digest of a lane that has eaten all its blocks, unless its
+  // file couldn't be read to the end
+  auto finish = [&](std::size_t lane) {
+    const LaneInput &input = lanes[lane].input;
+    if (input.error) {
+      LOG_S(WARNING) << "Unable to hash " << paths[lanes[lane].file].native()
+                     << " (it may have been truncated while we read it): "
+                     << input.error.message();
+      return;
+    }
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    for (int word = 0; word != 4; ++word)
+      std::memcpy(digest + word * 4, &state[word][lane], 4);
+    results[lanes[lane].file] = md5_to_hex(digest);
+  };
+
+  std::size_t active = 0;
+  for (std::size_t lane = 0; lane != Lanes; ++lane)
+    if (load(lane))
+      ++active;
+  while (active > 0) {
+    for (std::size_t lane = 0; lane != Lanes; ++lane) {
+      const unsigned char *block = nullptr;
+      if (lanes[lane].active) {
+        block = lanes[lane].input.next();
+        // The next file may be unreadable from the start too
+        while (block == nullptr) {
+          finish(lane);
+          if (!load(lane)) {
+            --active;
+            break;
+          }
+          block = lanes[lane].input.next();
+        }
+      }
+      blocks[lane] = block ? block : idle;
+    }
+    if (active > 0)
+      transform(state, blocks);
+  }
+}
+
+#endif
+
+/// One file at a time, through openssl
+void hashOneByOne(const std::vector<fs::path> &paths,
+                  std::vector<std::string> &results) {
+  for (std::size_t i = 0; i != paths.size(); ++i) {
+    try {
+      results[i] = md5_from_file(paths[i]);
+    } catch (std::exception &e) {
+      LOG_S(WARNING) << "Unable to hash " << paths[i].native() << ": "
+                     << boost::diagnostic_information(e, true);
+    }
+  }
+}
+
+/// How many lanes an engine runs at once
+std::size_t lanesFor(MD5Engine engine) {
+  switch (engine) {
+  case MD5Engine::avx2:
+    return 8;
+  case MD5Engine::avx512:
+    return 16;
+  default:
+    return 1;
+  }
+}
+
+} /* anonymous namespace */
+
+bool md5EngineSupported(MD5Engine engine) {
+  switch (engine) {
+  case MD5Engine::scalar:
+    return true;
+#if defined(__x86_64__) || defined(__i386__)
+  case MD5Engine::avx2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  case MD5Engine::avx512:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#endif
+  default:
+    return false;
+  }
+}
+
+MD5Engine bestMD5Engine() {
+  if (md5EngineSupported(MD5Engine::avx512))
+    return MD5Engine::avx512;
+  if (md5EngineSupported(MD5Engine::avx2))
+    return MD5Engine::avx2;
+  return MD5Engine::scalar;
+}
+
+const char *md5EngineName(MD5Engine engine) {
+  switch (engine) {
+  case MD5Engine::avx2:
+    return "avx2";
+  case MD5Engine::avx512:
+    return "avx512";
+  default:
+    return "scalar";
+  }
+}
+
+std::vector<std::string> md5_from_files(const std::vector<fs::path> &paths) {
+  static const MD5Engine best = [] {
+    MD5Engine result = bestMD5Engine();
+    LOG_S(INFO) << "Using the " << md5EngineName(result)
+                << " md5 engine for bulk hashing";
+    return result;
+  }();
+  std::vector<std::string> results(paths.size());
+  // Only hash the files that the cache doesn't already know about
+  HashCache *cache = hashCache();
+  std::vector<HashCache::Key> keys(paths.size());
+  std::vector<fs::path> toHash;
+  std::vector<std::size_t> toHashIndex;
+  for (std::size_t i = 0; i != paths.size(); ++i) {
+    if (cache && HashCache::keyFor(paths[i], keys[i]))
+      results[i] = cache->find(paths[i].native(), keys[i]);
+    if (results[i].empty()) {
+      toHash.push_back(paths[i]);
+      toHashIndex.push_back(i);
+    }
+  }
+  if (toHash.empty())
+    return results;
+  // Unless at least half the lanes have something to do, openssl's single
+  // stream code is quicker
+  MD5Engine engine = best;
+  if (toHash.size() * 2 < lanesFor(best))
+    engine = MD5Engine::scalar;
+  std::vector<std::string> hashed(md5_from_files(toHash, engine));
+  for (std::size_t i = 0; i != toHash.size(); ++i) {
+    std::size_t index = toHashIndex[i];
+    results[index] = std::move(hashed[i]);
+    // Only remember it if the file didn't change while we were reading it
+    HashCache::Key after;
+    if (cache && !results[index].empty() &&
+        HashCache::keyFor(paths[index], after) && (after == keys[index]))
+      cache->store(paths[index].native(), keys[index], results[index]);
+  }
+  return results;
+}
+
+std::vector<std::string> md5_from_files(const std::vector<fs::path> &paths,
+                                        MD5Engine engine) {
+  assert(md5EngineSupported(engine));
+  LOG_SCOPE_F(5, "md5_from_files");
+  std::vector<std::string> results(paths.size());
+  switch (engine) {
+#if defined(__x86_64__) || defined(__i386__)
+  case MD5Engine::avx2:
+    hashInLanes<8>(paths, results, transformAVX2);
+    break;
+  case MD5Engine::avx512:
+    hashInLanes<16>(paths, results, transformAVX512);
+    break;
+#endif
+  default:
+    hashOneByOne(paths, results);
+  };
+  return results;
+}
+
+} /* jobs */
+} /* cdnalizerd  */
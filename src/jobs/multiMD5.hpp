@@ -0,0 +1,44 @@
+#pragma once
+/// Hashes many files at once.
+///
+/// md5 can't be parallelized within a single file, but with SIMD we can push
+/// one block from each of 8 (AVX2) or 16 (AVX-512) different files through the
+/// md5 rounds together. This is what the initial sync uses when it has a pile
+/// of files to check against the server.
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace fs = boost::filesystem;
+
+/// The different ways we know how to hash files
+enum class MD5Engine {
+  scalar, // One file at a time, using openssl
+  avx2,   // 8 files at a time
+  avx512  // 16 files at a time
+};
+
+/// The fastest engine that this CPU supports
+MD5Engine bestMD5Engine();
+
+/// Returns true if this CPU can run 'engine'
+bool md5EngineSupported(MD5Engine engine);
+
+/// Human readable engine name, for the logs
+const char *md5EngineName(MD5Engine engine);
+
+/// Returns the hex md5 of each file in 'paths', in the same order.
+/// Files that couldn't be read get "" (like md5_from_file).
+std::vector<std::string> md5_from_files(const std::vector<fs::path> &paths);
+
+/// Same as above, but forces a particular engine. The engine must be supported
+std::vector<std::string> md5_from_files(const std::vector<fs::path> &paths,
+                                        MD5Engine engine);
+
+} /* jobs */
+} /* cdnalizerd  */
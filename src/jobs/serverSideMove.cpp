@@ -0,0 +1,182 @@
+#include "serverSideMove.hpp"
+
+#include "delete.hpp"
+#include "listObjects.hpp"
+#include "md5.hpp"
+#include "upload.hpp"
+#include "../BlockingPool.hpp"
+#include "../exception_tags.hpp"
+#include "../logging.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/exception/enable_error_info.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+
+using namespace std::literals;
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace {
+
+/// How many connections a directory move uses at once
+constexpr std::size_t moveConnections = 8;
+
+/// Swift wants the copy's source without the /v1/<account> at the front of
+/// its URL path, ie. /<container>/<object>
+std::string accountRelative(const std::string &path) {
+  std::size_t slash = path.find('/', 1);
+  if (slash != std::string::npos)
+    slash = path.find('/', slash + 1);
+  return (slash == std::string::npos) ? path : path.substr(slash);
+}
+
+/// Copies 'source' to 'dest' on the server and puts the copy's ETag in
+/// 'etag'. Returns false if there's no 'source' to copy
+bool copyObject(HTTPS &conn, const std::string &token, const URL &source,
+                const URL &dest, std::string &etag) {
+  http::request<http::empty_body> req{http::verb::put, dest.pathAndSearch,
+                                      11};
+  req.set(http::field::host, dest.host);
+  req.set(http::field::user_agent, userAgent());
+  req.set("X-Auth-Token", token);
+  req.set("X-Copy-From", accountRelative(source.path));
+  req.prepare_payload();
+  DLOG_S(9) << "HTTP Request: " << req;
+  http::async_write(conn.stream(), req, conn.yield);
+  http::response<http::string_body> response;
+  http::async_read(conn.stream(), conn.read_buffer, response, conn.yield);
+  DLOG_S(9) << "HTTP Response: " << response.base();
+  switch (response.result()) {
+  case http::status::created:
+    etag = unquoted(response[http::field::etag]).to_string();
+    return true;
+  case http::status::not_found:
+    return false;
+  default:
+    BOOST_THROW_EXCEPTION(
+        boost::enable_error_info(std::runtime_error("HTTP Bad Response"))
+        << err::http_status(response.result()));
+  };
+}
+
+/// Moves one object on the server. Returns false if it wasn't there
+bool moveObject(HTTPS &conn, const std::string &token, const URL &source,
+                const URL &dest) {
+  std::string etag;
+  if (!copyObject(conn, token, source, dest, etag))
+    return false;
+  deleteRemoteFile(source, conn, token);
+  return true;
+}
+
+} /* anonymous namespace */
+
+Job makeServerSideMoveJob(URL source, URL dest, fs::path local) {
+  std::string name("Server side move from "s + source.whole() + " to " +
+                   dest.whole());
+  Job::Work go = [source, dest, local](HTTPS &conn, const std::string &token) {
+    LOG_SCOPE_F(5, "Server side move");
+    std::string etag;
+    if (!copyObject(conn, token, source, dest, etag)) {
+      // It was never uploaded under its old name (or we've been retried after
+      // moving it), so send it the usual way
+      LOG_S(1) << "Nothing to copy at " << source.whole() << ", uploading "
+               << local.native();
+      upload(local, dest, conn, token);
+      return;
+    }
+    // If the file changed just before it was renamed, the server's copy may
+    // be from before that; then the bytes have to go up after all
+    std::string md5(
+        runBlocking(conn.yield, [&local]() { return md5_from_file(local); }));
+    if (!md5.empty() && (md5 != etag)) {
+      LOG_S(1) << "Server's copy of " << local.native()
+               << " is out of date, uploading it";
+      upload(local, dest, conn, token, md5);
+    }
+    deleteRemoteFile(source, conn, token);
+    LOG_S(INFO) << "Moved " << source.whole() << " to " << dest.whole()
+                << " on the server";
+  };
+  return Job(std::move(name), go);
+}
+
+Job makeServerSideMoveTreeJob(URL fromContainer, std::string fromPrefix,
+                              URL toContainer, std::string toPrefix,
+                              std::function<void()> then) {
+  std::string name("Server side move of everything under "s +
+                   fromContainer.whole() + "/" + fromPrefix + " to " +
+                   toContainer.whole() + "/" + toPrefix);
+  Job::Work go = [fromContainer, fromPrefix, toContainer, toPrefix,
+                  then](HTTPS &conn, const std::string &token) {
+    LOG_SCOPE_F(5, "Server side tree move");
+    // Nothing in here throws, so we're never retried; whatever we couldn't
+    // move is left to 'then', which finds what's missing and uploads it
+    std::vector<std::string> names;
+    try {
+      names = listObjects(conn, token, fromContainer, fromPrefix);
+    } catch (std::exception &e) {
+      LOG_S(ERROR) << "Couldn't list " << fromContainer.whole() << "/"
+                   << fromPrefix << " to move it: " << e.what();
+    }
+    std::size_t next = 0;
+    std::size_t moved = 0;
+    // Each connection takes the next object until there are none left
+    auto work = [&](HTTPS &c) {
+      while (next != names.size()) {
+        const std::string &object = names[next++];
+        URL source(fromContainer / object);
+        URL dest(toContainer / (toPrefix + object.substr(fromPrefix.size())));
+        try {
+          if (moveObject(c, token, source, dest))
+            ++moved;
+        } catch (std::exception &e) {
+          LOG_S(WARNING) << "Couldn't move " << source.whole() << " to "
+                         << dest.whole() << ": " << e.what();
+          // We don't know what state the connection's in now
+          try {
+            c.reconnect();
+          } catch (std::exception &) {
+            return;
+          }
+        }
+      }
+    };
+    // A couple of objects aren't worth the extra connections
+    std::size_t helpers = std::min(moveConnections - 1, names.size() / 2);
+    std::size_t running = helpers;
+    asio::deadline_timer allDone(service());
+    allDone.expires_at(boost::posix_time::pos_infin);
+    for (std::size_t i = 0; i != helpers; ++i)
+      asio::spawn(service(), [&](yield_context yield) {
+        try {
+          HTTPS helper(yield, toContainer.host);
+          work(helper);
+        } catch (std::exception &e) {
+          LOG_S(WARNING) << "Couldn't connect to help move objects: "
+                         << e.what();
+        }
+        if (--running == 0)
+          allDone.cancel();
+      });
+    work(conn);
+    if (running != 0) {
+      boost::system::error_code ec;
+      allDone.async_wait(conn.yield[ec]);
+    }
+    LOG_S(INFO) << "Moved " << moved << " of " << names.size()
+                << " objects under " << fromContainer.whole() << "/"
+                << fromPrefix << " to " << toContainer.whole() << "/"
+                << toPrefix << " on the server";
+    if (then)
+      then();
+  };
+  return Job(std::move(name), go);
+}
+
+} /* jobs */
+} /* cdnalizerd  */
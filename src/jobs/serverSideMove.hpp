@@ -1,28 +1,29 @@
 #pragma once
+/// Renames objects on the server: a copy there (PUT with X-Copy-From), then a
+/// delete of the original. None of the bytes go through us.
 
 #include "../Job.hpp"
-#include "../exception_tags.hpp"
+#include "../url.hpp"
 
-namespace cdnalizerd {
+#include <functional>
+#include <string>
 
+namespace cdnalizerd {
 namespace jobs {
 
-Job makeServerSideMove(URL source, URL dest) {
-  Job::Worker go =
-      [ source = std::move(source), dest = std::move(dest) ](REST & conn) {
-      if (source.hostname != dest.hostname) {
-        // TODO: support a download, then upload copy ?
-        BOOST_THROW_EXCEPTION(boost::enable_error_info(std::runtime_error(
-                                  "We don't support server side copy between "
-                                  "two different hosts"))
-                              << err::source(source) << err::destination(dest));
-      }
-      conn.put(dest.path_part()).add_header("X-Copy-From", source.path_part()).go();
-      conn.delet(source.path_part()).go();
-  };
-  return Job("Server side move from "s + source + " to " + dest, go);
-}
+/// Returns a job that moves the object at 'source' to 'dest' on the server.
+/// Both must be in the same account. 'local' is the file as it is now; if the
+/// server doesn't have it yet, or has an old version of it, it's uploaded
+/// instead
+Job makeServerSideMoveJob(URL source, URL dest, fs::path local);
 
-} /* jobs */ 
-} /* cdnalizerd  */ 
+/// Returns a job that moves every object under 'fromPrefix' in 'fromContainer'
+/// to the same name under 'toPrefix' in 'toContainer', several at a time.
+/// Both containers must be in the same account. Calls 'then' when it's done,
+/// even if some of the objects couldn't be moved
+Job makeServerSideMoveTreeJob(URL fromContainer, std::string fromPrefix,
+                              URL toContainer, std::string toPrefix,
+                              std::function<void()> then);
 
+} /* jobs */
+} /* cdnalizerd  */
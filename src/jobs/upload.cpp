@@ -1,19 +1,17 @@
 #include "upload.hpp"
 
+#include "md5.hpp"
+#include "hashCache.hpp"
+#include "md5FileBody.hpp"
+#include "../BlockingPool.hpp"
 #include "../logging.hpp"
 #include "../exception_tags.hpp"
 
-#include <boost/beast/core/file.hpp>
-#include <boost/beast/http/file_body.hpp>
 #include <boost/exception/enable_error_info.hpp>
 #include <boost/exception/exception.hpp>
-#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/throw_exception.hpp>
 #include <boost/utility/string_view.hpp>
-#include <iomanip>
 #include <iostream>
-#include <openssl/md5.h>
-#include <sstream>
 #include <string>
 
 using namespace std::literals;
@@ -21,67 +19,43 @@ using namespace std::literals;
 namespace cdnalizerd {
 namespace jobs {
 
-/// Returns the file size and md5
-std::string md5_from_file(const fs::path &path) {
-  LOG_SCOPE_F(5, "md5_from_file");
-  unsigned char result[MD5_DIGEST_LENGTH];
-  try {
-    if (!fs::is_regular_file(path)) {
-      LOG_S(0) << "File may have been removed since event happened. Upload aborted";
-      return "";
-    }
-    boost::iostreams::mapped_file_source src(path.native());
-    MD5((const unsigned char *)src.data(), src.size(), result);
-  } catch (std::exception &e) {
-    LOG_S(WARNING) << boost::diagnostic_information(e, true);
-    BOOST_THROW_EXCEPTION(boost::enable_error_info(e)
-                          << err::action("Taking md5"));
-  } catch (...) {
-    LOG_S(WARNING) << boost::current_exception_diagnostic_information(true);
-    BOOST_THROW_EXCEPTION(
-        boost::enable_error_info(std::runtime_error("Unknown exception"))
-        << err::action("Taking md5"));
-  }
-
-  std::ostringstream sout;
-  sout << std::hex << std::setfill('0');
-  for (auto c : result)
-    sout << std::setw(2) << (int)c;
-
-  return sout.str();
+boost::string_view unquoted(boost::string_view etag) {
+  if ((etag.size() >= 2) && (etag.front() == '"') && (etag.back() == '"'))
+    return etag.substr(1, etag.size() - 2);
+  return etag;
 }
 
 /// Uploads a file.
-/// if md5 is not set, it'll read it from the file
+/// If md5 is set, the server checks the upload against it. If not, we work it
+/// out while sending the file, and check it against the ETag the server
+/// returns. Either way the file is only read once here.
 void upload(const fs::path &source, URL dest, HTTPS &conn,
-            const std::string &token, std::string md5 = "") {
+            const std::string &token, std::string md5) {
   try {
     LOG_SCOPE_F(5, "cdnalizerd::upload");
-    if (fs::file_size(source) == 0) {
-      // Code shouldn't really get here, because there's another check in
-      // processes/mainProcess.cpp where it'll only create this job if the file
-      // size is > 0
-      LOG_S(WARNING) << "Unable to upload zero length file. Aborting: " << source.native();
+    // Remember what the file looked like when we started, so we can cache its
+    // md5 if it doesn't change while we're sending it
+    HashCache::Key key;
+    if (!runBlocking(conn.yield,
+                     [&source, &key]() { return HashCache::keyFor(source, key); })) {
+      LOG_S(0) << "File may have been removed since event happened. Upload "
+                  "aborted: "
+               << source.native();
       return;
     }
     LOG_S(INFO) << "Uploading " << source.native() << " to " << dest.whole();
     namespace http = boost::beast::http;
-    using boost::beast::file_mode;
-    if (md5.empty() && (source.size() > 0)) {
-      DLOG_S(8) << "Getting MD5 of local file: " << source.native();
-      md5 = md5_from_file(source);
-      DLOG_S(9) << "Local MD5: " << md5;
-    }
     // Make the upload request
-    http::request<http::file_body> req;
+    http::request<MD5FileBody> req;
     setDefaultHeaders(req, token);
-    req.set(http::field::etag, md5);
+    if (!md5.empty())
+      req.set(http::field::etag, md5);
     req.set(http::field::host, dest.host);
     req.target(dest.pathAndSearch);
     req.method(http::verb::put);
     // Open the file
     boost::system::error_code ec;
-    req.body().open(source.native().c_str(), boost::beast::file_mode::scan, ec);
+    req.body().open(source.native().c_str(), ec);
     if (ec != boost::system::errc::success) {
       BOOST_THROW_EXCEPTION(
           boost::enable_error_info(boost::system::system_error(ec))
@@ -89,7 +63,22 @@ void upload(const fs::path &source, URL dest, HTTPS &conn,
     }
     req.set(http::field::content_length, req.body().size());
     LOG_S(9) << "HTTP Request: " << req.base();
-    http::async_write(conn.stream(), req, conn.yield);
+    if (conn.kernelSends()) {
+      // The kernel is doing the encryption, so the body can go straight from
+      // the page cache to the socket
+      http::request_serializer<MD5FileBody> serializer(req);
+      http::async_write_header(conn.stream(), serializer, conn.yield);
+      req.body().sendWith(
+          [&conn](int fd, std::uint64_t offset, std::size_t size) {
+            conn.sendfile(fd, offset, size);
+          },
+          ec);
+      if (ec)
+        BOOST_THROW_EXCEPTION(
+            boost::enable_error_info(boost::system::system_error(ec))
+            << err::action("Reading file"));
+    } else
+      http::async_write(conn.stream(), req, conn.yield);
     // Make sure it's OK
     http::response<http::string_body> response;
     http::async_read(conn.stream(), conn.read_buffer, response, conn.yield);
@@ -100,6 +89,21 @@ void upload(const fs::path &source, URL dest, HTTPS &conn,
       break;
     }
     case http::status::created: {
+      // Make sure what the server got is what we sent
+      boost::string_view serverMD5(unquoted(response[http::field::etag]));
+      const std::string &sentMD5(req.body().sentMD5());
+      DLOG_S(9) << "Sent MD5: " << sentMD5 << " - Server MD5: " << serverMD5;
+      if (!serverMD5.empty() && (serverMD5 != sentMD5))
+        BOOST_THROW_EXCEPTION(
+            boost::enable_error_info(std::runtime_error(
+                "Server's ETag doesn't match the md5 of what we sent"))
+            << err::action("Checking ETag"));
+      if (HashCache *cache = hashCache())
+        runBlocking(conn.yield, [cache, &source, &key, &sentMD5]() {
+          HashCache::Key after;
+          if (HashCache::keyFor(source, after) && (after == key))
+            cache->store(source.native(), key, sentMD5);
+        });
       LOG_S(0) << "Upload Successful";
       break;
     }
@@ -152,15 +156,7 @@ Job makeConditionalUploadJob(fs::path source, URL dest) {
     LOG_S(INFO) << "Conditionally Uploading " << source.native() << " to "
                 << dest.whole();
     try {
-      // Get the MD5 of the local file
-      DLOG_S(5) << "Getting MD5 of local file: " << source.native();
-      std::string md5;
-      md5 = md5_from_file(source);
-      if (md5 == "")
-        return;
       // Get the MD5 of the existing file from the server
-      for (char ch : dest.path)
-        std::cout << std::hex << ch;
       http::request<http::empty_body> req{http::verb::head, dest.path, 11};
       req.set(http::field::host, dest.host);
       req.set(http::field::user_agent, userAgent());
@@ -178,7 +174,7 @@ Job makeConditionalUploadJob(fs::path source, URL dest) {
       if (response.result() == http::status::not_found) {
         // File doesn't exist on the server, upload it
         LOG_S(1) << "File not found on server, uploading..";
-        upload(source, dest, conn, token, md5);
+        upload(source, dest, conn, token);
         return;
       } else if (response.result() != http::status::ok) {
         LOG_S(ERROR) << "Bad HTTP Response. HTTP Request: " << req
@@ -187,8 +183,30 @@ Job makeConditionalUploadJob(fs::path source, URL dest) {
             boost::enable_error_info(std::runtime_error("HTTP Bad Response"))
             << err::http_status(response.result()));
       }
-      auto etag = response.find(http::field::etag);
-      boost::string_view serverMD5(response[http::field::etag]);
+      HashCache::Key key;
+      if (!runBlocking(conn.yield, [&source, &key]() {
+            return HashCache::keyFor(source, key);
+          })) {
+        LOG_S(0) << "File may have been removed since event happened. Upload "
+                    "aborted";
+        return;
+      }
+      // If the sizes differ, the contents differ; no need to read the file
+      // just to find that out
+      boost::string_view serverSize(response[http::field::content_length]);
+      if (serverSize != std::to_string(key.size)) {
+        LOG_S(1) << "File size differs from server (" << serverSize
+                 << "), uploading..";
+        upload(source, dest, conn, token);
+        return;
+      }
+      // Same size, so we need the MD5 of the local file to know if it changed
+      DLOG_S(5) << "Getting MD5 of local file: " << source.native();
+      std::string md5 =
+          runBlocking(conn.yield, [&source]() { return md5_from_file(source); });
+      if (md5 == "")
+        return;
+      boost::string_view serverMD5(unquoted(response[http::field::etag]));
 
       // Now compare the md5 from the server with the file's actual md5
       if (md5 != serverMD5) {
@@ -4,6 +4,7 @@
 #include "../url.hpp"
 #include <boost/exception/exception.hpp>
 #include <boost/exception/errinfo_errno.hpp>
+#include <boost/utility/string_view.hpp>
 #include <string>
 
 namespace cdnalizerd {
@@ -15,6 +16,14 @@ using http_body = boost::error_info<struct HTTPBody, std::string>;
 
 struct UploadError : virtual boost::exception {};
 
+/// Swift sometimes puts quotes around ETags
+boost::string_view unquoted(boost::string_view etag);
+
+/// Uploads a file on a job's connection. If md5 is set, the server checks the
+/// upload against it
+void upload(const fs::path &source, URL dest, HTTPS &conn,
+            const std::string &token, std::string md5 = "");
+
 /// Upload a file
 Job makeUploadJob(fs::path source, URL dest);
 
@@ -0,0 +1,200 @@
+#include "uringMD5.hpp"
+
+#include "hashCache.hpp"
+#include "md5.hpp"
+#include "../logging.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace {
+
+/// How much of a file each read asks for
+constexpr std::size_t chunkSize = 256 * 1024;
+/// How many files we have open at once
+constexpr std::size_t maxOpen = 256;
+
+HashCache::Key keyFor(const struct statx &sb) {
+  HashCache::Key key;
+  key.device = makedev(sb.stx_dev_major, sb.stx_dev_minor);
+  key.inode = sb.stx_ino;
+  key.size = sb.stx_size;
+  key.mtime_ns =
+      static_cast<std::int64_t>(sb.stx_mtime.tv_sec) * 1000000000 +
+      sb.stx_mtime.tv_nsec;
+  key.ctime_ns =
+      static_cast<std::int64_t>(sb.stx_ctime.tv_sec) * 1000000000 +
+      sb.stx_ctime.tv_nsec;
+  return key;
+}
+
+/// Stats all of 'which' at once. Returns false for the ones we couldn't stat
+std::vector<bool> statAll(yield_context yield, IOURing &ring,
+                          const std::vector<fs::path> &paths,
+                          const std::vector<std::size_t> &which,
+                          std::vector<struct statx> &out) {
+  std::vector<io_uring_sqe> ops;
+  for (std::size_t index : which)
+    ops.push_back(IOURing::statx(paths[index].c_str(), &out[index]));
+  std::vector<int> results(ring.run(yield, std::move(ops)));
+  std::vector<bool> ok;
+  for (int result : results)
+    ok.push_back(result == 0);
+  return ok;
+}
+
+/// A file we're part way through reading
+struct Reading {
+  std::size_t index;
+  int fd;
+  std::uint64_t size;
+  std::uint64_t offset = 0;
+  MD5Stream md5;
+  bool failed = false;
+  // Set after a short read; the rest of this round's chunks are at the wrong
+  // offsets
+  bool skip = false;
+};
+
+/// Reads and hashes a group of files, keeping as many reads in flight as the
+/// ring allows
+void hashGroup(yield_context yield, IOURing &ring,
+               const std::vector<fs::path> &paths,
+               const std::vector<struct statx> &stats,
+               const std::vector<std::size_t> &group,
+               std::vector<char> &buffers, std::vector<std::string> &result) {
+  std::vector<io_uring_sqe> ops;
+  for (std::size_t index : group)
+    ops.push_back(IOURing::openat(paths[index].c_str(), O_RDONLY | O_CLOEXEC));
+  std::vector<int> fds(ring.run(yield, std::move(ops)));
+  std::vector<Reading> files;
+  for (std::size_t i = 0; i != group.size(); ++i)
+    if (fds[i] >= 0)
+      files.push_back({group[i], fds[i], stats[group[i]].stx_size});
+
+  struct Chunk {
+    Reading *file;
+    char *buffer;
+    unsigned size;
+  };
+  std::vector<Chunk> chunks;
+  while (true) {
+    std::vector<Reading *> active;
+    for (Reading &file : files)
+      if (!file.failed && (file.offset < file.size))
+        active.push_back(&file);
+    if (active.empty())
+      break;
+    // Share the ring out between the files, so big files get several reads in
+    // flight, and lots of small files get one each
+    std::size_t perFile = std::max<std::size_t>(1, ring.depth() / active.size());
+    ops.clear();
+    chunks.clear();
+    for (Reading *file : active) {
+      std::uint64_t offset = file->offset;
+      for (std::size_t i = 0; (i != perFile) && (offset < file->size) &&
+                              (chunks.size() != ring.depth());
+           ++i) {
+        unsigned amount = static_cast<unsigned>(
+            std::min<std::uint64_t>(chunkSize, file->size - offset));
+        char *buffer = buffers.data() + chunks.size() * chunkSize;
+        ops.push_back(IOURing::read(file->fd, buffer, amount, offset));
+        chunks.push_back({file, buffer, amount});
+        offset += amount;
+      }
+      if (chunks.size() == ring.depth())
+        break;
+    }
+    std::vector<int> got(ring.run(yield, std::move(ops)));
+    // The chunks are in file order, so we can hash them as they are
+    for (std::size_t i = 0; i != chunks.size(); ++i) {
+      Reading &file = *chunks[i].file;
+      if (file.failed || file.skip)
+        continue;
+      if (got[i] <= 0) {
+        // Either an error, or the file got shorter while we were reading it
+        file.failed = true;
+        continue;
+      }
+      file.md5.update(chunks[i].buffer, got[i]);
+      file.offset += got[i];
+      if (static_cast<unsigned>(got[i]) < chunks[i].size)
+        file.skip = true;
+    }
+    for (Reading *file : active)
+      file->skip = false;
+  }
+
+  ops.clear();
+  for (Reading &file : files)
+    ops.push_back(IOURing::close(file.fd));
+  ring.run(yield, std::move(ops));
+  for (Reading &file : files) {
+    if (file.failed)
+      continue;
+    file.md5.finish();
+    result[file.index] = file.md5.hex();
+  }
+}
+
+} /* anonymous namespace */
+
+std::vector<std::string> md5_from_files(yield_context yield, IOURing &ring,
+                                        const std::vector<fs::path> &paths) {
+  LOG_SCOPE_F(5, "md5_from_files (io_uring)");
+  std::vector<std::string> result(paths.size());
+  HashCache *cache = hashCache();
+  std::vector<std::size_t> all;
+  for (std::size_t i = 0; i != paths.size(); ++i)
+    all.push_back(i);
+  std::vector<struct statx> before(paths.size());
+  std::vector<bool> stated(statAll(yield, ring, paths, all, before));
+
+  // Read everything that's not in the cache
+  std::vector<std::size_t> toRead;
+  for (std::size_t i = 0; i != paths.size(); ++i) {
+    if (!stated[i] || !S_ISREG(before[i].stx_mode))
+      continue;
+    if (cache) {
+      std::string found = cache->find(paths[i].native(), keyFor(before[i]));
+      if (!found.empty()) {
+        DLOG_S(9) << "Hash cache hit: " << paths[i].native();
+        result[i] = found;
+        continue;
+      }
+    }
+    toRead.push_back(i);
+  }
+  std::vector<char> buffers(ring.depth() * chunkSize);
+  for (std::size_t start = 0; start < toRead.size(); start += maxOpen) {
+    std::vector<std::size_t> group(
+        toRead.begin() + start,
+        toRead.begin() + std::min(start + maxOpen, toRead.size()));
+    hashGroup(yield, ring, paths, before, group, buffers, result);
+  }
+
+  // Only remember the ones that didn't change while we were reading them
+  if (cache) {
+    std::vector<std::size_t> hashed;
+    for (std::size_t index : toRead)
+      if (!result[index].empty())
+        hashed.push_back(index);
+    std::vector<struct statx> after(paths.size());
+    std::vector<bool> restated(statAll(yield, ring, paths, hashed, after));
+    for (std::size_t i = 0; i != hashed.size(); ++i) {
+      HashCache::Key key(keyFor(before[hashed[i]]));
+      if (restated[i] && (keyFor(after[hashed[i]]) == key))
+        cache->store(paths[hashed[i]].native(), key, result[hashed[i]]);
+    }
+  }
+  return result;
+}
+
+} /* jobs */
+} /* cdnalizerd  */
@@ -0,0 +1,24 @@
+#pragma once
+/// Hashes many files through io_uring: the statx, openat and reads for lots of
+/// files are all in flight at once, rather than being done one at a time.
+
+#include "../IOURing.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+#include <vector>
+
+namespace cdnalizerd {
+namespace jobs {
+
+namespace fs = boost::filesystem;
+
+/// Returns the hex md5 of each file, in the same order as 'paths'. A file that
+/// has gone away (or can't be read) gets "". Uses and fills the hash cache,
+/// like md5_from_file
+std::vector<std::string> md5_from_files(yield_context yield, IOURing &ring,
+                                        const std::vector<fs::path> &paths);
+
+} /* jobs */
+} /* cdnalizerd  */
@@ -12,6 +12,11 @@
 #include "logging.hpp"
 #include "https.hpp"
 #include "exception_tags.hpp"
+#include "jobs/hashCache.hpp"
+#include "BlockingPool.hpp"
+#include "IOURing.hpp"
+#include "TraceWatcher.hpp"
+#include "Watcher.hpp"
 
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
@@ -32,13 +37,40 @@ int main(int argc, char **argv) {
       ".info or .ini")("create-sample",
                        "Creates an empty sample config file at 'config' "
                        "filename, and does nothing else")("go",
-                                                          "Start running...")(
+                                                          "Start running. "
+                                                          "The config is read "
+                                                          "again on SIGHUP, "
+                                                          "or once it "
+                                                          "changes")(
       "list", "List all the containers from the config to standard out")(
       "list-detailed",
       "List all the containers from the config to standard "
       "out, including md5sum, modification date (in UTC), "
       "content-type, size")("log-verbosity", po::value<int>()->default_value(0),
-                            "-9 to 9 - FATAL=-3, INFO=0, DEBUG=5, TRACE=9");
+                            "-9 to 9 - FATAL=-3, INFO=0, DEBUG=5, TRACE=9")(
+      "hash-cache",
+      po::value<std::string>()->default_value("/var/cache/cdnalizerd/hashes"),
+      "File to remember the md5s of unchanged files in, across restarts. "
+      "Empty to disable")(
+      "blocking-threads", po::value<unsigned>()->default_value(4),
+      "Threads for hashing, stats and directory walks, so they don't hold up "
+      "the network. 0 to do them on the main thread")(
+      "kernel-tls",
+      "Let the kernel do the TLS encryption (kTLS) where it can, and send "
+      "uploads with sendfile")(
+      "io-uring",
+      "Do the initial sync's stats and hashing through io_uring, with many "
+      "operations in flight at once")(
+      "fanotify",
+      "Watch whole file systems with fanotify instead of adding an inotify "
+      "watch to every directory. Needs CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH; "
+      "without them we fall back to inotify")(
+      "inotify-shards", po::value<unsigned>()->default_value(4),
+      "How many inotify handles to spread the config entries over, each with "
+      "its own kernel queue and reading thread")(
+      "record-events", po::value<std::string>(),
+      "Write every file event we get to this file, to replay later with "
+      "benchReplay");
   po::variables_map options;
   po::store(po::parse_command_line(argc, argv, desc), options);
   options.notify();
@@ -51,6 +83,19 @@ int main(int argc, char **argv) {
     return -1;
   }
   init_logging(verbosity);
+  if (options.count("kernel-tls")) {
+    TLSSettings settings;
+    settings.kernelTLS = true;
+    tlsSettings(settings);
+  }
+  if (options.count("fanotify"))
+    watcherKind(WatcherKind::fanotify);
+  inotifyShards(options["inotify-shards"].as<unsigned>());
+  if (options.count("record-events")) {
+    TraceSettings settings;
+    settings.record = options["record-events"].as<std::string>();
+    traceSettings(settings);
+  }
 
   // Handle the options
   std::string config_file_name = options["config"].as<std::string>();
@@ -69,6 +114,34 @@ int main(int argc, char **argv) {
       options.count("go")) {
     LOG_S(INFO) << "Reading config from " << config_file_name << std::endl;
     Config config = read_config(config_file_name);
+    std::unique_ptr<jobs::HashCache> hashes;
+    std::string hashCacheFile = options["hash-cache"].as<std::string>();
+    if (options.count("go") && !hashCacheFile.empty()) {
+      try {
+        boost::filesystem::create_directories(
+            boost::filesystem::path(hashCacheFile).parent_path());
+        hashes.reset(new jobs::HashCache(hashCacheFile));
+        jobs::hashCache(hashes.get());
+      } catch (std::exception &e) {
+        LOG_S(WARNING) << "Not caching file hashes: " << e.what();
+      }
+    }
+    // Declared after the hash cache, so any work still using it finishes first
+    std::unique_ptr<BlockingPool> pool;
+    unsigned blockingThreads = options["blocking-threads"].as<unsigned>();
+    if (options.count("go") && (blockingThreads > 0)) {
+      pool.reset(new BlockingPool(blockingThreads));
+      blockingPool(pool.get());
+    }
+    std::unique_ptr<IOURing> ring;
+    if (options.count("go") && options.count("io-uring")) {
+      try {
+        ring.reset(new IOURing());
+        ioURing(ring.get());
+      } catch (std::exception &e) {
+        LOG_S(WARNING) << "Not using io_uring: " << e.what();
+      }
+    }
     if (options.count("list"))
       asio::spawn(ios, [&config](yield_context yield) {
         AccountCache accounts;
@@ -100,10 +173,12 @@ int main(int argc, char **argv) {
           }
         }
       });
-    else if (options.count("go"))
+    else if (options.count("go")) {
+      cdnalizerd::processes::reloadConfigFrom(config_file_name);
       asio::spawn(ios, [&config](yield_context yield) {
         cdnalizerd::processes::watchForFileChanges(std::move(yield), config);
       });
+    }
     try {
       ios.run();
     } catch (boost::exception &e) {
@@ -0,0 +1,89 @@
+#include "destinations.hpp"
+
+#include "../exception_tags.hpp"
+
+#include <boost/exception/enable_error_info.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace cdnalizerd {
+namespace processes {
+
+namespace {
+
+/// 'name' without a '/' at either end, like URL joins its parts
+boost::string_view trimmed(boost::string_view name) {
+  if (!name.empty() && (name.front() == '/'))
+    name.remove_prefix(1);
+  if (!name.empty() && (name.back() == '/'))
+    name.remove_suffix(1);
+  return name;
+}
+
+} /* anonymous namespace */
+
+boost::string_view Destination::relative(boost::string_view path) const {
+  path.remove_prefix(std::min(localLength, path.size()));
+  while (!path.empty() && (path.front() == '/'))
+    path.remove_prefix(1);
+  return path;
+}
+
+std::string Destination::name(boost::string_view path) const {
+  boost::string_view name(trimmed(relative(path)));
+  std::string result(remoteDir);
+  if (!result.empty() && !name.empty())
+    result.push_back('/');
+  result.append(name.data(), name.size());
+  return result;
+}
+
+Destinations::Destinations(const Config &config, const AccountCache &accounts,
+                           WorkerManager &workers)
+    : accounts(accounts), workers(workers) {
+  add(config);
+}
+
+void Destinations::add(const Config &config) {
+  for (const ConfigEntry &entry : config.entries()) {
+    Destination &destination = destinations[&entry];
+    boost::string_view local(entry.local_dir);
+    while ((local.size() > 1) && (local.back() == '/'))
+      local.remove_suffix(1);
+    destination.localLength = local.size();
+    destination.remoteDir = trimmed(entry.remote_dir).to_string();
+    auto found = accounts.find(entry.username);
+    if (found == accounts.end())
+      continue;
+    destination.rs = &found->second;
+    const URL &url(found->second.getURL(entry.region, entry.snet));
+    destination.lane = &workers.lane(url.whole());
+    destination.container = url / entry.container;
+    destination.directory = url / entry.container / entry.remote_dir;
+  }
+}
+
+void Destinations::remove(const Config &config) {
+  for (const ConfigEntry &entry : config.entries())
+    destinations.erase(&entry);
+}
+
+const Destination *Destinations::find(const ConfigEntry &entry) const {
+  auto found = destinations.find(&entry);
+  if ((found == destinations.end()) || !found->second.rs)
+    return nullptr;
+  return &found->second;
+}
+
+const Destination &Destinations::operator[](const ConfigEntry &entry) const {
+  const Destination *found = find(entry);
+  if (!found)
+    BOOST_THROW_EXCEPTION(
+        boost::enable_error_info(std::runtime_error(
+            "All Rackspace accounts should be initialized "
+            "by the time this is called"))
+        << err::username(entry.username));
+  return *found;
+}
+
+} /* processes */
+} /* cdnalizerd */
@@ -0,0 +1,66 @@
+#pragma once
+/// Where each config entry's changes go on the server, worked out once after
+/// logging in: the account, the workers for its cloud files URL, and the URLs
+/// of its container and remote directory. An event then only has to add its
+/// path to them, with no lookups by name and no URLs parsed.
+
+#include "../AccountCache.hpp"
+#include "../WorkerManager.hpp"
+#include "../config/config.hpp"
+#include "../url.hpp"
+
+#include <boost/utility/string_view.hpp>
+
+#include <string>
+#include <unordered_map>
+
+namespace cdnalizerd {
+namespace processes {
+
+struct Destination {
+  // Null if the account didn't log in
+  const Rackspace *rs = nullptr;
+  WorkerManager::Lane *lane = nullptr;
+  URL container;
+  // container / remote_dir
+  URL directory;
+  // remote_dir, without '/'s at either end
+  std::string remoteDir;
+  // How much of a local path is the entry's local_dir
+  std::size_t localLength = 0;
+
+  /// 'path' (under the entry) relative to its local_dir
+  boost::string_view relative(boost::string_view path) const;
+  /// The name on the server of the object for 'path'
+  std::string name(boost::string_view path) const;
+  /// The URL of the object for 'path'
+  URL object(boost::string_view path) const {
+    return directory.child(relative(path));
+  }
+};
+
+class Destinations {
+private:
+  const AccountCache &accounts;
+  WorkerManager &workers;
+  // Those of configs we had before a reload stay until they're removed, as
+  // events that were already on their way can still be for their entries
+  std::unordered_map<const ConfigEntry *, Destination> destinations;
+
+public:
+  /// Call once the logins are done
+  Destinations(const Config &config, const AccountCache &accounts,
+               WorkerManager &workers);
+  Destinations(const Destinations &) = delete;
+  /// Adds the entries of a reloaded config, once its logins are done
+  void add(const Config &config);
+  /// Forgets the entries of a config that's been replaced
+  void remove(const Config &config);
+  /// Throws if the entry's account didn't log in
+  const Destination &operator[](const ConfigEntry &entry) const;
+  /// Null if the entry's account didn't log in (or hasn't yet)
+  const Destination *find(const ConfigEntry &entry) const;
+};
+
+} /* processes */
+} /* cdnalizerd */
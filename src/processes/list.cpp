@@ -197,6 +197,71 @@ void doJSONGetEntries(ListEntriesPusher out, yield_context &yield,
   }
 }
 
+namespace {
+
+/// Waits until 'timer' is cancelled
+void waitFor(yield_context yield, boost::asio::deadline_timer &timer) {
+  timer.expires_at(boost::posix_time::pos_infin);
+  boost::system::error_code ec;
+  timer.async_wait(yield[ec]);
+}
+
+} /* anonymous namespace */
+
+struct RemoteListing::State {
+  std::deque<nlohmann::json> entries;
+  bool finished = false;
+  bool stopped = false;
+  std::exception_ptr error;
+  // Cancelled when there's something to read, or room for more
+  boost::asio::deadline_timer readable;
+  boost::asio::deadline_timer writable;
+
+  State() : readable(service()), writable(service()) {}
+};
+
+RemoteListing::RemoteListing() : state(std::make_shared<State>()) {}
+
+RemoteListing::~RemoteListing() {
+  state->stopped = true;
+  state->writable.cancel();
+}
+
+void RemoteListing::start(const Rackspace &rs, const ConfigEntry &entry) {
+  asio::spawn(service(), [state = this->state, rs,
+                          entry](yield_context yield) {
+    try {
+      for (auto &&data : detailedListContainer(yield, rs, entry)) {
+        while (!state->stopped && (state->entries.size() >= maxAhead))
+          waitFor(yield, state->writable);
+        if (state->stopped)
+          return;
+        state->entries.push_back(std::move(data));
+        state->readable.cancel();
+      }
+    } catch (...) {
+      state->error = std::current_exception();
+    }
+    state->finished = true;
+    state->readable.cancel();
+  });
+}
+
+bool RemoteListing::next(yield_context yield, nlohmann::json &entry) {
+  while (state->entries.empty()) {
+    if (state->finished) {
+      if (state->error)
+        std::rethrow_exception(state->error);
+      return false;
+    }
+    waitFor(yield, state->readable);
+  }
+  entry = std::move(state->entries.front());
+  state->entries.pop_front();
+  state->writable.cancel();
+  return true;
+}
+
 template void doGetPages<std::vector<std::string>>(
     ListContainerPusher<std::vector<std::string>> out, yield_context &yield,
     const std::string &token, const URL &baseURL, const std::string &prefix,
@@ -9,8 +9,12 @@
 
 #include <nlohmann/json.hpp>
 #include <boost/algorithm/string/find.hpp>
+#include <boost/asio/deadline_timer.hpp>
 #include <boost/coroutine2/coroutine.hpp>
 
+#include <deque>
+#include <exception>
+#include <memory>
 #include <string>
 
 namespace cdnalizerd {
@@ -42,5 +46,28 @@ DetailedListEntriesResult detailedListContainer(yield_context &yield,
                                                 const ConfigEntry &entry,
                                                 std::string extra_params = "");
 
+/// A detailed listing that runs in its own coroutine, ahead of whoever reads
+/// it, so it can start as soon as we've logged in, while the local tree is
+/// still being walked. It gets at most 'maxAhead' entries ahead of the reader
+class RemoteListing {
+private:
+  static constexpr std::size_t maxAhead = 10000;
+  struct State;
+  // Shared with the listing coroutine, which may outlive us
+  std::shared_ptr<State> state;
+
+public:
+  RemoteListing();
+  RemoteListing(const RemoteListing &) = delete;
+  /// Stops listing
+  ~RemoteListing();
+  /// Starts listing 'entry's container. Both are copied, so they needn't
+  /// outlive us
+  void start(const Rackspace &rs, const ConfigEntry &entry);
+  /// Waits for the next entry. Returns false once there are no more, and
+  /// throws if listing failed
+  bool next(yield_context yield, nlohmann::json &entry);
+};
+
 } /* processes { */ 
 } /* cdnalizerd  */
@@ -4,8 +4,11 @@
 #include "../https.hpp"
 
 #include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
 #include <boost/system/system_error.hpp>
 
+#include <set>
+
 namespace cdnalizerd {
 
 // Fills the cache of all accounts - spawns more cooperative threads and waits for them
@@ -41,5 +44,70 @@ void login(yield_context &yield, AccountCache& accounts, const Config& config) {
 
 }
 
+struct Logins::State {
+  // Null once the Logins is gone
+  AccountCache *accounts;
+  OnLoggedIn onLoggedIn;
+  std::size_t left = 0;
+  // Cancelled once the last one is done
+  boost::asio::deadline_timer allDone;
+
+  State(AccountCache &accounts, OnLoggedIn onLoggedIn)
+      : accounts(&accounts), onLoggedIn(std::move(onLoggedIn)),
+        allDone(service()) {
+    allDone.expires_at(boost::posix_time::pos_infin);
+  }
+};
+
+Logins::Logins(const Config &config, AccountCache &accounts,
+               OnLoggedIn onLoggedIn)
+    : state(std::make_shared<State>(accounts, std::move(onLoggedIn))) {
+  std::set<std::string> usernames;
+  for (const ConfigEntry &entry : config.entries()) {
+    if (accounts.count(entry.username)) {
+      if (usernames.insert(entry.username).second)
+        state->onLoggedIn(entry.username);
+      continue;
+    }
+    if (!usernames.insert(entry.username).second)
+      continue;
+    ++state->left;
+    // The entry is copied, as the config may not outlive the login either
+    asio::spawn(service(), [state = this->state,
+                            entry](yield_context yield) {
+      LOG_S(INFO) << "Logging in as " << entry.username;
+      AccountCache fresh;
+      try {
+        fillSingleAccountCache(yield, entry, fresh);
+      } catch (std::exception &e) {
+        LOG_S(ERROR) << "Logging in as " << entry.username
+                     << " failed: " << e.what();
+      }
+      if (!state->accounts)
+        return;
+      auto found = fresh.find(entry.username);
+      if (found != fresh.end()) {
+        state->accounts->insert(std::move(*found));
+        state->onLoggedIn(entry.username);
+      }
+      if (--state->left == 0)
+        state->allDone.cancel();
+    });
+  }
+}
+
+Logins::~Logins() {
+  state->accounts = nullptr;
+  state->onLoggedIn = nullptr;
+  state->allDone.cancel();
+}
+
+void Logins::wait(yield_context yield) {
+  if (state->left == 0)
+    return;
+  boost::system::error_code ec;
+  state->allDone.async_wait(yield[ec]);
+}
+
   
 } /* cdnalizerd  */ 
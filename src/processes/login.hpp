@@ -3,9 +3,37 @@
 #include "../AccountCache.hpp"
 #include "../config/config.hpp"
 
+#include <functional>
+#include <memory>
+#include <string>
+
 namespace cdnalizerd {
 
 // Fills the cache of all accounts - spawns more cooperative threads and waits for them
 void login(yield_context &yield, AccountCache& accounts, const Config& config);
 
+/// Logs in to every account in a config that isn't in the cache yet, each in
+/// its own coroutine, without waiting for them. What needs one account can
+/// start as soon as it's in, and what needs them all can wait()
+class Logins {
+public:
+  /// Called as each account is logged in. It's not called for accounts that
+  /// fail; they're missing from the cache
+  using OnLoggedIn = std::function<void(const std::string &username)>;
+
+private:
+  struct State;
+  // Shared with the login coroutines, which may outlive us
+  std::shared_ptr<State> state;
+
+public:
+  Logins(const Config &config, AccountCache &accounts, OnLoggedIn onLoggedIn);
+  Logins(const Logins &) = delete;
+  /// Logins still going are left to finish on their own, without touching
+  /// the cache or calling onLoggedIn, so neither has to outlive us
+  ~Logins();
+  /// Waits for all the logins to succeed or fail
+  void wait(yield_context yield);
+};
+
 } /* cdnalizerd */ 
@@ -1,13 +1,22 @@
 #include "mainProcess.hpp"
 
+#include "../BlockingPool.hpp"
+#include "../Watcher.hpp"
 #include "../WorkerManager.hpp"
 #include "../config/config.hpp"
+#include "../config/config_reader.hpp"
 #include "../exception_tags.hpp"
-#include "../inotify.hpp"
 #include "../jobs/delete.hpp"
+#include "../jobs/hashCache.hpp"
+#include "../jobs/serverSideMove.hpp"
 #include "../jobs/upload.hpp"
 #include "../logging.hpp"
+#include "destinations.hpp"
 #include "login.hpp"
+#include "moves.hpp"
+#include "poll.hpp"
+#include "reload.hpp"
+#include "rescan.hpp"
 #include "syncAllDirectories.hpp"
 
 #include <boost/log/trivial.hpp>
@@ -15,202 +24,581 @@
 #include <boost/exception/enable_error_info.hpp>
 #include <boost/throw_exception.hpp>
 
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
 namespace cdnalizerd {
 
 namespace processes {
 
 namespace fs = boost::filesystem;
 
-constexpr int maskToFollow =
-    IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+std::string _global_reload_config_from;
+
+void reloadConfigFrom(std::string path) {
+  _global_reload_config_from = std::move(path);
+}
+
+const std::string &reloadConfigFrom() { return _global_reload_config_from; }
 
-// Maps an inotify cookie to the event that last had that cookie
-using Cookies = std::map<uint32_t, inotify::Event>;
+namespace {
 
-// Maps inotify watch handles to config entries
-using WatchToConfig = std::map<uint32_t, ConfigEntry>;
+/// How long we wait before logging in again to accounts that failed to: at
+/// first, and at most, as it doubles each time they fail again
+const boost::posix_time::seconds firstLoginRetry(60);
+const boost::posix_time::seconds lastLoginRetry(30 * 60);
 
-void watchNewDirectory(inotify::Instance &inotify, WatchToConfig &watchToConfig,
-                       const ConfigEntry &entry, const std::string &path) {
-  if (entry.shouldIgnoreDirectory(path))
-    LOG_S(9) << "Not watching ignored directory " << path;
-  else {
-    LOG_S(1) << "Adding inotify watch for: " << path;
-    // Starts watching a directory
-    inotify::Watch &watch = inotify.addWatch(path.c_str(), maskToFollow);
-    watchToConfig[watch.handle()] = entry;
+/// What the syncs, which run in coroutines of their own, share with the
+/// event loop. Each holds on to it, so it's still there if we fail while
+/// they're running
+struct SyncState {
+  AccountCache ownAccounts;
+  AccountCache &accounts;
+  RemoteListings listings;
+  LocalTrees trees;
+  WorkerManager workers;
+  LiveChanges live;
+  // Made once the logins are done
+  std::unique_ptr<Destinations> destinations;
+  // The config we're running now
+  const Config *config;
+  // Work under way that may point at the entries of configs we've replaced.
+  // They're kept until it's done
+  std::vector<std::weak_ptr<const void>> users;
+  // Set once watchForFileChanges is gone
+  bool stopped = false;
+
+  SyncState(const Config &config, AccountCache *loggedIn)
+      : accounts(loggedIn ? *loggedIn : ownAccounts), config(&config) {}
+
+  /// Something for such work to hold on to while it's under way
+  std::shared_ptr<const void> hold() {
+    auto held = std::make_shared<char>();
+    users.push_back(held);
+    return held;
   }
-}
+  /// True if any of it is still under way
+  bool inUse() {
+    users.erase(std::remove_if(users.begin(), users.end(),
+                               [](const std::weak_ptr<const void> &user) {
+                                 return user.expired();
+                               }),
+                users.end());
+    return !users.empty();
+  }
+};
 
-void recursivelyWatchDirectory(inotify::Instance &inotify,
-                               WatchToConfig &watchToConfig,
-                               const ConfigEntry &entry, const char *path) {
-  watchNewDirectory(inotify, watchToConfig, entry, entry.local_dir.c_str());
-  // Recurse to all sub directories
-  for (auto d = fs::recursive_directory_iterator(path); d != decltype(d)();
-       ++d) {
-    if (fs::is_directory(*d))
-      watchNewDirectory(inotify, watchToConfig, entry, d->path().native());
+/// Logs in again, every so often, to the accounts that failed to, and syncs
+/// their entries once they're in. Until then, their entries' events are
+/// dropped; the sync catches up on them
+void retryLogins(yield_context yield, std::shared_ptr<SyncState> shared) {
+  boost::asio::deadline_timer timer(service());
+  boost::posix_time::time_duration wait(firstLoginRetry);
+  while (true) {
+    timer.expires_from_now(wait);
+    boost::system::error_code ec;
+    timer.async_wait(yield[ec]);
+    if (shared->stopped)
+      return;
+    // A reload can replace the config while we log in and sync
+    auto held = shared->hold();
+    const Config &config(*shared->config);
+    std::vector<const ConfigEntry *> missing;
+    for (const ConfigEntry &entry : config.entries())
+      if (!shared->accounts.count(entry.username))
+        missing.push_back(&entry);
+    if (missing.empty()) {
+      wait = firstLoginRetry;
+      continue;
+    }
+    Logins logins(config, shared->accounts, [](const std::string &) {});
+    logins.wait(yield);
+    if (shared->stopped)
+      return;
+    std::vector<const ConfigEntry *> loggedIn;
+    for (const ConfigEntry *entry : missing)
+      if (shared->accounts.count(entry->username))
+        loggedIn.push_back(entry);
+    if (loggedIn.empty()) {
+      wait = std::min<boost::posix_time::time_duration>(wait * 2,
+                                                        lastLoginRetry);
+      LOG_S(WARNING) << "Still can't log in for " << missing.size()
+                     << " config entries. Trying again in "
+                     << wait.total_seconds() << " seconds";
+      continue;
+    }
+    wait = firstLoginRetry;
+    shared->destinations->add(config);
+    LOG_S(INFO) << "Logged in late for " << loggedIn.size()
+                << " config entries. Syncing them";
+    LiveChanges::Sync sync(shared->live);
+    try {
+      syncConfigEntries(yield, shared->accounts, loggedIn, shared->workers,
+                        nullptr, &shared->live);
+    } catch (std::exception &e) {
+      LOG_S(ERROR) << "Syncing entries that logged in late failed: "
+                   << boost::diagnostic_information(e, true);
+    }
   }
 }
 
-/// Reads our configuration object and creates all the inotify watches needed
-void createINotifyWatches(inotify::Instance &inotify,
-                          WatchToConfig &watchToConfig, const Config &config) {
-  for (const ConfigEntry &entry : config.entries())
-    recursivelyWatchDirectory(inotify, watchToConfig, entry, entry.local_dir.c_str());
-}
+} /* anonymous namespace */
 
-void watchForFileChanges(yield_context yield, const Config &config) {
+void watchForFileChanges(yield_context yield, const Config &config,
+                         AccountCache *loggedIn) {
   try {
-    LOG_S(INFO) << "Creating inotify watches..." << std::endl;
-    // Setup
-    inotify::Instance inotify(yield);
-    // Maps inotify watch handles to config entries
-    std::map<uint32_t, ConfigEntry> watchToConfig;
-    createINotifyWatches(inotify, watchToConfig, config);
+    // Setup. Nothing here needs anything else until jobs are made, so it all
+    // happens at once: each account logs in straight away, and each entry's
+    // container listing starts as soon as its account is in, while the
+    // watcher walks the trees. Then each entry's sync reads its listing as it
+    // comes, and the events are handled alongside
+    auto shared = std::make_shared<SyncState>(config, loggedIn);
+    // Tells the coroutines holding on to it that we've gone
+    struct Stopper {
+      SyncState &state;
+      ~Stopper() { state.stopped = true; }
+    } stopper{*shared};
+    AccountCache &accounts(shared->accounts);
+    RemoteListings &listings(shared->listings);
+    for (const ConfigEntry &entry : config.entries())
+      listings[&entry];
+    Logins logins(config, accounts, [&](const std::string &username) {
+      const Rackspace &rs = accounts.at(username);
+      for (const ConfigEntry &entry : config.entries())
+        if (entry.username == username)
+          listings[&entry].start(rs, entry);
+    });
 
-    // Account login information
-    AccountCache accounts;
-    login(yield, accounts, config);
+    // The initial sync uses the watcher's and the pollers' walks of the
+    // trees, rather than walking them again
+    LocalTrees &trees(shared->trees);
+    std::unique_ptr<Watcher> watcher(makeWatcher(yield, config, &trees));
+    // By the entry they poll for, in the config we have now
+    std::map<const ConfigEntry *, std::unique_ptr<Poller>> pollers;
+    for (const ConfigEntry &entry : config.entries())
+      if (entry.poll)
+        pollers[&entry].reset(new Poller(yield, entry, &trees[&entry]));
 
-    WorkerManager workers;
+    // Usually long done by now
+    logins.wait(yield);
 
-    syncAllDirectories(yield, accounts, config, workers);
+    WorkerManager &workers(shared->workers);
+    // Each entry's account, workers and URLs, so events don't look them up
+    shared->destinations.reset(new Destinations(config, accounts, workers));
+    Destinations &destinations(*shared->destinations);
+    asio::spawn(service(), [shared](yield_context yield) {
+      retryLogins(yield, shared);
+    });
 
-    /// Holds file move operations that are waiting for a pair
-    std::map<uint32_t, inotify::Event> cookies;
+    // The startup sync runs alongside the live events, rather than before
+    // them, so big trees don't leave a window where the kernel's queues fill
+    // up. Whatever the events see to, it leaves to them
+    LiveChanges &live(shared->live);
+    asio::spawn(service(), [shared, &config,
+                            held = shared->hold()](yield_context yield) {
+      LiveChanges::Sync sync(shared->live, std::adopt_lock);
+      try {
+        syncAllDirectories(yield, shared->accounts, config, shared->workers,
+                           &shared->trees, &shared->live, &shared->listings);
+        LOG_S(INFO) << "Startup sync done";
+      } catch (std::exception &e) {
+        LOG_S(ERROR) << "Startup sync failed: "
+                     << boost::diagnostic_information(e, true);
+      }
+    });
 
-    LOG_S(5) << "Waiting for file events" << std::endl;
-    while (true) {
-      inotify::Event event = inotify.waitForEvent();
-      LOG_S(5) << "Got an inotify event: " << event << std::endl;
-
-      // Get the job data ready
-      const ConfigEntry &entry = watchToConfig[event.watch().handle()];
-      auto found = accounts.find(entry.username);
-      if (found == accounts.end())
-        BOOST_THROW_EXCEPTION(
-            boost::enable_error_info(std::runtime_error(
-                "All Rackspace accounts should be initialized "
-                "by the time this is called"))
-            << err::username(entry.username));
-      Rackspace &rs = found->second;
-      fs::path localFile(event.path());
-      URL url(rs.getURL(entry.region, entry.snet));
-      auto worker = workers.getWorker(url.whole(), rs);
-      std::string localRelativePath(
-          fs::relative(event.path(), entry.local_dir).string());
-
-      // If the file was closed and may have been written, upload if checksum is
-      // different
-      if (event.wasClosed()) {
-        auto size = fs::file_size(localFile);
-        LOG_S(5) << "File was closed for writing: " << localFile.native() << " "
-                 << size << " bytes";
-        if (size > 0) {
-          if (entry.shouldIgnoreFile(localFile.native())) {
-            LOG_S(1) << "Ignoring file " << localFile.native();
-          } else {
-            LOG_S(9) << "Making upload job: " << localFile.native();
-            worker->addJob(jobs::makeConditionalUploadJob(
-                localFile,
-                url / entry.container / entry.remote_dir / localRelativePath));
-          }
-        }
-      } else if (event.wasIgnored()) {
-          LOG_S(9) << "Removing inotify watch for deleted directory";
-          auto found = watchToConfig.find(event.watch().handle());
-          // We should have already made a note of this watch and be tracking it
-          assert(found != watchToConfig.end());
-          watchToConfig.erase(found);
-          inotify.removeWatch(event.watch());
-      } else if (event.wasDeleted()) {
-        LOG_S(9) << "Got delete event: " << event.path();
-        if (!event.isDir()) {
-          if (entry.shouldIgnoreFile(localFile.native())) {
-            LOG_S(1) << "Ignoring file " << localFile.native();
-          } else {
-            LOG_S(9) << "Creating delete job";
-            worker->addJob(jobs::makeRemoteDeleteJob(
-                url / entry.container / entry.remote_dir / localRelativePath));
-          }
-        }
-      } else if (event.wasCreated()) {
-        // ... if a directory was created, add a watch to it
-        if (event.isDir())
-          watchNewDirectory(inotify, watchToConfig, entry,
-                            event.path().c_str());
-        // TODO: Sometimes files are created with > zero bytes. Check the file
-        // size; if it's > 0, upload it
+    // Catches up when the kernel drops events
+    Rescanner rescanner(*watcher, accounts, workers);
+
+    auto workerFor = [&workers](const Destination &destination) {
+      return workers.getWorker(*destination.lane, *destination.rs);
+    };
+    // Null if the entry's account isn't logged in (yet). Its events are
+    // dropped; the sync once it does log in catches up on them
+    auto destinationFor = [&](const ConfigEntry &entry) -> const Destination * {
+      const Destination *destination = destinations.find(entry);
+      if (!destination)
+        LOG_S(1) << "Dropping an event for " << entry.local_dir << " as "
+                 << entry.username << " isn't logged in";
+      return destination;
+    };
+    // Uploads a file that may have changed, unless it's empty (the file may
+    // already be gone again) or ignored. 'yield' is the calling coroutine's;
+    // the events, the pollers and the move pairer each have their own
+    auto uploadFile = [&](yield_context yield, const ConfigEntry &entry,
+                          const fs::path &localFile) {
+      const Destination *destination = destinationFor(entry);
+      if (!destination)
+        return;
+      auto size = runBlocking(yield, [&localFile]() -> boost::uintmax_t {
+        boost::system::error_code ec;
+        auto size = fs::file_size(localFile, ec);
+        return ec ? 0 : size;
+      });
+      LOG_S(5) << "File may have been written: " << localFile.native() << " "
+               << size << " bytes";
+      if (size == 0)
+        return;
+      if (entry.shouldIgnoreFile(localFile.native())) {
+        LOG_S(1) << "Ignoring file " << localFile.native();
+        return;
       }
-      /*
-      // If it's a move event, find its pair
-      if (event.cookie) {
-        auto found = cookies.find(event.cookie);
-        if (found != cookies.end()) {
-          if (event.wasMovedTo())
-            std::swap(event, found->second);
-          if (event.wasMovedFrom())
-            event.destination.reset(new
-      inotify::Event(std::move(found->second)));
-          else {
-            /// TODO: Log a runtime error here, only move events should have
-            /// cookies
-            cookies.erase(found);
-          }
-        } else {
-          // The event's partner hasn't been found yet.
-          // Store it in cookies; start another worker that'll wait 1 second,
-      then
-          // launch it as a delete if it's still there
-          // TODO: Launch the cleanup worker
-          continue; // Wait for its partner to appear
+      auto worker = workerFor(*destination);
+      LOG_S(9) << "Making upload job: " << localFile.native();
+      rescanner.uploading(entry, localFile.native());
+      worker->addJob(jobs::makeConditionalUploadJob(
+          localFile, destination->object(localFile.native())));
+    };
+    // Removes a file, or everything under a directory, from the server
+    auto deleteRemote = [&](const ConfigEntry &entry, const fs::path &localFile,
+                            bool isDir) {
+      if (isDir ? entry.shouldIgnoreDirectory(localFile.native())
+                : entry.shouldIgnoreFile(localFile.native())) {
+        LOG_S(1) << "Ignoring " << localFile.native();
+        return;
+      }
+      const Destination *destination = destinationFor(entry);
+      if (!destination)
+        return;
+      auto worker = workerFor(*destination);
+      if (isDir) {
+        LOG_S(9) << "Creating delete job for everything under "
+                 << localFile.native();
+        worker->addJob(jobs::makeRemoteDeleteTreeJob(
+            destination->container,
+            destination->name(localFile.native()) + "/"));
+      } else {
+        LOG_S(9) << "Creating delete job";
+        worker->addJob(jobs::makeRemoteDeleteJob(
+            destination->object(localFile.native())));
+      }
+    };
+    // The md5s of files that are gone are no use to us any more
+    auto forgetHashes = [](const std::string &path, bool isDir) {
+      if (jobs::HashCache *cache = jobs::hashCache())
+        cache->forget(path, isDir);
+    };
+    // Something turned up under 'entry' without our seeing it being made
+    auto arrived = [&](yield_context yield, const ConfigEntry &entry,
+                       const MoveHalf &to) {
+      if (to.isDir)
+        rescanner.newDirectory(entry, to.path, true);
+      else
+        uploadFile(yield, entry, to.path);
+    };
+    auto movedIn = [&](yield_context yield, const MoveHalf &to) {
+      for (const ConfigEntry *entry : *to.entries)
+        arrived(yield, *entry, to);
+    };
+    // Something left our directories
+    auto movedOut = [&](yield_context, const MoveHalf &from) {
+      if (from.isDir)
+        watcher->directoryGone(from.path);
+      forgetHashes(from.path, from.isDir);
+      for (const ConfigEntry *entry : *from.entries)
+        deleteRemote(*entry, from.path, from.isDir);
+    };
+    // Moves what's on the server for 'fromEntry' to where 'toEntry' keeps it
+    auto moveRemote = [&](yield_context yield, const ConfigEntry &fromEntry,
+                          const MoveHalf &from, const ConfigEntry &toEntry,
+                          const MoveHalf &to) {
+      bool ignored =
+          from.isDir ? (fromEntry.shouldIgnoreDirectory(from.path) ||
+                        toEntry.shouldIgnoreDirectory(to.path))
+                     : (fromEntry.shouldIgnoreFile(from.path) ||
+                        toEntry.shouldIgnoreFile(to.path));
+      // The server can only copy within an account
+      bool sameAccount = (fromEntry.username == toEntry.username) &&
+                         (fromEntry.region == toEntry.region) &&
+                         (fromEntry.snet == toEntry.snet);
+      if (ignored || !sameAccount) {
+        deleteRemote(fromEntry, from.path, from.isDir);
+        arrived(yield, toEntry, to);
+        return;
+      }
+      // Both or neither, as they're the same account
+      const Destination *source = destinations.find(fromEntry);
+      const Destination *destination = destinationFor(toEntry);
+      if (!source || !destination)
+        return;
+      auto worker = workerFor(*destination);
+      if (from.isDir) {
+        LOG_S(9) << "Making server side move job for everything under "
+                 << from.path;
+        // Once it's moved, a catch up pass uploads whatever the server didn't
+        // have; it's only a HEAD for each file that's already there
+        worker->addJob(jobs::makeServerSideMoveTreeJob(
+            source->container, source->name(from.path) + "/",
+            destination->container, destination->name(to.path) + "/",
+            [&rescanner, &toEntry, path = to.path, held = shared->hold()]() {
+              rescanner.newDirectory(toEntry, path, true);
+            }));
+      } else {
+        LOG_S(9) << "Making server side move job: " << from.path;
+        rescanner.uploading(toEntry, to.path);
+        worker->addJob(jobs::makeServerSideMoveJob(source->object(from.path),
+                                                   destination->object(to.path),
+                                                   to.path));
+      }
+    };
+    auto moved = [&](yield_context yield, const MoveHalf &from,
+                     const MoveHalf &to) {
+      LOG_S(5) << "Moved " << from.path << " to " << to.path;
+      if (from.isDir && !watcher->directoryMoved(from.path, to.path))
+        watcher->directoryGone(from.path);
+      // Entries at both ends move their own copies. Of the rest, the ones
+      // only at the start are paired off with the ones only at the end (both
+      // in config order), and any left over are a delete or an upload
+      std::vector<const ConfigEntry *> leaving, coming;
+      for (const ConfigEntry *entry : *from.entries)
+        if (std::find(to.entries->begin(), to.entries->end(), entry) ==
+            to.entries->end())
+          leaving.push_back(entry);
+        else
+          moveRemote(yield, *entry, from, *entry, to);
+      for (const ConfigEntry *entry : *to.entries)
+        if (std::find(from.entries->begin(), from.entries->end(), entry) ==
+            from.entries->end())
+          coming.push_back(entry);
+      std::size_t i = 0;
+      for (; (i != leaving.size()) && (i != coming.size()); ++i)
+        moveRemote(yield, *leaving[i], from, *coming[i], to);
+      for (std::size_t j = i; j != leaving.size(); ++j)
+        deleteRemote(*leaving[j], from.path, from.isDir);
+      for (std::size_t j = i; j != coming.size(); ++j)
+        arrived(yield, *coming[j], to);
+    };
+    MovePairer moves(moved, movedOut, movedIn);
+    auto startPolling = [&](Poller &poller) {
+      poller.start(
+          [&](yield_context yield, const ConfigEntry &entry,
+              const std::string &path) {
+            live.noteEvent(path);
+            uploadFile(yield, entry, path);
+          },
+          [&](const ConfigEntry &entry, const std::string &path, bool isDir) {
+            live.noteEvent(path);
+            forgetHashes(path, isDir);
+            deleteRemote(entry, path, isDir);
+          });
+    };
+    for (auto &poller : pollers)
+      startPolling(*poller.second);
+
+    // Reloading the config. Entries that haven't changed keep their watches,
+    // pollers, workers and logins; new and changed ones are set up and synced
+    // like at startup, while the events carry on. The configs we replace are
+    // kept until nothing on its way can still point at their entries: the
+    // events being handled, moves being paired, rescans, syncs, polls, and
+    // jobs that call back
+    std::list<Config> reloaded;
+    const Config *&current = shared->config;
+    std::vector<const Config *> replaced;
+    bool reloading = false, reloadWanted = false;
+    auto retire = [&]() {
+      if (replaced.empty() || reloading || !moves.idle() ||
+          !rescanner.idle() || shared->inUse())
+        return;
+      for (const Config *old : replaced) {
+        for (const ConfigEntry &entry : old->entries()) {
+          listings.erase(&entry);
+          trees.erase(&entry);
+          rescanner.forget(entry);
         }
+        destinations.remove(*old);
       }
-      // Now we have a whole event...
-      if (event.wasCreated()) {
-        // ... if a directory was created, add a watch to it
-        fs::path path = event.path();
-        if (fs::is_directory(path)) {
-          inotify.addWatch(path.c_str(), maskToFollow);
+      watcher->forgetOldConfigs();
+      reloaded.remove_if(
+          [&current](const Config &old) { return &old != current; });
+      LOG_S(5) << "Let go of " << replaced.size() << " replaced configs";
+      replaced.clear();
+    };
+    auto reload = [&](yield_context yield) {
+      reloaded.emplace_back();
+      try {
+        reloaded.back() = read_config(reloadConfigFrom(), true);
+      } catch (std::exception &e) {
+        reloaded.pop_back();
+        LOG_S(ERROR) << "Keeping the config we have, as the new one can't be "
+                        "read: "
+                     << e.what();
+        return;
+      }
+      const Config &next = reloaded.back();
+      if (!next) {
+        reloaded.pop_back();
+        LOG_S(ERROR) << "Keeping the config we have, as the new one has no "
+                        "entries";
+        return;
+      }
+      // Pair each entry with an equal one we have; the rest are new or changed
+      std::map<const ConfigEntry *, const ConfigEntry *> same;
+      std::vector<const ConfigEntry *> added;
+      std::vector<bool> matched(current->entries().size(), false);
+      for (const ConfigEntry &entry : next.entries()) {
+        std::size_t i = 0;
+        for (; i != matched.size(); ++i)
+          if (!matched[i] && (current->entries()[i] == entry))
+            break;
+        if (i == matched.size()) {
+          added.push_back(&entry);
           continue;
         }
-        // TODO: Sometimes files are created with > zero bytes. Check the file
-        // size; if it's > 0, upload it
+        matched[i] = true;
+        same[&entry] = &current->entries()[i];
+      }
+      std::size_t removed = std::count(matched.begin(), matched.end(), false);
+      if (added.empty() && (removed == 0)) {
+        reloaded.pop_back();
+        LOG_S(INFO) << "The config hasn't changed";
+        return;
+      }
+      LOG_S(INFO) << "Reloading the config: " << added.size()
+                  << " new or changed entries, and " << removed
+                  << " removed";
+
+      // The new entries' accounts and listings. Accounts we already have
+      // aren't logged in again
+      for (const ConfigEntry *entry : added)
+        listings[entry];
+      Logins logins(next, accounts, [&](const std::string &username) {
+        const Rackspace &rs = accounts.at(username);
+        for (const ConfigEntry *entry : added)
+          if (entry->username == username)
+            listings[entry].start(rs, *entry);
+      });
+      logins.wait(yield);
+      // Before any events come for them
+      destinations.add(next);
+      replaced.push_back(current);
+      current = &next;
+
+      // Pollers of unchanged entries carry on, with the new entries; those of
+      // removed ones stop, though they may finish the round they're in
+      std::map<const ConfigEntry *, std::unique_ptr<Poller>> kept;
+      for (const auto &pair : same) {
+        auto found = pollers.find(pair.second);
+        if (found == pollers.end())
+          continue;
+        found->second->follow(*pair.first, shared->hold());
+        kept[pair.first] = std::move(found->second);
       }
-      if (event.wasClosed()) {
-        // File was closed; could have been written.
-        // Upload if newer than the remote
+      pollers.swap(kept);
+      for (const auto &poller : kept)
+        if (poller.second)
+          shared->users.push_back(poller.second->lifetime());
+      kept.clear();
+
+      watcher->reconfigure(yield, next, added, &trees);
+      for (const ConfigEntry *entry : added)
+        if (entry->poll) {
+          std::unique_ptr<Poller> poller(
+              new Poller(yield, *entry, &trees[entry]));
+          startPolling(*poller);
+          pollers[entry] = std::move(poller);
+        }
 
+      {
+        LiveChanges::Sync sync(live);
+        syncConfigEntries(yield, accounts, added, workers, &trees, &live,
+                          &listings);
       }
+      // The listings stay, as one the sync gave up on can still be filling
+      for (const ConfigEntry *entry : added)
+        trees.erase(entry);
+      LOG_S(INFO) << "Config reloaded";
+    };
+    // One reload at a time. Another asked for meanwhile runs after it, with
+    // whatever the config is by then
+    std::unique_ptr<ReloadTrigger> reloadTrigger;
+    if (!reloadConfigFrom().empty())
+      reloadTrigger.reset(new ReloadTrigger(reloadConfigFrom(), [&]() {
+        reloadWanted = true;
+        if (reloading)
+          return;
+        reloading = true;
+        asio::spawn(service(), [&](yield_context yield) {
+          while (reloadWanted) {
+            reloadWanted = false;
+            try {
+              reload(yield);
+            } catch (std::exception &e) {
+              LOG_S(ERROR) << "Reloading the config failed: "
+                           << boost::diagnostic_information(e, true);
+            }
+          }
+          reloading = false;
+          retire();
+        });
+      }));
+
+    LOG_S(5) << "Waiting for file events" << std::endl;
+    while (true) {
+      const std::vector<inotify::Event> &events = watcher->waitForEvents();
+      // The batch's entries point into the watcher's index and the config,
+      // and uploads and moves yield part way through it, so a reload that
+      // finishes then mustn't let go of them
+      auto held = shared->hold();
+      for (const inotify::Event &event : events) {
+        LOG_S(5) << "Got an inotify event: " << event << std::endl;
+
+        if (event.wasIgnored())
+          // The watcher forgets the watch itself
+          continue;
+        if (event.wasOverflowed()) {
+          LOG_S(WARNING) << "The kernel's event queue overflowed. Rescanning";
+          rescanner.overflowed(watcher->overflowed(event));
+          continue;
+        }
+
+        const EntryIndex::Entries &entries = watcher->entries(event);
+        if (entries.empty()) {
+          LOG_S(9) << "Event isn't for any of our directories";
+          continue;
+        }
+        // The only time we build the event's path
+        fs::path localFile(watcher->path(event));
+        live.noteEvent(localFile.native());
+        // Renames are paired up once, for all the entries they're under
+        if (event.wasMovedFrom()) {
+          moves.movedFrom(yield, event.cookie,
+                          {&entries, localFile.native(), event.isDir()});
+          continue;
+        } else if (event.wasMovedTo()) {
+          moves.movedTo(yield, event.cookie,
+                        {&entries, localFile.native(), event.isDir()});
+          continue;
+        }
+        if (event.wasDeleted() && !event.isDir())
+          forgetHashes(localFile.native(), false);
 
-      // If this event is a move and has a destionation..
-      if (event.wasMovedFrom()) {
-        if (event.destination) {
-          // This may be a server side rename (copy + delete)
-          const ConfigEntry &dest =
-              watchToConfig[event.destination->watch().handle()];
-          // The original job should be a server side copy
-          worker->addJob(makeServerSideMoveJob(
-              remoteURL, rs.getURL(*dest.region, dest.snet) / *dest.container /
-                             dest.remote_dir /
-                             unJoinPaths(dest.local_dir, event.path())));
-        } else {
-          // This file was moved out of our known directory space, delete it
-          // from the server
-          job.operation = SDelete;
-          job.dest.clear();
+        // Entries can overlap; each one that the file is under syncs it
+        for (const ConfigEntry *entryPtr : entries) {
+          const ConfigEntry &entry = *entryPtr;
+          rescanner.activity(entry, localFile.native());
+          if (event.wasClosed()) {
+            // File was closed and may have been written; upload it if its
+            // checksum is different
+            uploadFile(yield, entry, localFile);
+          } else if (event.wasDeleted()) {
+            LOG_S(9) << "Got delete event: " << localFile.native();
+            // Everything in a directory is deleted before it is
+            if (!event.isDir())
+              deleteRemote(entry, localFile, false);
+          } else if (event.wasCreated() && event.isDir()) {
+            // Watch it, and catch up on anything already in it
+            rescanner.newDirectory(entry, localFile.native(), false);
+          }
         }
-        // Put it in the right queue
-        auto worker = workers.getWorker(job.workerURL(), rs);
-        worker->addJob(std::move(job));
-      } else if (event.wasDeleted()) {
-        job.operation = SDelete;
-        job.source.swap(job.dest);
-        job.dest.clear();
+        // TODO: Sometimes files are created with > zero bytes. Check the file
+        // size; if it's > 0, upload it
       }
-        */
+      // Nothing from this batch points into the old configs any more
+      held.reset();
+      retire();
     }
   } catch (boost::exception &e) {
     LOG_S(ERROR) << "watchForFileChanges failed: "
@@ -1,12 +1,23 @@
 #pragma once
 
+#include "../AccountCache.hpp"
 #include "../config/config.hpp"
 
+#include <string>
+
 namespace cdnalizerd {
 namespace processes {
 
+/// Sets where watchForFileChanges() reads the config again from, on a SIGHUP
+/// or when it changes. Empty (the default) for never
+void reloadConfigFrom(std::string path);
+const std::string &reloadConfigFrom();
+
 /// This is the main function in the app and watches for file changes, then launches processes as required
-void watchForFileChanges(yield_context yield, const Config& config);
+/// If 'loggedIn' is given, it's used instead of logging in to the accounts.
+/// 'config' must outlive it
+void watchForFileChanges(yield_context yield, const Config& config,
+                         AccountCache *loggedIn = nullptr);
 
 }
 } /* processes */ 
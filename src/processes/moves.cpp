@@ -0,0 +1,92 @@
+#include "moves.hpp"
+
+#include "../https.hpp"
+#include "../logging.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+
+namespace cdnalizerd {
+namespace processes {
+
+namespace {
+
+/// How long we wait for the second half of a rename. The kernel queues both
+/// halves together, but a read can end between them, and when they're on
+/// different inotify handles, either can be read first
+const boost::posix_time::time_duration pairingTimeout =
+    boost::posix_time::milliseconds(500);
+
+boost::posix_time::ptime now() {
+  return boost::posix_time::microsec_clock::universal_time();
+}
+
+} /* anonymous namespace */
+
+void MovePairer::movedFrom(yield_context yield, std::uint32_t cookie,
+                           MoveHalf from) {
+  if (cookie == 0)
+    // No way of finding its partner
+    onMovedOut(yield, from);
+  else
+    add(yield, cookie, std::move(from), true);
+}
+
+void MovePairer::movedTo(yield_context yield, std::uint32_t cookie,
+                         MoveHalf to) {
+  if (cookie == 0)
+    onMovedIn(yield, to);
+  else
+    add(yield, cookie, std::move(to), false);
+}
+
+void MovePairer::add(yield_context yield, std::uint32_t cookie, MoveHalf half,
+                     bool isFrom) {
+  for (auto i = pending.begin(); i != pending.end(); ++i)
+    if ((i->cookie == cookie) && (i->isFrom != isFrom)) {
+      Pending partner(std::move(*i));
+      pending.erase(i);
+      if (isFrom)
+        onMoved(yield, half, partner.half);
+      else
+        onMoved(yield, partner.half, half);
+      return;
+    }
+  pending.push_back({cookie, std::move(half), isFrom, now() + pairingTimeout});
+  expireLater();
+}
+
+void MovePairer::expireLater() {
+  if (timing)
+    return;
+  timing = true;
+  asio::spawn(service(), [this](yield_context yield) {
+    boost::asio::deadline_timer timer(service());
+    while (!pending.empty()) {
+      timer.expires_at(pending.front().deadline);
+      boost::system::error_code ec;
+      timer.async_wait(yield[ec]);
+      // Partners may have turned up while we waited
+      while (!pending.empty() && (pending.front().deadline <= now())) {
+        Pending alone(std::move(pending.front()));
+        pending.pop_front();
+        LOG_S(9) << "Nothing was moved to match " << alone.half.path;
+        try {
+          if (alone.isFrom)
+            onMovedOut(yield, alone.half);
+          else
+            onMovedIn(yield, alone.half);
+        } catch (std::exception &e) {
+          LOG_S(ERROR) << "Handling " << alone.half.path
+                       << " being moved failed: "
+                       << boost::diagnostic_information(e, true);
+        }
+      }
+    }
+    timing = false;
+  });
+}
+
+} /* processes */
+} /* cdnalizerd  */
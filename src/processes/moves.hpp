@@ -0,0 +1,78 @@
+#pragma once
+/// Pairs up the two halves of renames. inotify tells us about a rename with an
+/// IN_MOVED_FROM and an IN_MOVED_TO that share a cookie. They can come in
+/// either order, when they're on different inotify handles. If only one half
+/// turns up, the other end is outside our directories, so it was really a
+/// delete or a create. fanotify events have no cookies, so each of their
+/// halves is on its own.
+
+#include "../EntryIndex.hpp"
+#include "../common.hpp"
+#include "../config/config.hpp"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+
+namespace cdnalizerd {
+namespace processes {
+
+/// One end of a rename
+struct MoveHalf {
+  // The config entries it's under; the watcher's, so never empty
+  const EntryIndex::Entries *entries;
+  std::string path;
+  bool isDir;
+};
+
+class MovePairer {
+public:
+  /// Each is called with the yield_context of the coroutine it runs in: the
+  /// one the half came in on, or our own for the ones that time out
+  using OnMoved = std::function<void(yield_context yield, const MoveHalf &from,
+                                     const MoveHalf &to)>;
+  /// For a half whose partner never turned up
+  using OnAlone = std::function<void(yield_context yield, const MoveHalf &half)>;
+
+private:
+  struct Pending {
+    std::uint32_t cookie;
+    MoveHalf half;
+    // Whether 'half' is the IN_MOVED_FROM
+    bool isFrom;
+    boost::posix_time::ptime deadline;
+  };
+  OnMoved onMoved;
+  OnAlone onMovedOut;
+  OnAlone onMovedIn;
+  // Oldest first
+  std::deque<Pending> pending;
+  bool timing = false;
+
+  /// Pairs 'half' with its partner if we've had it, otherwise waits a little
+  /// while for it
+  void add(yield_context yield, std::uint32_t cookie, MoveHalf half,
+           bool isFrom);
+  /// Calls onMovedOut or onMovedIn for each half whose partner doesn't turn
+  /// up in time
+  void expireLater();
+
+public:
+  MovePairer(OnMoved onMoved, OnAlone onMovedOut, OnAlone onMovedIn)
+      : onMoved(std::move(onMoved)), onMovedOut(std::move(onMovedOut)),
+        onMovedIn(std::move(onMovedIn)) {}
+  /// An IN_MOVED_FROM. If its partner doesn't turn up, 'from' was moved out
+  /// of our directories
+  void movedFrom(yield_context yield, std::uint32_t cookie, MoveHalf from);
+  /// An IN_MOVED_TO. If its partner doesn't turn up, 'to' was moved in from
+  /// somewhere we don't watch
+  void movedTo(yield_context yield, std::uint32_t cookie, MoveHalf to);
+  /// True if we're not holding on to any halves, or handling them
+  bool idle() const { return pending.empty() && !timing; }
+};
+
+} /* processes */
+} /* cdnalizerd  */
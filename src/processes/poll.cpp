@@ -0,0 +1,443 @@
+#include "poll.hpp"
+
+#include "../BlockingPool.hpp"
+#include "../DirectoryTree.hpp"
+#include "../logging.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cdnalizerd {
+namespace processes {
+
+namespace {
+
+/// How often we poll a directory that's just had something change in it.
+/// It's also how often we look for directories that are due
+constexpr std::time_t minInterval = 5;
+/// How often we poll a directory that's been quiet a long time
+constexpr std::time_t maxInterval = 5 * 60;
+/// Files modified more recently than this may still be being written; we
+/// wait for them to settle before reporting them
+constexpr std::time_t settleTime = 2;
+
+std::int64_t nanoseconds(const timespec &time) {
+  return std::int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+std::string join(const std::string &directory, boost::string_view name) {
+  std::string result(directory);
+  if (result.empty() || (result.back() != '/'))
+    result.push_back('/');
+  result.append(name.data(), name.size());
+  return result;
+}
+
+/// A name in a directory listing, and whether it's a directory
+using Name = std::pair<std::string, bool>;
+
+/// Lists the files in 'path', and the directories 'entry' doesn't ignore,
+/// sorted by name. Returns false if it can't be read
+bool list(const ConfigEntry &entry, const std::string &path,
+          std::vector<Name> &result) {
+  DIR *directory = opendir(path.c_str());
+  if (directory == nullptr)
+    return false;
+  while (const dirent *found = readdir(directory)) {
+    const char *name = found->d_name;
+    if ((std::strcmp(name, ".") == 0) || (std::strcmp(name, "..") == 0))
+      continue;
+    unsigned char type = found->d_type;
+    std::string child(join(path, name));
+    if (type == DT_UNKNOWN) {
+      // Not every file system fills it in
+      struct stat info;
+      if (lstat(child.c_str(), &info) == -1)
+        continue;
+      type = S_ISDIR(info.st_mode) ? DT_DIR
+                                   : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+    }
+    if (type == DT_REG)
+      result.emplace_back(name, false);
+    else if ((type == DT_DIR) && !entry.shouldIgnoreDirectory(child))
+      result.emplace_back(name, true);
+  }
+  closedir(directory);
+  std::sort(result.begin(), result.end());
+  return true;
+}
+
+} /* anonymous namespace */
+
+struct Poller::State {
+  /// Something in a directory
+  struct Item {
+    // Nanoseconds. -1 for a file we haven't reported yet
+    std::int64_t modified;
+    std::uint64_t size : 63;
+    std::uint64_t isDir : 1;
+  };
+  struct Directory {
+    // The directory's own times, when we last listed it. -1 to list it again
+    std::int64_t modified = -1;
+    std::int64_t changed = -1;
+    // What's in it, sorted, each name followed by a '\0'. 'items' are in the
+    // same order
+    std::string names;
+    std::vector<Item> items;
+    std::time_t interval = minInterval;
+    std::time_t due = 0;
+  };
+  struct Changes {
+    std::vector<std::string> changed;
+    std::vector<std::pair<std::string, bool>> removed;
+  };
+
+  const ConfigEntry *entry;
+  // An equal entry in a reloaded config, that we switch to between rounds,
+  // and what keeps the old one there until we have
+  const ConfigEntry *next = nullptr;
+  std::shared_ptr<const void> held;
+  asio::deadline_timer timer;
+  bool stopped = false;
+  // Only used by one thread at a time: the blocking pool's while we poll,
+  // otherwise ours
+  DirectoryTree tree;
+  std::unordered_map<DirectoryTree::Node, Directory> directories;
+  DirectoryTree::Node root;
+
+  explicit State(const ConfigEntry &entry)
+      : entry(&entry), timer(service()), root(tree.add(entry.local_dir)) {
+    directories[root];
+  }
+
+  /// Polls every directory that's due. If 'report' isn't set, we're just
+  /// taking the first look
+  Changes poll(std::time_t now, bool report);
+  /// Polls one directory. Directories found in it go on 'work'
+  void visit(DirectoryTree::Node node, std::time_t now, bool report,
+             Changes &changes, std::vector<DirectoryTree::Node> &work);
+  /// Compares a new listing of 'directory' with the old one. Returns true if
+  /// anything changed
+  bool relist(Directory &directory, const std::string &path,
+              const std::vector<Name> &names, std::time_t now, bool report,
+              Changes &changes, std::vector<DirectoryTree::Node> &work);
+  /// Stats the files in 'directory'. Returns true if anything changed
+  bool restat(Directory &directory, const std::string &path, std::time_t now,
+              bool report, Changes &changes);
+  /// Stats a file into 'item'. Returns true if it's changed since 'item'
+  /// was last filled in, and it's settled. Sets 'gone' if it's not there
+  bool stat(const std::string &path, Item &item, std::time_t now, bool report,
+            bool &gone);
+  /// Forgets a directory and everything under it
+  void forget(DirectoryTree::Node node);
+  /// Everything we know about
+  void fill(LocalTree &out) const;
+};
+
+Poller::State::Changes Poller::State::poll(std::time_t now, bool report) {
+  Changes changes;
+  std::vector<DirectoryTree::Node> work;
+  for (const auto &directory : directories)
+    if (directory.second.due <= now)
+      work.push_back(directory.first);
+  while (!work.empty()) {
+    DirectoryTree::Node node = work.back();
+    work.pop_back();
+    visit(node, now, report, changes, work);
+  }
+  return changes;
+}
+
+void Poller::State::visit(DirectoryTree::Node node, std::time_t now,
+                          bool report, Changes &changes,
+                          std::vector<DirectoryTree::Node> &work) {
+  auto found = directories.find(node);
+  // Forgotten, or already done, earlier in this poll
+  if ((found == directories.end()) || (found->second.due > now))
+    return;
+  Directory &directory = found->second;
+  directory.due = now + directory.interval;
+  std::string path(tree.path(node));
+  struct stat info;
+  if ((lstat(path.c_str(), &info) == -1) || !S_ISDIR(info.st_mode)) {
+    if (node == root) {
+      LOG_S(WARNING) << "Can't poll " << path << ": " << std::strerror(errno);
+      return;
+    }
+    // Its parent's listing will tell us it's gone
+    std::size_t slash = path.rfind('/');
+    DirectoryTree::Node parent = tree.find(path.substr(0, slash));
+    auto up = directories.find(parent);
+    if (up != directories.end()) {
+      up->second.modified = -1;
+      up->second.due = 0;
+      work.push_back(parent);
+    }
+    return;
+  }
+  std::int64_t modified = nanoseconds(info.st_mtim);
+  std::int64_t changed = nanoseconds(info.st_ctim);
+  bool active;
+  if ((modified != directory.modified) || (changed != directory.changed)) {
+    std::vector<Name> names;
+    if (!list(*entry, path, names))
+      return;
+    directory.modified = modified;
+    directory.changed = changed;
+    active = relist(directory, path, names, now, report, changes, work);
+  } else
+    active = restat(directory, path, now, report, changes);
+  directory.interval =
+      active ? minInterval : std::min(directory.interval * 2, maxInterval);
+  directory.due = now + directory.interval;
+}
+
+bool Poller::State::relist(Directory &directory, const std::string &path,
+                           const std::vector<Name> &names, std::time_t now,
+                           bool report, Changes &changes,
+                           std::vector<DirectoryTree::Node> &work) {
+  bool active = false;
+  std::string newNames;
+  std::vector<Item> newItems;
+  newItems.reserve(names.size());
+  // Walk the old listing and the new one together; they're both sorted
+  std::size_t offset = 0;
+  std::size_t old = 0;
+  std::size_t next = 0;
+  while ((old != directory.items.size()) || (next != names.size())) {
+    boost::string_view oldName;
+    if (old != directory.items.size())
+      oldName = directory.names.c_str() + offset;
+    int order;
+    if (old == directory.items.size())
+      order = 1;
+    else if (next == names.size())
+      order = -1;
+    else
+      order = oldName.compare(names[next].first);
+    // A file replaced by a directory, or the other way round, is a removal
+    // and an addition
+    bool replaced = (order == 0) &&
+                    (bool(directory.items[old].isDir) != names[next].second);
+    if ((order < 0) || replaced) {
+      std::string child(join(path, oldName));
+      bool isDir = directory.items[old].isDir;
+      if (isDir)
+        forget(tree.find(child));
+      if (report)
+        changes.removed.emplace_back(std::move(child), isDir);
+      active = true;
+      offset += oldName.size() + 1;
+      ++old;
+      if (!replaced)
+        continue;
+    }
+    if ((order > 0) || replaced) {
+      const Name &name = names[next++];
+      std::string child(join(path, name.first));
+      Item item{-1, 0, name.second};
+      if (name.second) {
+        DirectoryTree::Node node = tree.find(child);
+        if (node == DirectoryTree::none)
+          node = tree.add(child);
+        // Listed when we get to it, so everything in it turns up as new
+        directories[node];
+        work.push_back(node);
+      } else {
+        bool gone = false;
+        if (stat(child, item, now, report, gone) && report)
+          changes.changed.push_back(child);
+        if (gone)
+          continue;
+      }
+      active = true;
+      newNames.append(name.first).push_back('\0');
+      newItems.push_back(item);
+      continue;
+    }
+    // In both
+    Item item(directory.items[old]);
+    offset += oldName.size() + 1;
+    ++old;
+    const Name &name = names[next++];
+    if (!item.isDir) {
+      std::string child(join(path, name.first));
+      bool gone = false;
+      if (stat(child, item, now, report, gone)) {
+        if (report)
+          changes.changed.push_back(child);
+        active = true;
+      } else if (item.modified == -1)
+        // Still settling
+        active = true;
+      if (gone) {
+        if (report)
+          changes.removed.emplace_back(std::move(child), false);
+        active = true;
+        continue;
+      }
+    }
+    newNames.append(name.first).push_back('\0');
+    newItems.push_back(item);
+  }
+  directory.names.swap(newNames);
+  directory.items.swap(newItems);
+  return active;
+}
+
+bool Poller::State::restat(Directory &directory, const std::string &path,
+                           std::time_t now, bool report, Changes &changes) {
+  // Nothing's been added or removed, or the directory's times would have
+  // moved on; a file that's gone since will be found next time
+  bool active = false;
+  const char *name = directory.names.c_str();
+  for (Item &item : directory.items) {
+    boost::string_view current(name);
+    name += current.size() + 1;
+    if (item.isDir)
+      continue;
+    std::string child(join(path, current));
+    bool gone = false;
+    if (stat(child, item, now, report, gone)) {
+      if (report)
+        changes.changed.push_back(std::move(child));
+      active = true;
+    } else if (item.modified == -1)
+      // Still settling
+      active = true;
+  }
+  return active;
+}
+
+bool Poller::State::stat(const std::string &path, Item &item,
+                         std::time_t now, bool report, bool &gone) {
+  struct stat info;
+  if (lstat(path.c_str(), &info) == -1) {
+    gone = (errno == ENOENT);
+    return false;
+  }
+  std::int64_t modified = nanoseconds(info.st_mtim);
+  if ((modified == item.modified) && (std::uint64_t(info.st_size) == item.size))
+    return false;
+  item.size = info.st_size;
+  if (report && (info.st_mtim.tv_sec > now - settleTime)) {
+    // Look again next time
+    item.modified = -1;
+    return false;
+  }
+  item.modified = modified;
+  return true;
+}
+
+void Poller::State::forget(DirectoryTree::Node node) {
+  if (node == DirectoryTree::none)
+    return;
+  std::vector<DirectoryTree::Node> under;
+  for (const auto &directory : directories)
+    if (tree.contains(node, directory.first))
+      under.push_back(directory.first);
+  for (DirectoryTree::Node gone : under) {
+    directories.erase(gone);
+    tree.remove(gone);
+  }
+}
+
+void Poller::State::fill(LocalTree &out) const {
+  for (const auto &directory : directories) {
+    std::string path(tree.path(directory.first));
+    const char *name = directory.second.names.c_str();
+    for (const Item &item : directory.second.items) {
+      boost::string_view current(name);
+      name += current.size() + 1;
+      if (!item.isDir) {
+        WalkedFile file;
+        file.path = join(path, current);
+        file.size = item.size;
+        file.modified = item.modified / 1000000000;
+        out.files.push_back(std::move(file));
+      }
+    }
+    out.directories.push_back(std::move(path));
+  }
+}
+
+Poller::Poller(yield_context yield, const ConfigEntry &entry, LocalTree *tree)
+    : state(std::make_shared<State>(entry)) {
+  LOG_S(INFO) << "Taking a first look at " << entry.local_dir
+              << " to poll it" << std::endl;
+  std::shared_ptr<State> state(this->state);
+  runBlocking(yield, [state]() { state->poll(std::time(nullptr), false); });
+  LOG_S(1) << "Polling " << state->directories.size() << " directories under "
+           << entry.local_dir;
+  if (tree)
+    runBlocking(yield, [state, tree]() { state->fill(*tree); });
+}
+
+Poller::~Poller() {
+  state->stopped = true;
+  state->timer.cancel();
+}
+
+void Poller::follow(const ConfigEntry &entry,
+                    std::shared_ptr<const void> held) {
+  state->next = &entry;
+  state->held = std::move(held);
+}
+
+void Poller::start(OnChanged onChanged, OnRemoved onRemoved) {
+  asio::spawn(service(), [state = this->state, onChanged,
+                          onRemoved](yield_context yield) {
+    while (true) {
+      state->timer.expires_from_now(boost::posix_time::seconds(minInterval));
+      boost::system::error_code ec;
+      state->timer.async_wait(yield[ec]);
+      if (state->stopped)
+        return;
+      if (state->next) {
+        state->entry = state->next;
+        state->next = nullptr;
+        state->held.reset();
+      }
+      try {
+        State::Changes changes(runBlocking(yield, [&state]() {
+          return state->poll(std::time(nullptr), true);
+        }));
+        if (state->stopped)
+          return;
+        if (!changes.changed.empty() || !changes.removed.empty())
+          LOG_S(5) << "Polling " << state->entry->local_dir << " found "
+                   << changes.changed.size() << " changed and "
+                   << changes.removed.size() << " removed";
+        for (const auto &removed : changes.removed)
+          onRemoved(*state->entry, removed.first, removed.second);
+        for (const std::string &changed : changes.changed) {
+          onChanged(yield, *state->entry, changed);
+          // We may have been stopped while it waited
+          if (state->stopped)
+            return;
+        }
+      } catch (std::exception &e) {
+        LOG_S(ERROR) << "Polling " << state->entry->local_dir
+                     << " failed: " << boost::diagnostic_information(e, true);
+      }
+    }
+  });
+}
+
+} /* processes */
+} /* cdnalizerd  */
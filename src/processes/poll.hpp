@@ -0,0 +1,61 @@
+#pragma once
+/// Finds changes by looking for them, for file systems where the kernel
+/// can't tell us about them all: on NFS and GlusterFS mounts, changes made by
+/// other clients never make inotify or fanotify events. Config entries with
+/// 'poll' set are watched this way instead.
+///
+/// We keep a compact snapshot of each directory: its own mtime and ctime, and
+/// the names, sizes and mtimes of what's in it. A directory is only listed
+/// again when its mtime or ctime has moved on (something in it was made,
+/// removed or renamed); otherwise we just stat its files, for changes to
+/// their contents. Each directory is polled on its own schedule: straight
+/// after something changes in it, every few seconds, backing off to every
+/// few minutes while nothing does, so the quiet parts of big trees cost
+/// little.
+
+#include "../DirectoryWalker.hpp"
+#include "../common.hpp"
+#include "../config/config.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace cdnalizerd {
+namespace processes {
+
+class Poller {
+public:
+  /// A file under 'entry' is new, or has changed. 'yield' is the polling
+  /// coroutine's, which it may suspend
+  using OnChanged = std::function<void(
+      yield_context yield, const ConfigEntry &entry, const std::string &path)>;
+  /// A file or directory under 'entry' has gone
+  using OnRemoved = std::function<void(const ConfigEntry &entry,
+                                       const std::string &path, bool isDir)>;
+
+private:
+  struct State;
+  // Shared with the polling coroutine, which may outlive us for a while
+  std::shared_ptr<State> state;
+
+public:
+  /// Takes the first look at 'entry', suspending the coroutine while it does.
+  /// If 'tree' is given, what we found goes in it, with the files stat'ed
+  Poller(yield_context yield, const ConfigEntry &entry,
+         LocalTree *tree = nullptr);
+  Poller(const Poller &) = delete;
+  /// Stops polling
+  ~Poller();
+  /// Starts polling, in a coroutine of its own. Changes since the first look
+  /// are reported through 'onChanged' and 'onRemoved'
+  void start(OnChanged onChanged, OnRemoved onRemoved);
+  /// The config has been reloaded, and 'entry' is our entry's equal in it. We
+  /// switch to it before our next round, and hold on to 'held' until we have
+  void follow(const ConfigEntry &entry, std::shared_ptr<const void> held);
+  /// Lasts as long as the polling coroutine, which can outlive us a while
+  std::weak_ptr<const void> lifetime() const { return state; }
+};
+
+} /* processes */
+} /* cdnalizerd  */
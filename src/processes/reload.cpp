@@ -0,0 +1,149 @@
+#include "reload.hpp"
+
+#include "../config/config_reader.hpp"
+#include "../inotify.hpp"
+#include "../logging.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+
+#include <sys/inotify.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+namespace cdnalizerd {
+namespace processes {
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+/// How long the config has to be left alone before we read it
+const boost::posix_time::seconds settleTime(1);
+
+} /* anonymous namespace */
+
+struct ReloadTrigger::State {
+  OnReload onReload;
+  asio::signal_set signals;
+  asio::posix::stream_descriptor stream;
+  asio::deadline_timer settle;
+  std::vector<char> buffer;
+  // If set, only changes to this name count; otherwise any config file does
+  std::string name;
+  bool stopped = false;
+
+  explicit State(OnReload onReload)
+      : onReload(std::move(onReload)), signals(service(), SIGHUP),
+        stream(service()), settle(service()), buffer(4096) {
+    settle.expires_at(boost::posix_time::pos_infin);
+  }
+
+  /// Watches the directory the config is in (for a file, so it's still
+  /// watched after an editor replaces it). Returns false if we can't
+  bool watch(const std::string &path) {
+    fs::path watched(path);
+    boost::system::error_code ec;
+    if (!fs::is_directory(watched, ec)) {
+      name = watched.filename().native();
+      watched = watched.parent_path();
+      if (watched.empty())
+        watched = ".";
+    }
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+      LOG_S(WARNING) << "Can't watch the config for changes: "
+                     << std::strerror(errno);
+      return false;
+    }
+    stream.assign(fd);
+    if (inotify_add_watch(fd, watched.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                              IN_CREATE | IN_DELETE) == -1) {
+      LOG_S(WARNING) << "Can't watch " << watched.native()
+                     << " for config changes: " << std::strerror(errno);
+      return false;
+    }
+    LOG_S(INFO) << "Reloading the config when " << path << " changes";
+    return true;
+  }
+
+  /// Whether an event in the watched directory is about the config
+  bool relevant(const inotify_event &event) const {
+    if (event.mask & IN_Q_OVERFLOW)
+      return true;
+    if (event.len == 0)
+      return false;
+    const char *changed = event.name;
+    return name.empty() ? isConfigFile(changed) : (name == changed);
+  }
+};
+
+ReloadTrigger::ReloadTrigger(const std::string &path, OnReload onReload)
+    : state(std::make_shared<State>(std::move(onReload))) {
+  asio::spawn(service(), [state = this->state](yield_context yield) {
+    while (true) {
+      boost::system::error_code ec;
+      state->signals.async_wait(yield[ec]);
+      if (state->stopped || (ec == asio::error::operation_aborted))
+        return;
+      LOG_S(INFO) << "Got SIGHUP. Reloading the config";
+      state->onReload();
+    }
+  });
+  if (!state->watch(path))
+    return;
+  asio::spawn(service(), [state = this->state](yield_context yield) {
+    while (true) {
+      boost::system::error_code ec;
+      std::size_t size = state->stream.async_read_some(
+          asio::buffer(state->buffer), yield[ec]);
+      if (state->stopped)
+        return;
+      if (ec) {
+        LOG_S(WARNING) << "Stopped watching the config for changes: "
+                       << ec.message();
+        return;
+      }
+      bool changed = false;
+      inotify::forEachEvent(state->buffer.data(), size,
+                            [&](const inotify_event &event) {
+                              changed = changed || state->relevant(event);
+                            });
+      if (changed) {
+        LOG_S(5) << "The config changed. Reading it once it settles";
+        state->settle.expires_from_now(settleTime);
+      }
+    }
+  });
+  asio::spawn(service(), [state = this->state](yield_context yield) {
+    while (true) {
+      boost::system::error_code ec;
+      state->settle.async_wait(yield[ec]);
+      if (state->stopped)
+        return;
+      // Put off again by another change
+      if (ec || (state->settle.expires_at() >
+                 asio::deadline_timer::traits_type::now()))
+        continue;
+      state->settle.expires_at(boost::posix_time::pos_infin);
+      state->onReload();
+    }
+  });
+}
+
+ReloadTrigger::~ReloadTrigger() {
+  state->stopped = true;
+  boost::system::error_code ec;
+  state->signals.cancel(ec);
+  state->stream.cancel(ec);
+  state->settle.cancel();
+}
+
+} /* processes */
+} /* cdnalizerd */
@@ -0,0 +1,36 @@
+#pragma once
+/// Tells us when to read the config again: straight away on a SIGHUP, and a
+/// second after the config file (or a config file in the config directory)
+/// last changed, so the several writes of an editor or a deploy make one
+/// reload.
+
+#include "../common.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace cdnalizerd {
+namespace processes {
+
+class ReloadTrigger {
+public:
+  using OnReload = std::function<void()>;
+
+private:
+  struct State;
+  // Shared with the handlers waiting on the signal and the file watch, which
+  // may outlive us for a while
+  std::shared_ptr<State> state;
+
+public:
+  /// Starts watching 'path', the config file or directory. If it can't be
+  /// watched, it's only SIGHUP
+  ReloadTrigger(const std::string &path, OnReload onReload);
+  ReloadTrigger(const ReloadTrigger &) = delete;
+  /// Stops watching
+  ~ReloadTrigger();
+};
+
+} /* processes */
+} /* cdnalizerd */
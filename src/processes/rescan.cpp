@@ -0,0 +1,269 @@
+#include "rescan.hpp"
+
+#include "syncAllDirectories.hpp"
+#include "../BlockingPool.hpp"
+#include "../jobs/upload.hpp"
+#include "../logging.hpp"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+
+namespace cdnalizerd {
+namespace processes {
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+/// How long a directory's activity counts as recent
+constexpr std::time_t recentWindow = 5 * 60;
+/// How many recent directories we remember per config entry
+constexpr std::size_t maxRecent = 4096;
+/// The least time between rescans of one config entry's recent directories
+constexpr std::time_t minRescanInterval = 10;
+/// The least time between full syncs of one config entry
+constexpr std::time_t minFullSyncInterval = 5 * 60;
+
+/// Sleeps for 'seconds', if there are any
+void sleepFor(yield_context yield, std::time_t seconds) {
+  if (seconds <= 0)
+    return;
+  boost::asio::deadline_timer timer(service(),
+                                    boost::posix_time::seconds(seconds));
+  boost::system::error_code ec;
+  timer.async_wait(yield[ec]);
+}
+
+struct RecentChanges {
+  std::vector<fs::path> files;
+  std::vector<std::string> directories;
+};
+
+/// Finds the files and directories directly in 'directories' that have
+/// changed since 'since'. Directories 'entry' ignores are passed over without
+/// a look. Runs on the blocking pool
+RecentChanges findRecentChanges(const ConfigEntry &entry,
+                                const std::vector<std::string> &directories,
+                                std::time_t since) {
+  RecentChanges result;
+  for (const std::string &directory : directories) {
+    boost::system::error_code ec;
+    for (fs::directory_iterator d(directory, ec), end; !ec && (d != end);
+         d.increment(ec)) {
+      fs::file_status status(d->status(ec));
+      if (ec || (fs::is_directory(status) &&
+                 entry.shouldIgnoreDirectory(d->path().native())))
+        continue;
+      std::time_t modified = fs::last_write_time(d->path(), ec);
+      if (ec || (modified < since))
+        continue;
+      if (fs::is_directory(status))
+        result.directories.push_back(d->path().native());
+      else if (fs::is_regular_file(status))
+        result.files.push_back(d->path());
+    }
+  }
+  return result;
+}
+
+} /* anonymous namespace */
+
+void Rescanner::activity(const ConfigEntry &entry, const std::string &path) {
+  std::size_t slash = path.rfind('/');
+  if (slash == std::string::npos)
+    return;
+  EntryState &es = state->entries[&entry];
+  std::time_t now = std::time(nullptr);
+  if ((now == es.lastTime) &&
+      (es.lastDirectory.compare(0, std::string::npos, path, 0, slash) == 0))
+    return;
+  es.lastDirectory.assign(path, 0, slash);
+  es.lastTime = now;
+  es.recent[es.lastDirectory] = now;
+  if (es.recent.size() > maxRecent) {
+    for (auto i = es.recent.begin(); i != es.recent.end();)
+      if (i->second < now - recentWindow)
+        i = es.recent.erase(i);
+      else
+        ++i;
+    // Activity is too spread out to be worth targeting; the full sync will
+    // find it
+    if (es.recent.size() > maxRecent)
+      es.recent.clear();
+  }
+}
+
+void Rescanner::overflowed(const std::vector<const ConfigEntry *> &entries) {
+  for (const ConfigEntry *entry : entries) {
+    rescanRecent(state, *entry);
+    scheduleFullSync(state, *entry);
+  }
+}
+
+void Rescanner::rescanRecent(std::shared_ptr<State> state,
+                             const ConfigEntry &entry) {
+  // Map entries stay put, and the coroutine keeps the map alive
+  EntryState &es = state->entries[&entry];
+  if (es.rescanWaiting)
+    // This overflow is covered by the rescan that's waiting
+    return;
+  if (es.rescanRunning) {
+    // It may have already passed the directories this overflow hit
+    es.rescanAgain = true;
+    return;
+  }
+  es.rescanWaiting = true;
+  std::time_t wait = std::max<std::time_t>(
+      0, es.lastRescan + minRescanInterval - std::time(nullptr));
+  asio::spawn(service(), [state, &entry, &es, wait](yield_context yield) {
+    sleepFor(yield, wait);
+    es.rescanWaiting = false;
+    if (state->stopped)
+      return;
+    es.rescanRunning = true;
+    es.lastRescan = std::time(nullptr);
+    // Look at what's recent now, so overflows merged into this one are covered
+    std::time_t since = es.lastRescan - recentWindow;
+    std::vector<std::string> directories;
+    for (const auto &recent : es.recent)
+      if (recent.second >= since)
+        directories.push_back(recent.first);
+    if (!directories.empty()) {
+      LOG_S(INFO) << "Rescanning " << directories.size()
+                  << " recently active directories under " << entry.local_dir;
+      try {
+        RecentChanges changes(
+            runBlocking(yield, [&entry, &directories, since]() {
+              return findRecentChanges(entry, directories, since);
+            }));
+        if (!state->stopped) {
+          // New directories may have been created while we weren't listening
+          for (const std::string &directory : changes.directories)
+            scanNewDirectory(state, entry, directory, true);
+          if (!changes.files.empty()) {
+            const Rackspace &rs = state->accounts.at(entry.username);
+            URL url(rs.getURL(entry.region, entry.snet));
+            auto worker = state->workers.getWorker(url.whole(), rs);
+            for (const fs::path &file : changes.files) {
+              if (entry.shouldIgnoreFile(file.native()))
+                continue;
+              LOG_S(9) << "Making upload job after overflow: "
+                       << file.native();
+              // Conditional, so we don't upload files that haven't really
+              // changed
+              worker->addJob(jobs::makeConditionalUploadJob(
+                  file, url / entry.container / entry.remote_dir /
+                            file.lexically_relative(entry.local_dir)
+                                .string()));
+            }
+          }
+        }
+      } catch (std::exception &e) {
+        LOG_S(ERROR) << "Rescanning recent directories failed: "
+                     << boost::diagnostic_information(e, true);
+      }
+    }
+    es.rescanRunning = false;
+    if (es.rescanAgain && !state->stopped) {
+      es.rescanAgain = false;
+      rescanRecent(state, entry);
+    }
+  });
+}
+
+void Rescanner::newDirectory(const ConfigEntry &entry, const std::string &path,
+                             bool moved) {
+  scanNewDirectory(state, entry, path, moved);
+}
+
+void Rescanner::scanNewDirectory(std::shared_ptr<State> state,
+                                 const ConfigEntry &entry,
+                                 const std::string &path, bool moved) {
+  ++state->newDirectoryScans;
+  asio::spawn(service(), [state, &entry, path, moved](yield_context yield) {
+    try {
+      LocalTree found(
+          state->watcher.directoryCreated(yield, entry, path, moved));
+      if (!state->stopped && !found.files.empty()) {
+        LOG_S(5) << "Found " << found.files.size()
+                 << " files already in new directory " << path;
+        const Rackspace &rs = state->accounts.at(entry.username);
+        URL url(rs.getURL(entry.region, entry.snet));
+        auto worker = state->workers.getWorker(url.whole(), rs);
+        for (const WalkedFile &file : found.files) {
+          // Empty ones too: a file being written will send us an event when
+          // it's done, but one that was empty all along (or moved in) won't
+          if (entry.shouldIgnoreFile(file.path) ||
+              !state->queued.emplace(&entry, file.path).second)
+            continue;
+          LOG_S(9) << "Making upload job for new directory: " << file.path;
+          worker->addJob(jobs::makeConditionalUploadJob(
+              file.path,
+              url / entry.container / entry.remote_dir /
+                  fs::path(file.path).lexically_relative(entry.local_dir)
+                      .string()));
+        }
+      }
+    } catch (std::exception &e) {
+      LOG_S(ERROR) << "Catching up on new directory " << path
+                   << " failed: " << boost::diagnostic_information(e, true);
+    }
+    if (--state->newDirectoryScans == 0)
+      state->queued.clear();
+  });
+}
+
+void Rescanner::uploading(const ConfigEntry &entry, const std::string &path) {
+  if (state->newDirectoryScans != 0)
+    state->queued.emplace(&entry, path);
+}
+
+void Rescanner::scheduleFullSync(std::shared_ptr<State> state,
+                                 const ConfigEntry &entry) {
+  EntryState &es = state->entries[&entry];
+  if (es.fullSyncWaiting)
+    // This overflow is covered by the one that's waiting
+    return;
+  if (es.fullSyncRunning) {
+    // It may have already passed the files this overflow lost
+    es.fullSyncAgain = true;
+    return;
+  }
+  es.fullSyncWaiting = true;
+  // The sync we did at startup counts
+  std::time_t last = es.lastFullSync ? es.lastFullSync : state->started;
+  std::time_t wait =
+      std::max<std::time_t>(0, last + minFullSyncInterval - std::time(nullptr));
+  LOG_S(INFO) << "Syncing " << entry.local_dir << " again in " << wait
+              << " seconds, to find lost events";
+  asio::spawn(service(), [state, &entry, &es, wait](yield_context yield) {
+    sleepFor(yield, wait);
+    es.fullSyncWaiting = false;
+    if (state->stopped)
+      return;
+    es.fullSyncRunning = true;
+    es.lastFullSync = std::time(nullptr);
+    try {
+      syncOneConfigEntry(yield, state->accounts.at(entry.username), entry,
+                         state->workers);
+    } catch (boost::exception &e) {
+      LOG_S(ERROR) << "Syncing after lost events failed: "
+                   << boost::diagnostic_information(e, true);
+    } catch (std::exception &e) {
+      LOG_S(ERROR) << "Syncing after lost events failed (std::exception): "
+                   << boost::diagnostic_information(e, true);
+    }
+    es.fullSyncRunning = false;
+    if (es.fullSyncAgain && !state->stopped) {
+      es.fullSyncAgain = false;
+      scheduleFullSync(state, entry);
+    }
+  });
+}
+
+} /* processes */
+} /* cdnalizerd  */
@@ -0,0 +1,107 @@
+#pragma once
+/// Catches up after the kernel's event queue overflows and we lose events.
+///
+/// Straight away, we look again at the directories that had events lately
+/// (that's where a storm is), and upload what's changed in them. Then each
+/// affected config entry gets a full sync against the server. Both are rate
+/// limited per config entry: overflows while one is waiting are merged into
+/// it, and one that comes while it's running makes it run once more after.
+/// Live events carry on being handled the whole time.
+///
+/// It also catches up on new directories: by the time we watch one, things
+/// may already have been made in it (mkdir -p, tar x), and we'd never hear
+/// about them.
+
+#include "../AccountCache.hpp"
+#include "../Watcher.hpp"
+#include "../WorkerManager.hpp"
+#include "../config/config.hpp"
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cdnalizerd {
+namespace processes {
+
+class Rescanner {
+private:
+  struct EntryState {
+    // Directories that had events lately, and when
+    std::unordered_map<std::string, std::time_t> recent;
+    // The last one we noted, so runs of events in one directory are cheap
+    std::string lastDirectory;
+    std::time_t lastTime = 0;
+    // When the last rescan of the recent directories started
+    std::time_t lastRescan = 0;
+    bool rescanWaiting = false;
+    bool rescanRunning = false;
+    // Another overflow happened while the rescan was running
+    bool rescanAgain = false;
+    // When the last full sync started
+    std::time_t lastFullSync = 0;
+    bool fullSyncWaiting = false;
+    bool fullSyncRunning = false;
+    // Another overflow happened while the full sync was running
+    bool fullSyncAgain = false;
+  };
+
+  /// Everything our coroutines use, so they can outlive us
+  struct State {
+    Watcher &watcher;
+    const AccountCache &accounts;
+    WorkerManager &workers;
+    std::map<const ConfigEntry *, EntryState> entries;
+    // We're made as the startup sync starts
+    std::time_t started = std::time(nullptr);
+    // How many new directories we're catching up on, and the files queued for
+    // upload while we were, so we don't queue them twice. By entry too, as
+    // entries with the same local_dir each upload their own copy
+    std::size_t newDirectoryScans = 0;
+    std::set<std::pair<const ConfigEntry *, std::string>> queued;
+    // We've been destroyed; coroutines stop at their next chance
+    bool stopped = false;
+    State(Watcher &watcher, const AccountCache &accounts,
+          WorkerManager &workers)
+        : watcher(watcher), accounts(accounts), workers(workers) {}
+  };
+  std::shared_ptr<State> state;
+
+  static void rescanRecent(std::shared_ptr<State> state,
+                           const ConfigEntry &entry);
+  static void scheduleFullSync(std::shared_ptr<State> state,
+                               const ConfigEntry &entry);
+  static void scanNewDirectory(std::shared_ptr<State> state,
+                               const ConfigEntry &entry,
+                               const std::string &path, bool moved);
+
+public:
+  Rescanner(Watcher &watcher, const AccountCache &accounts,
+            WorkerManager &workers)
+      : state(std::make_shared<State>(watcher, accounts, workers)) {}
+  Rescanner(const Rescanner &) = delete;
+  ~Rescanner() { state->stopped = true; }
+
+  /// Notes that something happened to 'path' (a file under 'entry')
+  void activity(const ConfigEntry &entry, const std::string &path);
+  /// Events for 'entries' have been lost
+  void overflowed(const std::vector<const ConfigEntry *> &entries);
+  /// A directory has turned up under 'entry', made there or 'moved' in.
+  /// Watches everything in it, and uploads the files that are already there
+  void newDirectory(const ConfigEntry &entry, const std::string &path,
+                    bool moved);
+  /// Notes that an event has queued an upload of 'path' for 'entry'
+  void uploading(const ConfigEntry &entry, const std::string &path);
+  /// True if there's no rescan, sync or catching up under way or waiting
+  bool idle() const { return state.use_count() == 1; }
+  /// Forgets 'entry', from a config that's been replaced. Only while idle
+  void forget(const ConfigEntry &entry) { state->entries.erase(&entry); }
+};
+
+} /* processes */
+} /* cdnalizerd  */
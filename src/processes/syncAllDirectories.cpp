@@ -1,16 +1,23 @@
 #include "syncAllDirectories.hpp"
 
 #include "../inotify.hpp"
+#include "../BlockingPool.hpp"
+#include "../DirectoryWalker.hpp"
+#include "../IOURing.hpp"
 #include "login.hpp"
 #include "list.hpp"
 #include "../Rackspace.hpp"
 #include "../jobs/upload.hpp"
+#include "../jobs/multiMD5.hpp"
+#include "../jobs/uringMD5.hpp"
 #include "../utils.hpp"
 #include "../logging.hpp"
 
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <sys/stat.h>
+
 #include <set>
 #include <iostream>
 
@@ -21,24 +28,93 @@ namespace processes {
 
 namespace fs = boost::filesystem;
 
+bool LiveChanges::handledByEvent(const std::string &path) const {
+  if (paths.empty())
+    return false;
+  // The path itself, then each directory it's in
+  std::string at(path);
+  while (!at.empty()) {
+    if (paths.count(at))
+      return true;
+    std::size_t slash = at.rfind('/');
+    if ((slash == std::string::npos) || (slash == 0))
+      break;
+    at.resize(slash);
+  }
+  return false;
+}
+
+/// What we need to know about a local file to decide whether to upload it
+struct LocalFile {
+  fs::path path;
+  boost::uintmax_t size;
+  std::time_t modified;
+  bool operator<(const LocalFile &other) const { return path < other.path; }
+};
+
+std::vector<LocalFile> localFilesFrom(LocalTree &tree) {
+  std::vector<LocalFile> result;
+  result.reserve(tree.files.size());
+  for (WalkedFile &file : tree.files)
+    result.push_back({std::move(file.path), file.size, file.modified});
+  // Nobody needs the tree after us
+  tree = LocalTree();
+  // The walk finds them in any order; but we want them to be alphabetical,
+  // like what the cloud files server returns
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+/// Gets the sizes and times of all the files at once, through io_uring
+void statLocalFiles(yield_context yield, IOURing &ring,
+                    std::vector<LocalFile> &files) {
+  std::vector<struct statx> stats(files.size());
+  std::vector<std::size_t> which;
+  std::vector<io_uring_sqe> ops;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    which.push_back(i);
+    ops.push_back(IOURing::statx(files[i].path.c_str(), &stats[i]));
+  }
+  std::vector<int> results(ring.run(yield, std::move(ops)));
+  for (std::size_t i = 0; i != which.size(); ++i) {
+    if (results[i] != 0)
+      continue;
+    LocalFile &file = files[which[i]];
+    file.size = stats[which[i]].stx_size;
+    file.modified = stats[which[i]].stx_mtime.tv_sec;
+  }
+}
+
 void syncOneConfigEntry(yield_context yield, const Rackspace &rs,
-                        const ConfigEntry &config, WorkerManager &workers) {
+                        const ConfigEntry &config, WorkerManager &workers,
+                        LocalTree *tree, const LiveChanges *live,
+                        RemoteListing *listing) {
   LOG_S(5) << "Syncing config entry: " << config.username << " - "
            << config.region << " - " << (config.snet ? "snet" : "no snet")
            << " - filesToIgnore.size(): " << config.filesToIgnore.size();
   URL baseURL(rs.getURL(config.region, config.snet));
-  HTTPS conn(yield, baseURL.host);
-  // Get iterators to our local files
-  std::vector<fs::path> localFiles(
-      fs::recursive_directory_iterator(config.local_dir),
-      fs::recursive_directory_iterator());
+  // Get all our local files, sorted, with their sizes and times. The watcher
+  // may have walked the tree already. With io_uring, the stats are all done
+  // at once after the walk
+  IOURing *ring = ioURing();
+  std::vector<LocalFile> localFiles;
+  if (tree)
+    localFiles = localFilesFrom(*tree);
+  else {
+    LocalTree walked(walkTree(
+        yield, config.local_dir,
+        [&config](const std::string &path) {
+          return config.shouldIgnoreDirectory(path);
+        },
+        nullptr, ring == nullptr));
+    localFiles = localFilesFrom(walked);
+    if (ring)
+      statLocalFiles(yield, *ring, localFiles);
+  }
   if (localFiles.size() == 0) {
     // There are no local files, so nothing to upload
     return;
   }
-  // We need to grab all the local files and sort them because the normal
-  // ordering is by inode number or something; but we want them to be
-  // alphabetical, like what the cloud files server returns
   // TODO: Don't fill a vector with potentially MBs of files.
   // Solution 1: Make a smart iterator that iterates one directory, sorts it, then digs down.
   //      Con 1: You might have to go very very deep, so you may have to
@@ -53,57 +129,76 @@ void syncOneConfigEntry(yield_context yield, const Rackspace &rs,
   //             I like this method (2) better though because it uses less in
   //             program resources
   //
-  std::sort(localFiles.begin(), localFiles.end());
   auto local_iterator = localFiles.begin();
   auto local_end = localFiles.end();
-  // Get files only in the remote path/prefix that we care about from the config
-  for (const auto &remoteList : detailedListContainer(yield, rs, config)) {
+  // Queues an upload, unless the config says to ignore the file, or a live
+  // event has already seen to it
+  auto upload = [&](const fs::path &localFile,
+                    const std::string &localRelativePath) {
+    URL url(baseURL);
+    auto worker = workers.getWorker(url.whole(), rs);
+    if (config.shouldIgnoreFile(localFile.native()))
+      LOG_S(1) << "Igonring file: " << localFile.native();
+    else if (live && live->handledByEvent(localFile.native()))
+      LOG_S(9) << "Leaving file to its events: " << localFile.native();
+    else {
+      LOG_S(5) << "Making upload job: " << localFile.native();
+      worker->addJob(jobs::makeUploadJob(
+          localFile,
+          url / config.container / config.remote_dir / localRelativePath));
+    }
+  };
+  // Files that are newer than on the server, but the same size. They may just
+  // have been touched, so we hash them all together at the end, and only
+  // upload the ones whose contents really changed
+  struct MaybeChanged {
+    std::string localRelativePath;
+    std::string remoteMD5;
+  };
+  std::vector<fs::path> toHash;
+  std::vector<MaybeChanged> maybeChanged;
+  // Walks 'remoteList' and our files together
+  auto compare = [&](const nlohmann::json &remoteList) {
     auto remote_iterator = remoteList.begin();
     auto remote_end = remoteList.end();
     while ((local_iterator != local_end) && (remote_iterator != remote_end)) {
-      // We don't do anything with directories
-      if (fs::is_directory(*local_iterator)) {
-        ++local_iterator;
-        continue;
-      }
       // Compare the remote_dir with local file minus the config
       const std::string &remotePath(remote_iterator->at("name"));
       std::string remoteRelativePath(
           unJoinPaths(config.remote_dir, remotePath));
       std::string localRelativePath(
-          "/"s + fs::relative(*local_iterator, config.local_dir).string());
+          "/"s +
+          local_iterator->path.lexically_relative(config.local_dir).string());
       int diff = localRelativePath.compare(remoteRelativePath);
-      auto upload = [&](){
-        URL url(baseURL);
-        auto worker = workers.getWorker(url.whole(), rs);
-        if (config.shouldIgnoreFile(local_iterator->native()))
-          LOG_S(1) << "Igonring file: " << local_iterator->native();
-        else {
-          LOG_S(5) << "Making upload job: " << local_iterator->native();
-          worker->addJob(jobs::makeUploadJob(
-              *local_iterator,
-              url / config.container / config.remote_dir / localRelativePath));
-        }
-      };
       if (diff == 0) {
         using namespace boost::posix_time;
         // The local and remote files are the same one
         // check the modification time
         // Check the files' modification time in UTC against the
         // remoteEntry.at("last_modified') and "bytes" (for the size)
-        ptime localTime(
-            from_time_t(fs::last_write_time(*local_iterator)));
+        ptime localTime(from_time_t(local_iterator->modified));
         std::string remote_raw = (*remote_iterator)["last_modified"];
         remote_raw[remote_raw.find('T')] = ' ';
         ptime remoteTime(time_from_string(remote_raw));
         // Both times come to us in UTC time zone
-        DLOG_S(9) << "Comparing file times for " << local_iterator->native()
+        DLOG_S(9) << "Comparing file times for "
+                  << local_iterator->path.native()
                   << " - local: " << localTime
                   << " - remote_raw: " << remote_raw
                   << " - remote: " << remoteTime;
         if (localTime > remoteTime) {
-          if (fs::file_size(*local_iterator) > 0)
-            upload();
+          auto size = local_iterator->size;
+          std::uint64_t remoteSize =
+              remote_iterator->at("bytes").get<std::uint64_t>();
+          if ((size > 0) && (size == remoteSize)) {
+            if (!config.shouldIgnoreFile(local_iterator->path.native())) {
+              toHash.push_back(local_iterator->path);
+              maybeChanged.push_back(
+                  {localRelativePath,
+                   remote_iterator->at("hash").get<std::string>()});
+            }
+          } else if (size > 0)
+            upload(local_iterator->path, localRelativePath);
           // TODO: If the cloud file has data, and but locally the file is now
           // empty, depending on the mode, should we delete the cloud version ?
         }
@@ -113,8 +208,8 @@ void syncOneConfigEntry(yield_context yield, const Rackspace &rs,
       } else if (diff < 0) {
         // The local file is less than the remote file
         // The local file doesn't exist on the server and should be uploaded
-        if (fs::file_size(*local_iterator) > 0)
-          upload();
+        if (local_iterator->size > 0)
+          upload(local_iterator->path, localRelativePath);
         // We need to get the next local file
         ++local_iterator;
       } else {
@@ -122,34 +217,53 @@ void syncOneConfigEntry(yield_context yield, const Rackspace &rs,
         ++remote_iterator;
       }
     }
-  }
+  };
+  // Get files only in the remote path/prefix that we care about from the
+  // config; it may already be on its way
+  if (listing) {
+    nlohmann::json remoteList;
+    while (listing->next(yield, remoteList))
+      compare(remoteList);
+  } else
+    for (const auto &remoteList : detailedListContainer(yield, rs, config))
+      compare(remoteList);
   // Upload any files left over
   while (local_iterator != local_end) {
     // The local file doesn't exist on the server and should be uploaded
-    URL url(baseURL);
-    auto worker = workers.getWorker(url.whole(), rs);
-    std::string localRelativePath(
-        fs::relative(*local_iterator, config.local_dir).string());
-    if (config.shouldIgnoreFile(local_iterator->native()))
-      LOG_S(1) << "Igonring file: " << local_iterator->native();
-    else {
-      LOG_S(5) << "Making upload job: " << local_iterator->native();
-      worker->addJob(jobs::makeUploadJob(
-          *local_iterator,
-          url / config.container / config.remote_dir / localRelativePath));
+    if (local_iterator->size > 0) {
+      std::string localRelativePath(
+          local_iterator->path.lexically_relative(config.local_dir).string());
+      upload(local_iterator->path, localRelativePath);
     }
     ++local_iterator;
   }
+  // Now check the files that may or may not have changed
+  if (!toHash.empty()) {
+    LOG_S(5) << "Hashing " << toHash.size()
+             << " files that are newer than on the server";
+    std::vector<std::string> localMD5s(
+        ring ? jobs::md5_from_files(yield, *ring, toHash)
+             : runBlocking(yield,
+                           [&toHash]() { return jobs::md5_from_files(toHash); }));
+    for (size_t i = 0; i != toHash.size(); ++i) {
+      if (localMD5s[i].empty())
+        // The file went away while we were looking at it
+        continue;
+      if (localMD5s[i] != maybeChanged[i].remoteMD5)
+        upload(toHash[i], maybeChanged[i].localRelativePath);
+      else
+        LOG_S(9) << "File is unchanged: " << toHash[i].native();
+    }
+  }
 }
 
+/// Counts down a sync that was counted as it was spawned (spawn can run it
+/// straight away), and wakes the waiter once they're all done
 struct CountSentry {
   size_t& count;
   boost::asio::deadline_timer& timer;
   CountSentry(size_t &count, boost::asio::deadline_timer &timer)
-      : count(count), timer(timer) {
-    ++count;
-    LOG_S(5) << "Incremented count: " << count << std::endl;
-  }
+      : count(count), timer(timer) {}
   ~CountSentry() {
     --count;
     LOG_S(5) << "Decremented count: " << count << std::endl;
@@ -161,24 +275,61 @@ struct CountSentry {
 };
 
 void syncAllDirectories(yield_context &yield, const AccountCache &accounts,
-                        const Config &config, WorkerManager& workers) {
-  // Sync all the entries in parallel, and block the main thread with a timer
-  // until they're all done
-  boost::asio::deadline_timer waitForSync(service(),
-                                          boost::posix_time::minutes(10));
+                        const Config &config, WorkerManager &workers,
+                        LocalTrees *trees, const LiveChanges *live,
+                        RemoteListings *listings) {
+  std::vector<const ConfigEntry *> entries;
+  for (const ConfigEntry &entry : config.entries())
+    entries.push_back(&entry);
+  syncConfigEntries(yield, accounts, entries, workers, trees, live, listings);
+}
+
+void syncConfigEntries(yield_context &yield, const AccountCache &accounts,
+                       const std::vector<const ConfigEntry *> &entries,
+                       WorkerManager &workers, LocalTrees *trees,
+                       const LiveChanges *live, RemoteListings *listings) {
+  // Sync all the entries in parallel, and block this coroutine with a timer
+  // until they're all done. Events are handled meanwhile, so there's no limit
+  // on how long that takes
+  boost::asio::deadline_timer waitForSync(service());
+  waitForSync.expires_at(boost::posix_time::pos_infin);
   size_t syncWorkers(0);
-  for (const ConfigEntry &entry : config.entries()) {
+  for (const ConfigEntry *entryPtr : entries) {
+    const ConfigEntry &entry = *entryPtr;
+    auto account = accounts.find(entry.username);
+    if (account == accounts.end()) {
+      LOG_S(ERROR) << "Not syncing " << entry.local_dir << " as "
+                   << entry.username << " isn't logged in";
+      continue;
+    }
+    LocalTree *tree = nullptr;
+    if (trees) {
+      auto found = trees->find(&entry);
+      if (found != trees->end())
+        tree = &found->second;
+    }
+    RemoteListing *listing = nullptr;
+    if (listings) {
+      auto found = listings->find(&entry);
+      if (found != listings->end())
+        listing = &found->second;
+    }
     // Make a list of file information
+    ++syncWorkers;
+    LOG_S(5) << "Incremented count: " << syncWorkers << std::endl;
     asio::spawn(service(), [
-                               &rs = accounts.at(entry.username), &entry,
-                               &workers, &syncWorkers, &waitForSync
+                               &rs = account->second, &entry, &workers,
+                               &syncWorkers, &waitForSync, tree, live, listing
     ](yield_context y) {
       LOG_S(5) << "Syncing config: " << entry.username << std::endl;
       CountSentry sentry(syncWorkers, waitForSync);
-      syncOneConfigEntry(y, rs, entry, workers);
+      syncOneConfigEntry(y, rs, entry, workers, tree, live, listing);
       LOG_S(5) << "Done Syncing config: " << entry.username << std::endl;
     });
   }
+  if (syncWorkers == 0)
+    // There were none, or they're already done
+    return;
 
   // Wait for all the logins to finish
   try {
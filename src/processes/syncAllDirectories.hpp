@@ -2,13 +2,89 @@
 
 #include "../config/config.hpp"
 #include "../AccountCache.hpp"
+#include "../DirectoryWalker.hpp"
 #include "../WorkerManager.hpp"
+#include "list.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
 namespace cdnalizerd {
 namespace processes {
 
+/// The paths that live events have dealt with while a sync runs (the startup
+/// one, or one for entries a config reload added). Events are handled from
+/// the start, so the sync leaves these (and anything under them) to them;
+/// what it saw of them may be out of date by the time it gets there
+class LiveChanges {
+private:
+  std::unordered_set<std::string> paths;
+  // The startup sync is running from the start
+  std::size_t syncing = 1;
+
+public:
+  /// Notes that an event has dealt with 'path'
+  void noteEvent(const std::string &path) {
+    if (syncing != 0)
+      paths.insert(path);
+  }
+  /// True if an event has dealt with 'path', or a directory it's in
+  bool handledByEvent(const std::string &path) const;
+  /// Another sync is starting
+  void syncStarted() { ++syncing; }
+  /// A sync is over; once they all are, there's nothing more to note
+  void syncDone() {
+    if (--syncing == 0)
+      paths = {};
+  }
+
+  /// Counts a sync as running for as long as it lives, so it's over even if
+  /// the sync throws
+  class Sync {
+  private:
+    LiveChanges &live;
+
+  public:
+    explicit Sync(LiveChanges &live) : live(live) { live.syncStarted(); }
+    /// For the startup sync, which is counted from the start
+    Sync(LiveChanges &live, std::adopt_lock_t) : live(live) {}
+    Sync(const Sync &) = delete;
+    ~Sync() { live.syncDone(); }
+  };
+};
+
+/// Uploads everything under one config entry's local_dir that's missing or
+/// out of date on the server. If 'tree' is given, it's used (and emptied)
+/// instead of walking the directory again; its files must have been stat'ed.
+/// Likewise 'listing', if it's given, is read instead of listing the
+/// container here. Files in 'live' are left alone
+void syncOneConfigEntry(yield_context yield, const Rackspace &rs,
+                        const ConfigEntry &config, WorkerManager &workers,
+                        LocalTree *tree = nullptr,
+                        const LiveChanges *live = nullptr,
+                        RemoteListing *listing = nullptr);
+
+/// Each config entry's container listing, started ahead of its sync
+using RemoteListings = std::map<const ConfigEntry *, RemoteListing>;
+
+/// Syncs every config entry at once, and returns when they're all done.
+/// 'trees' are the ones the watcher walked, and 'listings' the ones started
+/// as each account logged in. Entries whose accounts aren't logged in are
+/// skipped
 void syncAllDirectories(yield_context &yield, const AccountCache &rs,
-                        const Config &config, WorkerManager &workers);
+                        const Config &config, WorkerManager &workers,
+                        LocalTrees *trees = nullptr,
+                        const LiveChanges *live = nullptr,
+                        RemoteListings *listings = nullptr);
+/// The same, for just 'entries'
+void syncConfigEntries(yield_context &yield, const AccountCache &rs,
+                       const std::vector<const ConfigEntry *> &entries,
+                       WorkerManager &workers, LocalTrees *trees = nullptr,
+                       const LiveChanges *live = nullptr,
+                       RemoteListings *listings = nullptr);
 
 } /* processes */ 
 } /* cdnalizerd  */ 
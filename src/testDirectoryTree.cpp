@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "DirectoryTree.hpp"
+
+using cdnalizerd::DirectoryTree;
+
+int result = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    ++result;
+    std::cerr << "Failed: " << what << std::endl;
+  }
+}
+
+// The paths of 'top' and everything under it, sorted
+std::vector<std::string> pathsUnder(const DirectoryTree &tree,
+                                    const std::string &top) {
+  std::vector<std::string> result;
+  for (DirectoryTree::Node node : tree.under(tree.find(top)))
+    result.push_back(tree.path(node));
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+// What the tree thinks the path of 'path' is, or "none"
+std::string pathOf(const DirectoryTree &tree, const std::string &path) {
+  DirectoryTree::Node node = tree.find(path);
+  return (node == DirectoryTree::none) ? "none" : tree.path(node);
+}
+
+// Adds some directories, moves them about, and checks that everything under
+// them comes along, and nothing else does
+int main() {
+  DirectoryTree tree;
+  DirectoryTree::Node root = tree.add("/");
+  DirectoryTree::Node top = tree.add("/www/site");
+  DirectoryTree::Node images = tree.add("/www/site/images");
+  DirectoryTree::Node thumbs = tree.add("/www/site/images/thumbs");
+  DirectoryTree::Node other = tree.add("/www/other/images");
+  DirectoryTree::Node relative = tree.add("relative/dir");
+
+  check(pathOf(tree, "/") == "/", "the root is '/'");
+  check(pathOf(tree, "/www/site/images/thumbs") == "/www/site/images/thumbs",
+        "paths come back as they went in");
+  check(pathOf(tree, "//www/./site//images/") == "/www/site/images",
+        "doubled slashes, '.' and trailing slashes are skipped");
+  check(pathOf(tree, "relative/dir") == "relative/dir",
+        "relative paths stay relative");
+  check(pathOf(tree, "/relative/dir") == "none",
+        "relative paths aren't absolute ones");
+  check(pathOf(tree, "/www") == "none",
+        "parents nobody added aren't found");
+  check(tree.add("/www/site/images") == images,
+        "adding a path again gives the same node");
+  tree.remove(images);
+  check(tree.contains(top, thumbs) && tree.contains(thumbs, thumbs) &&
+            !tree.contains(thumbs, top) && !tree.contains(top, other) &&
+            tree.contains(root, other) && !tree.contains(root, relative),
+        "contains");
+  check(pathsUnder(tree, "/www/site") ==
+            std::vector<std::string>{"/www/site", "/www/site/images",
+                                     "/www/site/images/thumbs"},
+        "under finds everything in site, and nothing else");
+
+  // Moving a directory brings everything under it along
+  check(tree.move("/www/site/images", "/www/pictures"), "moving images");
+  check(pathOf(tree, "/www/pictures/thumbs") == "/www/pictures/thumbs",
+        "thumbs moved with images");
+  check((tree.find("/www/pictures") == images) &&
+            (tree.find("/www/pictures/thumbs") == thumbs),
+        "moved directories keep their nodes");
+  check(pathOf(tree, "/www/site/images") == "none",
+        "images isn't where it was");
+  check(pathOf(tree, "/www/other/images") == "/www/other/images",
+        "a directory with the same name elsewhere stays put");
+  check(!tree.contains(top, thumbs), "thumbs left site");
+  check(pathsUnder(tree, "/www/site") ==
+            std::vector<std::string>{"/www/site"},
+        "site has nothing under it");
+  check(pathsUnder(tree, "/www/pictures") ==
+            std::vector<std::string>{"/www/pictures",
+                                     "/www/pictures/thumbs"},
+        "under follows the move");
+
+  // Into a directory that doesn't exist yet, and back again
+  check(tree.move("/www/pictures", "/new/place/images"),
+        "moving to a new parent");
+  check(pathOf(tree, "/new/place/images/thumbs") ==
+            "/new/place/images/thumbs",
+        "the new parents are made");
+  check(tree.move("/new/place/images", "/www/site/images"), "moving back");
+  check(pathOf(tree, "/www/site/images/thumbs") == "/www/site/images/thumbs",
+        "thumbs is back");
+  check(tree.contains(top, thumbs), "thumbs is back in site");
+
+  // Moves that can't happen
+  check(!tree.move("/not/there", "/www/else"), "moving a missing directory");
+  check(!tree.move("/www/site/images", "/www/other/images"),
+        "moving onto a directory that's there");
+  check(pathOf(tree, "/www/site/images") == "/www/site/images",
+        "a failed move leaves things alone");
+  check(!tree.move("/", "/elsewhere"), "moving the root");
+
+  // Nodes go when nothing uses them, and their parents with them
+  std::size_t before = tree.size();
+  tree.remove(other);
+  check(tree.size() == before - 2, "removing other frees it and its parent");
+  tree.remove(thumbs);
+  check(pathOf(tree, "/www/site/images/thumbs") == "none",
+        "removed directories aren't found");
+  check(pathOf(tree, "/www/site/images") == "/www/site/images",
+        "but their parents are");
+  check(pathsUnder(tree, "/www/site/images") ==
+            std::vector<std::string>{"/www/site/images"},
+        "removed directories aren't under their parents");
+  check(tree.add("/www/a/b") != DirectoryTree::none, "nodes are reused");
+  check(pathOf(tree, "/www/a/b") == "/www/a/b", "reused nodes are right");
+
+  return result;
+}
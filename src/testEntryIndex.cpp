@@ -0,0 +1,98 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "EntryIndex.hpp"
+
+using namespace cdnalizerd;
+
+ConfigEntry entry(const std::string &container, const std::string &local_dir,
+                  bool poll = false) {
+  ConfigEntry result("user", "key", "DFW", container, false, false,
+                     local_dir, "remote", {}, {});
+  result.poll = poll;
+  return result;
+}
+
+// The containers of the entries 'path' is under, space separated
+std::string containers(const EntryIndex &index, const std::string &path) {
+  std::string result;
+  for (const ConfigEntry *entry : index.find(path))
+    result += (result.empty() ? "" : " ") + entry->container;
+  return result;
+}
+
+// Indexes some overlapping and nested entries, and checks which ones paths
+// are under
+int main() {
+  Config config;
+  config.addEntry(entry("site", "/www/site"));
+  // The same tree to a second container
+  config.addEntry(entry("backup", "/www/site/"));
+  config.addEntry(entry("images", "/www/site/images"));
+  config.addEntry(entry("other", "/www/other"));
+  config.addEntry(entry("polled", "/mnt/nfs", true));
+  config.addEntry(entry("polledInside", "/www/site/nfs", true));
+  ConfigEntry ignoring(entry("ignoring", "/srv"));
+  ignoring.addDirectoryToIgnore("/cache$");
+  config.addEntry(ignoring);
+  config.addEntry(entry("notIgnoring", "/srv/data"));
+  EntryIndex index(config);
+
+  // Entries in the same directory come in config order, which is by
+  // directory
+  std::string both("site backup");
+  std::vector<std::pair<std::string, std::string>> expected{
+      {"/www/site", both},
+      {"/www/site/", both},
+      {"/www/site/index.html", both},
+      {"/www/site/a/b/c", both},
+      {"/www/site/images", both + " images"},
+      {"/www/site/images/", both + " images"},
+      {"/www/site/images/x/y.jpg", both + " images"},
+      // Not in images, for all it starts the same
+      {"/www/site/imagesx", both},
+      {"/www/site/imagesx/y.jpg", both},
+      {"/www/sitex", ""},
+      {"/www/other/a", "other"},
+      {"/www", ""},
+      {"/", ""},
+      {"", ""},
+      {"relative/www/site", ""},
+      // Polled entries get no events
+      {"/mnt/nfs/a", ""},
+      {"/www/site/nfs/a", both},
+      {"/srv/data/x", "ignoring notIgnoring"}};
+  int result = 0;
+  for (const auto &check : expected) {
+    std::string got(containers(index, check.first));
+    if (got != check.second) {
+      ++result;
+      std::cerr << "For " << check.first << " --- expected: " << check.second
+                << " --- Got: " << got << std::endl;
+    }
+  }
+  if (&index.find("/nowhere") != &EntryIndex::none) {
+    ++result;
+    std::cerr << "Paths under no entry should get 'none'" << std::endl;
+  }
+  if (&index.find("/www/site/a") != &index.find("/www/site/b/c")) {
+    ++result;
+    std::cerr << "Paths in one entry should share its set" << std::endl;
+  }
+
+  // A directory is only ignored if every entry it's under ignores it
+  std::vector<std::pair<std::string, bool>> ignored{
+      {"/srv/cache", true},
+      {"/srv/data/cache", false},
+      {"/srv/other", false},
+      {"/www/site/cache", false},
+      {"/nowhere/cache", true}};
+  for (const auto &check : ignored)
+    if (index.ignored(check.first) != check.second) {
+      ++result;
+      std::cerr << check.first << " should"
+                << (check.second ? "" : "n't") << " be ignored" << std::endl;
+    }
+  return result;
+}
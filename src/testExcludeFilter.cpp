@@ -1,7 +1,10 @@
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <random>
+#include <regex>
 #include <string>
 #include <vector>
 
@@ -28,9 +31,87 @@ std::map<std::string, std::vector<std::string>> regexToExpected{
     {"^f.n", {"funtastic", "fantastic"}}
 };
 
+// Times the compiled matcher against running each std::regex in turn, as we
+// used to, over 'count' made up paths, with the sample config's patterns
+int bench(int count) {
+  std::vector<std::string> files{".*php$", ".*conf.*xml$", ".*conf.*ini$",
+                                 ".*tmp$"};
+  std::vector<std::string> directories{"/conf/", "/config/", "/settings/",
+                                       "/tmp/"};
+  cdnalizerd::ConfigEntry e;
+  std::vector<std::regex> regexes;
+  for (const std::string &file : files) {
+    e.addFileToIgnore(file);
+    regexes.emplace_back(file);
+  }
+  for (const std::string &directory : directories) {
+    e.addDirectoryToIgnore(directory);
+    regexes.emplace_back(directory);
+  }
+
+  // A few directories, each with a run of files in it, as a tree walk sees
+  std::vector<std::string> parts{"var",  "www",      "html",   "site",
+                                 "conf", "settings", "images", "tmp",
+                                 "css",  "config2",  "a b",    "uploads"};
+  std::vector<std::string> extensions{".jpg", ".php", ".xml", ".ini",
+                                      ".tmp", ".css", ".js",  ".html"};
+  std::mt19937 random(42);
+  std::vector<std::string> paths;
+  while (paths.size() < std::size_t(count)) {
+    std::string directory;
+    for (int depth = 2 + random() % 5; depth != 0; --depth)
+      directory += "/" + parts[random() % parts.size()];
+    for (int i = random() % 20; (i != 0) && (paths.size() < std::size_t(count));
+         --i)
+      paths.push_back(directory + "/file" + std::to_string(random() % 1000) +
+                      extensions[random() % extensions.size()]);
+  }
+
+  using Clock = std::chrono::steady_clock;
+  std::vector<bool> old;
+  Clock::time_point start = Clock::now();
+  for (const std::string &path : paths) {
+    bool ignored = false;
+    for (const std::regex &regex : regexes)
+      if (std::regex_search(path, regex)) {
+        ignored = true;
+        break;
+      }
+    old.push_back(ignored);
+  }
+  Clock::time_point middle = Clock::now();
+  std::vector<bool> compiled;
+  for (const std::string &path : paths)
+    compiled.push_back(e.shouldIgnoreFile(path));
+  Clock::time_point end = Clock::now();
+
+  int result = 0;
+  for (std::size_t i = 0; i != paths.size(); ++i)
+    if (old[i] != compiled[i]) {
+      ++result;
+      std::cerr << "Disagree on " << paths[i] << ": std::regex says "
+                << old[i] << std::endl;
+    }
+  auto perPath = [&paths](Clock::duration took) {
+    return std::chrono::duration<double, std::nano>(took).count() /
+           paths.size();
+  };
+  std::cout << paths.size() << " paths, "
+            << std::count(old.begin(), old.end(), true) << " ignored"
+            << std::endl
+            << "  std::regex: " << perPath(middle - start) << "ns a path"
+            << std::endl
+            << "  compiled:   " << perPath(end - middle) << "ns a path"
+            << std::endl;
+  return result;
+}
+
 // Reads a bunch of regexes from the command line, then uses them to grep
-// std::in to std::out, removing files that match
+// std::in to std::out, removing files that match. Or with --bench [count],
+// times the matcher
 int main(int argc, char *argv[]) {
+  if ((argc > 1) && (std::string(argv[1]) == "--bench"))
+    return bench((argc > 2) ? std::stoi(argv[2]) : 100000);
   if (argc == 1) {
     std::cout << "List regexes to test in the command line. Options are: ";
     for (const auto pair : regexToExpected)
@@ -44,7 +125,7 @@ int main(int argc, char *argv[]) {
   std::vector<std::string> toCheck(argv, argv + argc);
   for (auto i = toCheck.begin() + 1; i < toCheck.end(); ++i) {
     const std::string &regex(*i);
-      e.filesToIgnore.emplace_back(std::regex(regex));
+      e.addFileToIgnore(regex);
       std::vector<std::string> output;
       for (const std::string &line : input)
         if (e.shouldIgnoreFile(line))
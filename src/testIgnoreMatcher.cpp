@@ -0,0 +1,144 @@
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "config/ignore_matcher.hpp"
+
+// Checks IgnoreMatcher against std::regex_search, which it stands in for,
+// over a spread of patterns and paths. Each pattern is checked alone and
+// with all the others at once, as the DFA for a set of patterns is built
+// differently to one for a single pattern
+
+std::vector<std::string> patterns{
+    // Anchors
+    "^abc", "abc$", "^abc$", "^/tmp/", "\\.tmp$", "^$", "a^b", "a$b",
+    "(^|/)\\.git(/|$)",
+    // Alternation and groups
+    "php|ini", "^(conf|config)/", "(a|b)c", "x(?:yz|zy)", "a|", "(|a)b",
+    "/(cache|tmp|log)s?/", "\\.(jpe?g|png|gif)$",
+    // Bracket classes
+    "[abc]", "[^abc]", "[a-c]x", "[^/]+\\.bak$", "[-a]z", "[a-]z", "[.]",
+    "[\\]]", "[\\d_]x", "[^\\w/]", "[\\s]", "^[^.]*$",
+    // Repeats
+    "a*", "ab*c", "ab+c", "ab?c", "a{2}", "a{2,}", "a{1,3}b", "(ab){2}",
+    "x.*y.*z", ".*conf.*xml$", "a+?b", "(a|b)*c", "[0-9]{3,4}$", "a{0}b",
+    // Character escapes
+    "\\d", "\\d\\d/", "\\D+$", "\\w+\\.\\w+$", "\\W", "\\s", "\\S\\s\\S",
+    "\\.", "\\*", "\\+", "\\?", "\\(", "\\)", "\\[", "\\{", "\\|", "\\\\",
+    "\\/", "\\^", "\\$", "\\x41", "\\t",
+    // Left to std::regex
+    "\\bfile\\b", "(a)\\1", "a(?=b)", "[[:digit:]]"};
+
+std::vector<std::string> paths{
+    "",
+    "abc",
+    "/abc",
+    "abc/",
+    "/some/dir/with/abc",
+    "/tmp/file.tmp",
+    "/var/tmp/x",
+    "tmp",
+    "/a/b/c/d",
+    "/www/index.php",
+    "/www/php.ini",
+    "conf/site.xml",
+    "config/site.xml",
+    "/etc/conf/x.ini",
+    "/repo/.git/HEAD",
+    "/repo/.gitignore",
+    ".git",
+    "/caches/x",
+    "/logs/today",
+    "/log/today",
+    "/img/a.jpg",
+    "/img/b.jpeg",
+    "/img/c.PNG",
+    "/img/d.gif.bak",
+    "a-z",
+    "-z",
+    "xyz xzy",
+    "aab",
+    "aaab",
+    "aaaab",
+    "abab",
+    "ac bc cc",
+    "abbbc",
+    "2024/01/05",
+    "/file 123",
+    "/file\t1",
+    "A",
+    "a]b",
+    "a*b+c?d",
+    "(x)[y]{z}|",
+    "back\\slash",
+    "1$2^3",
+    "/x/file",
+    "/x/files",
+    "/x/a_file.b",
+    "no extension",
+    "\xc3\xa9t\xc3\xa9.txt"};
+
+// Paths made from the bytes the patterns care about, so the odd corners get
+// looked at too
+std::vector<std::string> randomPaths(std::size_t count) {
+  const std::string bytes("abcxyz/._-01 \tAZ*$^[]()\\");
+  std::vector<std::string> result;
+  std::mt19937 random(7);
+  while (result.size() < count) {
+    std::string path;
+    for (int length = random() % 12; length != 0; --length)
+      path += bytes[random() % bytes.size()];
+    result.push_back(path);
+  }
+  return result;
+}
+
+// Checks 'matcher' says the same as 'regexes' do for every path, returning
+// how many it got wrong
+int check(const cdnalizerd::IgnoreMatcher &matcher,
+          const std::vector<std::regex> &regexes, const std::string &what) {
+  int result = 0;
+  auto compare = [&](const std::string &path) {
+    bool expected = false;
+    for (const std::regex &regex : regexes)
+      expected = expected || std::regex_search(path, regex);
+    if (matcher.search(path) != expected) {
+      ++result;
+      std::cerr << what << " disagrees with std::regex on \"" << path
+                << "\": std::regex says " << expected << std::endl;
+    }
+  };
+  for (const std::string &path : paths)
+    compare(path);
+  for (const std::string &path : randomPaths(2000))
+    compare(path);
+  return result;
+}
+
+int main() {
+  int result = 0;
+  cdnalizerd::IgnoreMatcher all;
+  std::vector<std::regex> allRegexes;
+  for (const std::string &pattern : patterns) {
+    cdnalizerd::IgnoreMatcher one;
+    one.add(pattern);
+    all.add(pattern);
+    std::regex regex(pattern);
+    allRegexes.push_back(regex);
+    result += check(one, {regex}, "\"" + pattern + "\"");
+  }
+  result += check(all, allRegexes, "All the patterns");
+  // A bad pattern is turned away the same way std::regex would
+  try {
+    cdnalizerd::IgnoreMatcher bad;
+    bad.add("a(b");
+    ++result;
+    std::cerr << "\"a(b\" was accepted" << std::endl;
+  } catch (std::regex_error &) {
+  }
+  std::cout << patterns.size() << " patterns checked, " << result
+            << " disagreements" << std::endl;
+  return result != 0;
+}
@@ -0,0 +1,97 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include "https.hpp"
+#include "logging.hpp"
+#include "processes/moves.hpp"
+
+using namespace cdnalizerd;
+using processes::MoveHalf;
+using processes::MovePairer;
+
+MoveHalf half(const std::string &path) {
+  return {&EntryIndex::none, path, false};
+}
+
+// Sends renames' halves in every order, and some without partners, and
+// checks what they're paired up into
+int main() {
+  init_logging(WARNING);
+  asio::io_service ios;
+  service(&ios);
+  std::vector<std::string> got;
+  MovePairer moves(
+      [&got](yield_context, const MoveHalf &from, const MoveHalf &to) {
+        got.push_back("moved " + from.path + " to " + to.path);
+      },
+      [&got](yield_context, const MoveHalf &from) {
+        got.push_back("moved out " + from.path);
+      },
+      [&got](yield_context, const MoveHalf &to) {
+        got.push_back("moved in " + to.path);
+      });
+  bool idleBefore = false;
+  auto start = std::chrono::steady_clock::now();
+  asio::spawn(ios, [&](yield_context yield) {
+    // Both halves, in order
+    moves.movedFrom(yield, 1, half("/a"));
+    moves.movedTo(yield, 1, half("/b"));
+    // The other way round, as can happen on different inotify handles
+    moves.movedTo(yield, 2, half("/d"));
+    moves.movedFrom(yield, 2, half("/c"));
+    // Halves without a cookie can't be paired
+    moves.movedFrom(yield, 0, half("/e"));
+    moves.movedTo(yield, 0, half("/f"));
+    // Interleaved, and some that never get partners
+    moves.movedFrom(yield, 3, half("/g"));
+    moves.movedFrom(yield, 4, half("/h"));
+    moves.movedTo(yield, 5, half("/i"));
+    moves.movedTo(yield, 3, half("/j"));
+    // Two halves the same way with one cookie aren't a pair
+    moves.movedTo(yield, 6, half("/k"));
+    moves.movedTo(yield, 6, half("/l"));
+    // A partner that turns up a little late still counts
+    moves.movedFrom(yield, 7, half("/m"));
+    asio::deadline_timer timer(ios);
+    timer.expires_from_now(boost::posix_time::milliseconds(100));
+    timer.async_wait(yield);
+    moves.movedTo(yield, 7, half("/n"));
+    idleBefore = moves.idle();
+  });
+  ios.run();
+  double took = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  std::vector<std::string> expected{
+      "moved /a to /b",      "moved /c to /d",  "moved out /e",
+      "moved in /f",         "moved /g to /j",  "moved /m to /n",
+      "moved out /h",        "moved in /i",     "moved in /k",
+      "moved in /l"};
+  int result = 0;
+  if (got != expected) {
+    ++result;
+    std::cerr << "--- expected: \n";
+    for (const std::string &line : expected)
+      std::cerr << line << std::endl;
+    std::cerr << "\n --- Got: \n";
+    for (const std::string &line : got)
+      std::cerr << line << std::endl;
+  }
+  if (idleBefore || !moves.idle()) {
+    ++result;
+    std::cerr << "Should only be idle once the lone halves are dealt with"
+              << std::endl;
+  }
+  // The lone halves wait for their partners for a while, but not forever
+  if ((took < 0.4) || (took > 5)) {
+    ++result;
+    std::cerr << "Lone halves took " << took << "s to expire" << std::endl;
+  }
+  return result;
+}
@@ -0,0 +1,66 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "jobs/md5.hpp"
+#include "jobs/multiMD5.hpp"
+
+using namespace cdnalizerd::jobs;
+namespace fs = boost::filesystem;
+
+// File sizes either side of md5's block and padding boundaries, and of the
+// chunks files are read in
+std::vector<size_t> sizes{0,      1,      55,     56,   57,   63,    64,
+                          65,     119,    120,    127,  128,  129,   1000,
+                          4096,   65535,  3,      200,  511,  9999,  777,
+                          12345,  100000, 64,     262143, 262144, 262145,
+                          262200, 600000};
+
+// Writes some files of known sizes, then checks that every md5 engine this CPU
+// supports agrees with openssl
+int main() {
+  fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  std::vector<fs::path> paths;
+  std::vector<std::string> expected;
+  unsigned int seed = 1;
+  for (size_t i = 0; i != sizes.size(); ++i) {
+    fs::path path = dir / std::to_string(i);
+    std::ofstream out(path.native(), std::ios::binary);
+    for (size_t j = 0; j != sizes[i]; ++j) {
+      seed = seed * 1103515245 + 12345;
+      out.put(static_cast<char>(seed >> 16));
+    }
+    out.close();
+    paths.push_back(path);
+    expected.push_back(md5_from_file(path));
+  }
+  // A file that's gone should just come back empty
+  paths.push_back(dir / "missing");
+  expected.push_back("");
+
+  int result = 0;
+  for (MD5Engine engine :
+       {MD5Engine::scalar, MD5Engine::avx2, MD5Engine::avx512}) {
+    if (!md5EngineSupported(engine)) {
+      std::cout << "Skipping unsupported engine: " << md5EngineName(engine)
+                << std::endl;
+      continue;
+    }
+    std::vector<std::string> got = md5_from_files(paths, engine);
+    for (size_t i = 0; i != paths.size(); ++i) {
+      if (got[i] != expected[i]) {
+        ++result;
+        std::cerr << md5EngineName(engine) << ": " << paths[i].native()
+                  << " --- expected: " << expected[i] << " --- Got: " << got[i]
+                  << std::endl;
+      }
+    }
+  }
+  fs::remove_all(dir);
+  return result;
+}
@@ -0,0 +1,39 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "url.hpp"
+
+using namespace cdnalizerd;
+
+std::vector<std::string> bases{"https://storage.example.com/v1/acct/container",
+                               "https://storage.example.com/v1/acct/container/",
+                               "https://storage.example.com:8443/v1/a",
+                               "https://storage.example.com/",
+                               "https://storage.example.com"};
+
+std::vector<std::string> names{"file.txt",  "/file.txt",  "dir/",
+                               "a/b/c.jpg", "with space", "100%+&=?#",
+                               "\xc3\xa9t\xc3\xa9"};
+
+// Checks that URL::child gives the same URL as joining with operator/ and
+// parsing the lot again
+int main() {
+  int result = 0;
+  for (const std::string &base : bases)
+    for (const std::string &name : names) {
+      URL parent(base);
+      URL expected(parent / name);
+      URL got(parent.child(name));
+      if ((got.whole() != expected.whole()) || (got.path != expected.path) ||
+          (got.pathAndSearch != expected.pathAndSearch) ||
+          (got.host != expected.host) || (got.port != expected.port)) {
+        ++result;
+        std::cerr << base << " child " << name
+                  << " --- expected: " << expected.whole() << " ("
+                  << expected.path << ") --- Got: " << got.whole() << " ("
+                  << got.path << ")" << std::endl;
+      }
+    }
+  return result;
+}
@@ -33,10 +33,35 @@ std::string joinSlashes(std::vector<std::string>& strings) {
 
 URL::URL(UnParsedURL in) : raw(joinSlashes(in.parts)) { parse(); }
 
+URL URL::child(boost::string_view name) const {
+  // Like joinSlashes, we drop one '/' from each end
+  if (!name.empty() && (name.front() == '/'))
+    name.remove_prefix(1);
+  if (!name.empty() && (name.back() == '/'))
+    name.remove_suffix(1);
+  URL result(*this);
+  if (name.empty())
+    return result;
+  if (result.path.empty() || (result.path.back() != '/'))
+    result.path.push_back('/');
+  std::size_t nameStart = result.path.size();
+  urlencode(name, result.path);
+  if (result.raw.back() != '/')
+    result.raw.push_back('/');
+  result.raw.append(result.path, nameStart, std::string::npos);
+  result.pathAndSearch = result.path + result.search;
+  return result;
+}
+
 /// Takes a filename or path and url encodes it
 std::string urlencode(const std::string &path) {
   std::string result;
   result.reserve(path.size() * 1.05); // Estamite 5% growth
+  urlencode(path, result);
+  return result;
+}
+
+void urlencode(boost::string_view path, std::string &result) {
   auto out = std::back_inserter(result);
   for (unsigned char in : path) {
     // Legal statements - a-z A-Z 0-9 . - _ ~ ! $ & ' ( ) * + , ; = : @
@@ -93,7 +118,6 @@ std::string urlencode(const std::string &path) {
       };
     }
   }
-  return result;
 }
 
 } /* cdnalizerd */ 
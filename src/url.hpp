@@ -3,6 +3,8 @@
 #include "exception_tags.hpp"
 #include "logging.hpp"
 
+#include <boost/utility/string_view.hpp>
+
 #include <string>
 #include <vector>
 
@@ -44,10 +46,15 @@ public:
       return scheme + host + ':' + port;
   }
   const std::string &whole() const { return raw; }
+  /// This URL with 'name' url encoded and joined on the end, as operator/
+  /// does, but without parsing the lot again. Only for URLs without a search
+  URL child(boost::string_view name) const;
 };
 
 /// Takes a filename or path and url encodes it
 std::string urlencode(const std::string &path);
+/// Url encodes 'path' onto the end of 'out'
+void urlencode(boost::string_view path, std::string &out);
 
 inline UnParsedURL operator/(UnParsedURL url, std::string s) {
   return UnParsedURL(std::move(url), urlencode(s));